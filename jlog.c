@@ -96,13 +96,51 @@
 #if HAVE_SYS_MMAN_H
 #include <sys/mman.h>
 #endif
+#if HAVE_POLL_H
+#include <poll.h>
+#endif
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#if HAVE_LINUX_FUTEX_H && HAVE_SYS_SYSCALL_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#define JLOG_USE_FUTEX 1
+#endif
 
 #include "fassert.h"
 #include <pthread.h>
+#include <signal.h>
 
 #define BUFFERED_INDICES 1024
 #define PRE_COMMIT_BUFFER_SIZE_DEFAULT 0
+#define READAHEAD_THRESHOLD(limit) ((limit) - ((limit) >> 2))
+                         /* prefetch the next segment 3/4 of the way in */
+#define DONTNEED_CHUNK (1024*1024)
+#define WAIT_SLICE_SEC 1         /* longest single futex sleep in jlog_ctx_wait */
+#define CLOCK_BATCH_USES 256     /* messages stamped with one batch reading */
+#define CLOCK_BATCH_NSEC 10000000ULL  /* and for at most 10ms of them */
 #define IS_COMPRESS_MAGIC(ctx) (((ctx)->meta->hdr_magic & DEFAULT_HDR_MAGIC_COMPRESSION) == DEFAULT_HDR_MAGIC_COMPRESSION)
+#define CPTABLE_SLOT(ctx, i) \
+  (((jlog_cptable_slot *)((char *)(ctx)->cptable + sizeof(jlog_cptable_header))) + (i))
+#define CPTABLE_NSLOTS(ctx) (((jlog_cptable_header *)(ctx)->cptable)->nslots)
+#define IS_COMPACT_HEADERS(ctx) \
+  ((ctx)->meta->format_flags & JLOG_FORMAT_COMPACT_HEADERS)
+/* tv_usec units per second */
+#define TIME_UNITS(ctx) (((ctx)->meta->format_flags & JLOG_FORMAT_NSEC_TIME) ? \
+                         1000000000ULL : 1000000ULL)
+/* fixed-size records are found by arithmetic on the marker, so such
+ * a jlog keeps no index files */
+#define IS_FIXED_RECORDS(ctx) ((ctx)->meta->record_size != 0)
+#define FIXED_STRIDE(ctx) \
+  ((u_int64_t)sizeof(jlog_message_header) + (ctx)->meta->record_size)
+/* records per .idx entry */
+#define INDEX_INTERVAL(ctx) \
+  ((ctx)->meta->index_interval > 1 ? (ctx)->meta->index_interval : 1)
+#define IS_SPARSE_INDEX(ctx) (INDEX_INTERVAL(ctx) > 1)
+#define WANT_DECOMPRESS(ctx) (IS_COMPRESS_MAGIC(ctx) && \
+                              !((ctx)->read_flags & JLOG_READ_NO_DECOMPRESS))
 
 
 static jlog_file *__jlog_open_writer(jlog_ctx *ctx);
@@ -110,6 +148,17 @@ static int __jlog_close_writer(jlog_ctx *ctx);
 static jlog_file *__jlog_open_reader(jlog_ctx *ctx, u_int32_t log);
 static int __jlog_close_reader(jlog_ctx *ctx);
 static int __jlog_close_checkpoint(jlog_ctx *ctx);
+static int __jlog_close_lease(jlog_ctx *ctx);
+static void __jlog_group_release(jlog_ctx *ctx);
+static void __jlog_wait_reset(jlog_ctx *ctx);
+static int __jlog_use_cptable(jlog_ctx *ctx);
+static jlog_cptable_slot *__jlog_cptable_find(jlog_ctx *ctx, const char *s);
+static void __jlog_cptable_read(jlog_cptable_slot *slot, jlog_id *id);
+static int __jlog_cptable_write(jlog_ctx *ctx, jlog_cptable_slot *slot, const jlog_id *id);
+static int __jlog_prefetch_take(jlog_ctx *ctx, const jlog_id *id, jlog_message *m);
+static void __jlog_prefetch_stop(jlog_ctx *ctx);
+static int __jlog_reclaim_queue(jlog_ctx *ctx, u_int32_t log);
+static void __jlog_reclaim_stop(jlog_ctx *ctx);
 static jlog_file *__jlog_open_indexer(jlog_ctx *ctx, u_int32_t log);
 static int __jlog_close_indexer(jlog_ctx *ctx);
 static int __jlog_resync_index(jlog_ctx *ctx, u_int32_t log, jlog_id *last, int *c);
@@ -117,21 +166,325 @@ static jlog_file *__jlog_open_named_checkpoint(jlog_ctx *ctx, const char *cpname
 static int __jlog_mmap_reader(jlog_ctx *ctx, u_int32_t log);
 static int __jlog_munmap_reader(jlog_ctx *ctx);
 static int __jlog_metastore_atomic_increment(jlog_ctx *ctx);
+static void __jlog_retain_if_due(jlog_ctx *ctx);
+static int __jlog_save_metastore(jlog_ctx *ctx, int ilocked);
+static int __jlog_scan_checkpoints(jlog_ctx *ctx, u_int32_t log, jlog_id *earliest);
+static void __jlog_drop_consumed(jlog_ctx *ctx, const jlog_id *id);
+static void __jlog_note_first_log(jlog_ctx *ctx, u_int32_t log);
+static void __jlog_release_closed(jlog_ctx *ctx);
+static jlog_closed_segment *__jlog_find_closed(jlog_ctx *ctx, u_int32_t log);
+static int __jlog_segment_exists(jlog_ctx *ctx, u_int32_t log);
+static void __jlog_unmap_closed(jlog_closed_segment *seg);
+static int __jlog_read_closed(jlog_ctx *ctx, const jlog_id *id, int count, jlog_message *m);
+static void __jlog_unlink_tag_indexes(jlog_ctx *ctx, u_int32_t log);
+static int __jlog_load_tag_filter(jlog_ctx *ctx);
 
 int jlog_snprint_logid(char *b, int n, const jlog_id *id) {
   return snprintf(b, n, "%08x:%08x", id->log, id->marker);
 }
 
-int jlog_repair_datafile(jlog_ctx *ctx, u_int32_t log)
-{
+static size_t __jlog_varint_len(u_int64_t v) {
+  size_t n = 1;
+  while(v >= 0x80) { v >>= 7; n++; }
+  return n;
+}
+
+static size_t __jlog_varint_put(u_int8_t *p, u_int64_t v) {
+  size_t n = 0;
+  while(v >= 0x80) {
+    p[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+/* @return bytes consumed, 0 if truncated or overlong */
+static size_t __jlog_varint_get(const u_int8_t *p, size_t avail, u_int64_t *v) {
+  size_t n;
+  *v = 0;
+  for(n = 0; n < avail && n < 10; n++) {
+    *v |= (u_int64_t)(p[n] & 0x7f) << (7 * n);
+    if(!(p[n] & 0x80)) return n + 1;
+  }
+  return 0;
+}
+
+/* a v3 header's check byte over its first n bytes */
+static u_int8_t __jlog_v3_check(const u_int8_t *p, size_t n) {
+  u_int8_t c = 0x5a;
+  while(n--) c = (u_int8_t)((c << 1) | (c >> 7)) ^ *p++;
+  return c;
+}
+
+/* encodes hdr as a v3 header in p, with topic tag tag unless it is 0;
+ * the time is written as a delta from base when there is one and that
+ * is shorter */
+static size_t __jlog_v3_encode(jlog_ctx *ctx, u_int8_t *p,
+                               const jlog_message_header_compressed *hdr,
+                               u_int8_t tag, int have_base, u_int64_t base) {
+  u_int64_t t = (u_int64_t)hdr->tv_sec * TIME_UNITS(ctx) + hdr->tv_usec;
+  int64_t delta = (int64_t)(t - base);
+  u_int64_t zz = ((u_int64_t)delta << 1) ^ (u_int64_t)(delta >> 63);
+  size_t n = 1;
+
+  p[0] = JLOG_V3_TAG;
+  if(tag) {
+    p[0] |= JLOG_V3_TAGGED;
+    p[n++] = tag;
+  }
+  if(have_base && __jlog_varint_len(zz) < __jlog_varint_len(t)) {
+    n += __jlog_varint_put(p + n, zz);
+  } else {
+    p[0] |= JLOG_V3_ABSTIME;
+    n += __jlog_varint_put(p + n, t);
+  }
+  n += __jlog_varint_put(p + n, hdr->mlen);
+  if(IS_COMPRESS_MAGIC(ctx))
+    n += __jlog_varint_put(p + n, hdr->compressed_len);
+  p[n] = __jlog_v3_check(p, n);
+  return n + 1;
+}
+
+/* tag gets the record's topic tag, 0 if it has none
+ * @return the v3 header length, 0 if p does not hold a valid one */
+static size_t __jlog_v3_parse(const u_int8_t *p, size_t avail, int compressed,
+                              u_int8_t *flags, u_int8_t *tag, u_int64_t *t,
+                              u_int32_t *mlen, u_int32_t *clen) {
+  u_int64_t v;
+  size_t n = 1, l;
+
+  if(avail < 1 || (p[0] & JLOG_V3_TAG_MASK) != JLOG_V3_TAG ||
+     (p[0] & ~JLOG_V3_TAG_MASK & ~JLOG_V3_FLAGS))
+    return 0;
+  *flags = p[0] & ~JLOG_V3_TAG_MASK;
+  *tag = 0;
+  if(*flags & JLOG_V3_TAGGED) {
+    if(avail < 2 || !p[1]) return 0;
+    *tag = p[n++];
+  }
+  if(!(l = __jlog_varint_get(p + n, avail - n, t))) return 0;
+  n += l;
+  if(!(l = __jlog_varint_get(p + n, avail - n, &v)) || v > 0xffffffffULL)
+    return 0;
+  n += l;
+  *mlen = *clen = v;
+  if(compressed) {
+    if(!(l = __jlog_varint_get(p + n, avail - n, &v)) || v > 0xffffffffULL)
+      return 0;
+    n += l;
+    *clen = v;
+  }
+  if(n >= avail || p[n] != __jlog_v3_check(p, n)) return 0;
+  return n + 1;
+}
+
+/* the absolute time of a segment's first record, which v3 delta times
+ * are relative to */
+static int __jlog_segment_base(jlog_ctx *ctx, u_int32_t log, u_int64_t *base) {
+  u_int8_t buf[JLOG_V3_MAX_HDR];
+  const u_int8_t *p = buf;
+  size_t avail = 0;
+  jlog_closed_segment *seg;
+  jlog_file *f = NULL;
+  u_int32_t mlen, clen;
+  u_int8_t flags, tag;
+  off_t len;
+
+  if(ctx->seg_base_valid && ctx->seg_base_log == log) {
+    *base = ctx->seg_base;
+    return 0;
+  }
+  if((seg = __jlog_find_closed(ctx, log)) != NULL) {
+    p = seg->data_base;
+    avail = seg->data_len;
+  }
+  else if(ctx->data && ctx->current_log == log && ctx->mmap_base) {
+    p = ctx->mmap_base;
+    avail = ctx->mmap_len;
+  }
+  else {
+    char file[MAXPATHLEN] = {0};
+    if(ctx->data && ctx->current_log == log) f = ctx->data;
+    else {
+      STRSETDATAFILE(ctx, file, log);
+      f = jlog_file_open(file, 0, ctx->file_mode, ctx->multi_process);
+      if(!f) return -1;
+    }
+    if((len = jlog_file_size(f)) > 0) {
+      avail = len < sizeof(buf) ? len : sizeof(buf);
+      if(!jlog_file_pread(f, buf, avail, 0)) avail = 0;
+    }
+    if(f != ctx->data) jlog_file_close(f);
+  }
+  if(!__jlog_v3_parse(p, avail, IS_COMPRESS_MAGIC(ctx), &flags, &tag, base,
+                      &mlen, &clen) || !(flags & JLOG_V3_ABSTIME))
+    return -1;
+  ctx->seg_base_log = log;
+  ctx->seg_base = *base;
+  ctx->seg_base_valid = 1;
+  return 0;
+}
+
+/* reads the record header at p, in whichever format this jlog uses, into
+ * hdr; disk_len gets the length of the payload that follows and tag, if
+ * not NULL, the record's topic tag.  Delta times are only resolved when
+ * want_time is set.
+ * @return the header length, 0 if p does not hold a valid header */
+static size_t __jlog_parse_header(jlog_ctx *ctx, u_int32_t log, const void *p,
+                                  size_t avail, int want_time,
+                                  jlog_message_header_compressed *hdr,
+                                  u_int32_t *disk_len, u_int8_t *tag) {
+  size_t hdr_size;
+  u_int64_t t, base;
+  u_int8_t flags, t8;
+
+  if(!tag) tag = &t8;
+  *tag = 0;
+  if(!IS_COMPACT_HEADERS(ctx)) {
+    hdr_size = IS_COMPRESS_MAGIC(ctx) ? sizeof(jlog_message_header_compressed)
+                                      : sizeof(jlog_message_header);
+    if(avail < hdr_size) return 0;
+    memcpy(hdr, p, hdr_size);
+    if(hdr->reserved != ctx->meta->hdr_magic) return 0;
+    *disk_len = IS_COMPRESS_MAGIC(ctx) ? hdr->compressed_len : hdr->mlen;
+    return hdr_size;
+  }
+
+  if(!(hdr_size = __jlog_v3_parse(p, avail, IS_COMPRESS_MAGIC(ctx), &flags,
+                                  tag, &t, &hdr->mlen, &hdr->compressed_len)))
+    return 0;
+  hdr->reserved = ctx->meta->hdr_magic;
+  *disk_len = hdr->compressed_len;
+  if(!(flags & JLOG_V3_ABSTIME)) {
+    if(!want_time) t = 0;
+    else if(__jlog_segment_base(ctx, log, &base) != 0) return 0;
+    else t = base + (u_int64_t)((t >> 1) ^ -(t & 1));
+  }
+  hdr->tv_sec = t / TIME_UNITS(ctx);
+  hdr->tv_usec = t % TIME_UNITS(ctx);
+  return hdr_size;
+}
+
+/* the length of the whole record at p, header and payload, if a valid
+ * header starts there and the record fits before end; 0 otherwise */
+static size_t __jlog_record_span(jlog_ctx *ctx, u_int32_t log,
+                                 const char *p, const char *end) {
   jlog_message_header_compressed hdr;
-  size_t hdr_size = sizeof(jlog_message_header);
-  uint32_t *message_disk_len = &hdr.mlen;
-  if (IS_COMPRESS_MAGIC(ctx)) {
-    hdr_size = sizeof(jlog_message_header_compressed);
-    message_disk_len = &hdr.compressed_len;
+  u_int32_t disk_len;
+  size_t hdr_size;
+
+  if (p >= end) return 0;
+  hdr_size = __jlog_parse_header(ctx, log, p, end - p, 0, &hdr, &disk_len,
+                                 NULL);
+  if (!hdr_size || (size_t)(end - p) - hdr_size < disk_len) return 0;
+  return hdr_size + disk_len;
+}
+
+/* re-encodes the v3 records in [in, in + len) against base, or against
+ * their own first record when have_base is clear; old_base resolves the
+ * delta times they carry now.  out may be NULL to find the length.
+ * @return the length of the records as re-encoded, -1 if invalid */
+static ssize_t __jlog_v3_reencode(jlog_ctx *ctx, const u_int8_t *in, size_t len,
+                                  u_int64_t old_base, int have_base,
+                                  u_int64_t base, u_int8_t *out) {
+  const u_int8_t *end = in + len;
+  u_int8_t scratch[JLOG_V3_MAX_HDR];
+  jlog_message_header_compressed hdr;
+  size_t n, olen = 0;
+  u_int64_t t;
+  u_int8_t flags, tag;
+
+  while(in < end) {
+    if(!(n = __jlog_v3_parse(in, end - in, IS_COMPRESS_MAGIC(ctx), &flags,
+                             &tag, &t, &hdr.mlen, &hdr.compressed_len)) ||
+       (size_t)(end - in) - n < hdr.compressed_len)
+      return -1;
+    if(!(flags & JLOG_V3_ABSTIME))
+      t = old_base + (u_int64_t)((t >> 1) ^ -(t & 1));
+    hdr.tv_sec = t / TIME_UNITS(ctx);
+    hdr.tv_usec = t % TIME_UNITS(ctx);
+    olen += __jlog_v3_encode(ctx, out ? out + olen : scratch, &hdr, tag,
+                             have_base, base);
+    if(out) memcpy(out + olen, in + n, hdr.compressed_len);
+    olen += hdr.compressed_len;
+    in += n + hdr.compressed_len;
+    if(!have_base) {
+      base = t;
+      have_base = 1;
+    }
   }
+  return olen;
+}
+
+/* repair cut away the first record of a compact segment, which the
+ * others' times are deltas from; re-encode the segment against its new
+ * first record, given the time of the one that went */
+static int __jlog_v3_reanchor(jlog_ctx *ctx, u_int64_t old_base) {
+  u_int8_t *in = NULL, *out = NULL;
+  u_int32_t mlen, clen;
+  u_int8_t flags, tag;
+  u_int64_t t;
+  ssize_t olen;
+  off_t len;
+  int rv = -1;
+
+  if((len = jlog_file_size(ctx->data)) <= 0) return len;
+  if((in = malloc(len)) == NULL || !jlog_file_pread(ctx->data, in, len, 0))
+    goto out;
+  if(!__jlog_v3_parse(in, len, IS_COMPRESS_MAGIC(ctx), &flags, &tag, &t,
+                      &mlen, &clen))
+    goto out;
+  if(flags & JLOG_V3_ABSTIME) {
+    rv = 0;
+    goto out;
+  }
+  if((olen = __jlog_v3_reencode(ctx, in, len, old_base, 0, 0, NULL)) < 0 ||
+     (out = malloc(olen)) == NULL)
+    goto out;
+  __jlog_v3_reencode(ctx, in, len, old_base, 0, 0, out);
+  if(!jlog_file_pwrite(ctx->data, out, olen, 0) ||
+     !jlog_file_truncate(ctx->data, olen))
+    goto out;
+  rv = 0;
+ out:
+  free(in);
+  free(out);
+  return rv;
+}
+
+/* the smallest header there can be, for bounds checks */
+static size_t __jlog_min_header(jlog_ctx *ctx) {
+  if(IS_COMPACT_HEADERS(ctx)) return IS_COMPRESS_MAGIC(ctx) ? 5 : 4;
+  return IS_COMPRESS_MAGIC(ctx) ? sizeof(jlog_message_header_compressed)
+                                : sizeof(jlog_message_header);
+}
+
+/* __jlog_parse_header for the record at off in a file of length flen
+ * @return the header length, 0 if invalid, -1 if it could not be read */
+static ssize_t __jlog_pread_header(jlog_ctx *ctx, jlog_file *f, u_int32_t log,
+                                   off_t off, off_t flen, int want_time,
+                                   jlog_message_header_compressed *hdr,
+                                   u_int32_t *disk_len, u_int8_t *tag) {
+  u_int8_t buf[JLOG_V3_MAX_HDR];
+  size_t avail = __jlog_min_header(ctx);
+
+  if(off + (off_t)avail > flen) return -1;
+  if(IS_COMPACT_HEADERS(ctx))
+    avail = flen - off < (off_t)sizeof(buf) ? flen - off : sizeof(buf);
+  if(!jlog_file_pread(f, buf, avail, off)) return -1;
+  return __jlog_parse_header(ctx, log, buf, avail, want_time, hdr, disk_len,
+                             tag);
+}
+
+int jlog_repair_datafile(jlog_ctx *ctx, u_int32_t log)
+{
+  size_t min_hdr = __jlog_min_header(ctx);
   char *this, *next, *afternext = NULL, *mmap_end;
+  size_t len_here;
+  u_int64_t base = 0;
+  u_int32_t mlen, clen;
+  u_int8_t flags, tag;
   int i, invalid_count = 0;
   struct {
     off_t start, end;
@@ -148,6 +501,9 @@ int jlog_repair_datafile(jlog_ctx *ctx, u_int32_t log)
   invalid_count++; \
 } while (0)
 
+/* the length of the whole record at p if a valid header starts there */
+#define RECORD_AT(p) __jlog_record_span(ctx, log, p, mmap_end)
+
   ctx->last_error = JLOG_ERR_SUCCESS;
 
   /* we want the reader's open logic because this runs in the read path
@@ -168,44 +524,31 @@ int jlog_repair_datafile(jlog_ctx *ctx, u_int32_t log)
 
   orig_len = ctx->mmap_len;
   mmap_end = (char*)ctx->mmap_base + ctx->mmap_len;
-  /* these values will cause us to fall right into the error clause and
-   * start searching for a valid header from offset 0 */
-  this = (char*)ctx->mmap_base - hdr_size;
-  hdr.reserved = ctx->meta->hdr_magic;
-  hdr.mlen = 0;
+  this = ctx->mmap_base;
 
-  while (this + hdr_size <= mmap_end) {
-    next = this + hdr_size + *message_disk_len;
-    if (next <= (char *)ctx->mmap_base) goto error;
-    if (next == mmap_end) {
-      this = next;
-      break;
-    }
-    if (next + hdr_size > mmap_end) goto error;
-    memcpy(&hdr, next, hdr_size);
-    if (hdr.reserved != ctx->meta->hdr_magic) goto error;
-    this = next;
-    continue;
-  error:
-    for (next = this + hdr_size; next + hdr_size <= mmap_end; next++) {
-      memcpy(&hdr, next, hdr_size);
-      if (hdr.reserved == ctx->meta->hdr_magic) {
-        afternext = next + hdr_size + *message_disk_len;
-        if (afternext <= (char *)ctx->mmap_base) continue;
-        if (afternext == mmap_end) break;
-        if (afternext + hdr_size > mmap_end) continue;
-        memcpy(&hdr, afternext, hdr_size);
-        if (hdr.reserved == ctx->meta->hdr_magic) break;
+  while (this < mmap_end) {
+    /* a record is good when the one after it starts where it says */
+    if ((len_here = RECORD_AT(this)) != 0) {
+      next = this + len_here;
+      if (next == mmap_end || RECORD_AT(next)) {
+        this = next;
+        continue;
       }
     }
-    /* correct for while loop entry condition */
-    if (this < (char *)ctx->mmap_base) this = ctx->mmap_base;
-    if (next + hdr_size > mmap_end) break;
-    if (next > this) TAG_INVALID(this, next);
+    afternext = NULL;
+    for (next = this + min_hdr; next < mmap_end; next++) {
+      if ((len_here = RECORD_AT(next)) == 0) continue;
+      afternext = next + len_here;
+      if (afternext == mmap_end || RECORD_AT(afternext)) break;
+      afternext = NULL;
+    }
+    if (!afternext) break;
+    TAG_INVALID(this, next);
     this = afternext;
   }
   if (this != mmap_end) TAG_INVALID(this, mmap_end);
 
+#undef RECORD_AT
 #undef TAG_INVALID
 
 #define MOVE_SEGMENT do { \
@@ -225,6 +568,13 @@ int jlog_repair_datafile(jlog_ctx *ctx, u_int32_t log)
 } while (0)
 
   if (invalid_count > 0) {
+    /* compact headers' times are deltas from the first record's; keep
+     * that time should the first record be among those cut away */
+    if (IS_COMPACT_HEADERS(ctx) && invalid[0].start == 0 &&
+        (!__jlog_v3_parse(ctx->mmap_base, ctx->mmap_len,
+                          IS_COMPRESS_MAGIC(ctx), &flags, &tag, &base,
+                          &mlen, &clen) || !(flags & JLOG_V3_ABSTIME)))
+      base = 0;
     __jlog_munmap_reader(ctx);
     dst = invalid[0].start;
     for (i = 0; i < invalid_count - 1; ) {
@@ -237,6 +587,12 @@ int jlog_repair_datafile(jlog_ctx *ctx, u_int32_t log)
     if (len > 0) MOVE_SEGMENT;
     if (!jlog_file_truncate(ctx->data, dst))
       SYS_FAIL(JLOG_ERR_FILE_WRITE);
+    if (IS_COMPACT_HEADERS(ctx) && invalid[0].start == 0 &&
+        __jlog_v3_reanchor(ctx, base) != 0)
+      SYS_FAIL(JLOG_ERR_FILE_WRITE);
+    ctx->seg_base_valid = 0;
+    /* the records have new markers; resync tags them afresh */
+    __jlog_unlink_tag_indexes(ctx, log);
   }
 
 #undef MOVE_SEGMENT
@@ -251,19 +607,15 @@ finish:
 int jlog_inspect_datafile(jlog_ctx *ctx, u_int32_t log, int verbose)
 {
   jlog_message_header_compressed hdr;
-  size_t hdr_size = sizeof(jlog_message_header);
-  uint32_t *message_disk_len = &hdr.mlen;
+  size_t hdr_size;
+  uint32_t disk_len, *message_disk_len = &disk_len;
   char *this, *next, *mmap_end;
+  u_int8_t tag;
   int i;
   time_t timet;
   struct tm tm;
   char tbuff[128];
 
-  if (IS_COMPRESS_MAGIC(ctx)) {
-    hdr_size = sizeof(jlog_message_header_compressed);
-    message_disk_len = &hdr.compressed_len;
-  }
-
   ctx->last_error = JLOG_ERR_SUCCESS;
 
   __jlog_open_reader(ctx, log);
@@ -275,13 +627,18 @@ int jlog_inspect_datafile(jlog_ctx *ctx, u_int32_t log, int verbose)
   mmap_end = (char*)ctx->mmap_base + ctx->mmap_len;
   this = ctx->mmap_base;
   i = 0;
-  while (this + hdr_size <= mmap_end) {
+  while (this + __jlog_min_header(ctx) <= mmap_end) {
     int initial = 1;
-    memcpy(&hdr, this, hdr_size);
     i++;
-    if (hdr.reserved != ctx->meta->hdr_magic) {
-      fprintf(stderr, "Message %d at [%ld] has invalid reserved value %u\n",
-              i, (long int)(this - (char *)ctx->mmap_base), hdr.reserved);
+    hdr_size = __jlog_parse_header(ctx, log, this, mmap_end - this, 1,
+                                   &hdr, &disk_len, &tag);
+    if (!hdr_size) {
+      if (IS_COMPACT_HEADERS(ctx))
+        fprintf(stderr, "Message %d at [%ld] has an invalid header\n",
+                i, (long int)(this - (char *)ctx->mmap_base));
+      else
+        fprintf(stderr, "Message %d at [%ld] has invalid reserved value %u\n",
+                i, (long int)(this - (char *)ctx->mmap_base), hdr.reserved);
       return 1;
     }
 
@@ -312,6 +669,7 @@ int jlog_inspect_datafile(jlog_ctx *ctx, u_int32_t log, int verbose)
     localtime_r(&timet, &tm);
     strftime(tbuff, sizeof(tbuff), "%c", &tm);
     if(verbose) fprintf(stderr, "\n\ttime: %s\n\tmlen: %u\n", tbuff, hdr.mlen);
+    if(verbose && tag) fprintf(stderr, "\ttag: %u\n", tag);
     this = next;
   }
   if (this < mmap_end) {
@@ -330,7 +688,15 @@ int jlog_idx_details(jlog_ctx *ctx, u_int32_t log,
 {
   off_t index_len;
   u_int64_t index;
+  jlog_id last;
 
+  /* neither keeps the record count where the index length shows it */
+  if (IS_FIXED_RECORDS(ctx) || IS_SPARSE_INDEX(ctx)) {
+    if (__jlog_resync_index(ctx, log, &last, closed) != 0)
+      return -1;
+    *marker = last.marker;
+    return 0;
+  }
   __jlog_open_indexer(ctx, log);
   if (!ctx->index)
     SYS_FAIL(JLOG_ERR_IDX_OPEN);
@@ -361,21 +727,94 @@ finish:
   return -1;
 }
 
-static int __jlog_unlink_datafile(jlog_ctx *ctx, u_int32_t log) {
-  char file[MAXPATHLEN];
-  int len;
+static int __jlog_spare_filename(jlog_ctx *ctx, char *file, u_int32_t seq) {
+  int len = strlen(ctx->path);
+  if((len + 1 + sizeof(SPARE_PREFIX) + 8 + sizeof(INDEX_EXT)) > MAXPATHLEN)
+    return -1;
+  memcpy(file, ctx->path, len);
+  file[len++] = IFS_CH;
+  memcpy(&file[len], SPARE_PREFIX, sizeof(SPARE_PREFIX) - 1);
+  len += sizeof(SPARE_PREFIX) - 1;
+  STRLOGID(&file[len], seq);
+  return len + 8;
+}
 
+/* move a consumed segment into the spare pool; 0 on success, -1 if it
+ * should be unlinked instead.  It keeps its contents until a writer takes
+ * it, since readers elsewhere may still have it mapped: bumping
+ * spare_tail tells them to check the name is still there before they
+ * read the mapping again, and nothing is truncated under them meanwhile */
+static int __jlog_recycle_segment(jlog_ctx *ctx, u_int32_t log) {
+  char file[MAXPATHLEN], spare[MAXPATHLEN];
+  int flen, slen, rv = -1;
+
+  if(!ctx->meta_is_mapped || !ctx->meta->spare_limit) return -1;
   memset(file, 0, sizeof(file));
-  if(ctx->current_log == log) {
-    __jlog_close_reader(ctx);
-    __jlog_close_indexer(ctx);
+  STRSETDATAFILE(ctx, file, log);
+  flen = strlen(file);
+  if((flen + sizeof(INDEX_EXT)) > sizeof(file)) return -1;
+  if(!jlog_file_lock(ctx->metastore)) return -1;
+  if(ctx->meta->spare_tail - ctx->meta->spare_head >= ctx->meta->spare_limit)
+    goto out;
+  if((slen = __jlog_spare_filename(ctx, spare, ctx->meta->spare_tail)) < 0)
+    goto out;
+
+  if(rename(file, spare) != 0) goto out;
+  memcpy(file + flen, INDEX_EXT, sizeof(INDEX_EXT));
+  memcpy(spare + slen, INDEX_EXT, sizeof(INDEX_EXT));
+  if(rename(file, spare) != 0) unlink(file);
+
+  ctx->meta->spare_tail++;
+  __jlog_save_metastore(ctx, 1);
+  rv = 0;
+ out:
+  jlog_file_unlock(ctx->metastore);
+  return rv;
+}
+
+/* called with the metastore locked: rename the oldest spare (if any) to
+ * the segment file about to be created, and only now empty it, keeping
+ * its blocks.  An empty index is just what a fresh segment starts with */
+static void __jlog_take_spare(jlog_ctx *ctx, const char *file) {
+  char spare[MAXPATHLEN], idx[MAXPATHLEN];
+  jlog_file *f;
+  int len, slen;
+
+  len = strlen(file);
+  if((len + sizeof(INDEX_EXT)) > sizeof(idx)) return;
+  memcpy(idx, file, len);
+  memcpy(idx + len, INDEX_EXT, sizeof(INDEX_EXT));
+  while(ctx->meta->spare_head != ctx->meta->spare_tail) {
+    slen = __jlog_spare_filename(ctx, spare, ctx->meta->spare_head++);
+    if(slen < 0) return;
+    memcpy(spare + slen, INDEX_EXT, sizeof(INDEX_EXT));
+    if(rename(spare, idx) == 0 && truncate(idx, 0) != 0) unlink(idx);
+    spare[slen] = '\0';
+    if(rename(spare, file) != 0) continue;
+    if(!(f = jlog_file_open(file, 0, ctx->file_mode, ctx->multi_process)) ||
+       !jlog_file_truncate(f, 0)) {
+      /* the old records must not show up in the new segment */
+      if(f) jlog_file_close(f);
+      unlink(file);
+      unlink(idx);
+      return;
+    }
+    jlog_file_reserve(f, JLOG_UNIT_LIMIT(ctx->meta));
+    jlog_file_close(f);
+    return;
   }
+}
+
+static int __jlog_remove_segment(jlog_ctx *ctx, u_int32_t log) {
+  char file[MAXPATHLEN];
+  int len;
 
+  memset(file, 0, sizeof(file));
   STRSETDATAFILE(ctx, file, log);
 #ifdef DEBUG
   fprintf(stderr, "unlinking %s\n", file);
 #endif
-  unlink(file);
+  if(unlink(file) != 0 && errno != ENOENT) return -1;
 
   len = strlen(file);
   if((len + sizeof(INDEX_EXT)) > sizeof(file)) return -1;
@@ -387,6 +826,35 @@ static int __jlog_unlink_datafile(jlog_ctx *ctx, u_int32_t log) {
   return 0;
 }
 
+/* only touches the files and the metastore, so the reclaim thread may
+ * call it */
+static int __jlog_unlink_segment(jlog_ctx *ctx, u_int32_t log) {
+  __jlog_unlink_tag_indexes(ctx, log);
+  if(__jlog_recycle_segment(ctx, log) == 0) return 0;
+  return __jlog_remove_segment(ctx, log);
+}
+
+/* `recycle` is for segments every subscriber has read past; anything a
+ * reader may still have mapped must be plainly unlinked, since taking a
+ * spare truncates it under them */
+static int __jlog_unlink_datafile(jlog_ctx *ctx, u_int32_t log, int recycle) {
+  jlog_closed_segment *seg;
+
+  if(ctx->current_log == log) {
+    __jlog_close_reader(ctx);
+    __jlog_close_indexer(ctx);
+  }
+  if((seg = __jlog_find_closed(ctx, log)) != NULL)
+    __jlog_unmap_closed(seg);
+
+  if(!recycle) {
+    __jlog_unlink_tag_indexes(ctx, log);
+    return __jlog_remove_segment(ctx, log);
+  }
+  if(ctx->reclaim && __jlog_reclaim_queue(ctx, log) == 0) return 0;
+  return __jlog_unlink_segment(ctx, log);
+}
+
 static int __jlog_open_metastore(jlog_ctx *ctx)
 {
   char file[MAXPATHLEN];
@@ -476,17 +944,47 @@ int __jlog_pending_readers(jlog_ctx *ctx, u_int32_t log) {
 }
 int jlog_pending_readers(jlog_ctx *ctx, u_int32_t log,
                          u_int32_t *earliest_out) {
+  jlog_id earliest;
+  int readers;
+
+  readers = __jlog_scan_checkpoints(ctx, log, &earliest);
+  if(readers >= 0 && earliest_out) *earliest_out = earliest.log;
+  return readers;
+}
+/* counts the subscribers still needing `log` and finds the checkpoint of
+ * the slowest one (0:0 if there are no subscribers) */
+static int __jlog_scan_checkpoints(jlog_ctx *ctx, u_int32_t log,
+                                   jlog_id *earliest_out) {
   int readers;
   DIR *dir;
   struct dirent *ent;
   char file[MAXPATHLEN];
   int len, seen = 0;
-  u_int32_t earliest = 0;
+  jlog_id earliest = { 0, 0 };
   jlog_id id;
+  u_int32_t i;
 
   memset(file, 0, sizeof(file));
   readers = 0;
 
+  switch(__jlog_use_cptable(ctx)) {
+    case -1: return -1;
+    case 1:
+      for(i = 0; i < CPTABLE_NSLOTS(ctx); i++) {
+        /* a NEW slot holds the position it was added at */
+        if(CPTABLE_SLOT(ctx, i)->state == JLOG_CPSLOT_FREE) continue;
+        __jlog_cptable_read(CPTABLE_SLOT(ctx, i), &id);
+        if (!seen || id.log < earliest.log ||
+            (id.log == earliest.log && id.marker < earliest.marker)) {
+          earliest = id;
+          seen = 1;
+        }
+        if (id.log <= log) readers++;
+      }
+      if(earliest_out) *earliest_out = earliest;
+      return readers;
+  }
+
   dir = opendir(ctx->path);
   if (!dir) return -1;
 
@@ -517,12 +1015,13 @@ int jlog_pending_readers(jlog_ctx *ctx, u_int32_t log,
           fprintf(stderr, "\t%u <= %u (pending reader)\n", id.log, log);
 #endif
           if (!seen) {
-            earliest = id.log;
+            earliest = id;
             seen = 1;
           }
           else {
-            if(id.log < earliest) {
-              earliest = id.log;
+            if(id.log < earliest.log ||
+               (id.log == earliest.log && id.marker < earliest.marker)) {
+              earliest = id;
             }
           }
           if (id.log <= log) {
@@ -566,6 +1065,25 @@ int jlog_ctx_list_subscribers(jlog_ctx *ctx, char ***subs) {
   js.subs = calloc(16, sizeof(char *));
   js.allocd = 16;
 
+  switch(__jlog_use_cptable(ctx)) {
+    case -1:
+      free(js.subs);
+      return -1;
+    case 1:
+      for(len = 0; len < CPTABLE_NSLOTS(ctx); len++) {
+        jlog_cptable_slot *slot = CPTABLE_SLOT(ctx, len);
+        if(slot->state == JLOG_CPSLOT_FREE) continue;
+        js.subs[js.used++] = strndup(slot->name, sizeof(slot->name));
+        if(js.used == js.allocd) {
+          js.allocd *= 2;
+          js.subs = realloc(js.subs, js.allocd*sizeof(char *));
+        }
+        js.subs[js.used] = NULL;
+      }
+      *subs = js.subs;
+      return js.used;
+  }
+
   dir = opendir(ctx->path);
   if (!dir) return -1;
   while ((ent = readdir(dir))) {
@@ -629,7 +1147,7 @@ static int __jlog_save_metastore(jlog_ctx *ctx, int ilocked)
     return rv;
   }
   else {
-    if (!jlog_file_pwrite(ctx->metastore, ctx->meta, sizeof(*ctx->meta), 0)) {
+    if (!jlog_file_pwrite(ctx->metastore, ctx->meta, JLOG_META_SIZE(ctx->meta), 0)) {
       if (!ilocked) jlog_file_unlock(ctx->metastore);
       FASSERT(0, "jlog_file_pwrite failed");
       ctx->last_error = JLOG_ERR_FILE_WRITE;
@@ -661,8 +1179,10 @@ static int __jlog_restore_metastore(jlog_ctx *ctx, int ilocked)
 
   if(ctx->meta_is_mapped == 0) {
     int rv;
-    rv = jlog_file_map_rdwr(ctx->metastore, &base, &len);
-    FASSERT(rv == 1, "jlog_file_map_rdwr");
+    /* the whole struct is mapped whatever the file's length; fields past
+     * its end read as 0, and show up as soon as anyone extends it */
+    rv = jlog_file_map_rdwr_len(ctx->metastore, sizeof(*ctx->meta), &base, &len);
+    FASSERT(rv == 1, "jlog_file_map_rdwr_len");
     if(rv != 1) {
       if (!ilocked) jlog_file_unlock(ctx->metastore);
       ctx->last_error = JLOG_ERR_OPEN;
@@ -675,10 +1195,14 @@ static int __jlog_restore_metastore(jlog_ctx *ctx, int ilocked)
        */
        u_int32_t dummy = 0;
        jlog_file_pwrite(ctx->metastore, &dummy, sizeof(dummy), 12);
-       rv = jlog_file_map_rdwr(ctx->metastore, &base, &len);
+       len = JLOG_META_BASE_SIZE;
     }
-    FASSERT(rv == 1, "jlog_file_map_rdwr");
-    if(rv != 1 || len != sizeof(*ctx->meta)) {
+    if(len != JLOG_META_BASE_SIZE &&
+       (len != sizeof(*ctx->meta) || !JLOG_META_EXTENDED((struct _jlog_meta_info *)base)))
+      rv = 0;
+    FASSERT(rv == 1, "jlog_file_map_rdwr_len");
+    if(rv != 1) {
+      munmap(base, sizeof(*ctx->meta));
       if (!ilocked) jlog_file_unlock(ctx->metastore);
       ctx->last_error = JLOG_ERR_OPEN;
       return -1;
@@ -698,6 +1222,61 @@ static int __jlog_restore_metastore(jlog_ctx *ctx, int ilocked)
   return 0;
 }
 
+/* does a new jlog need the metastore fields older versions lack? */
+static int __jlog_meta_wants_ext(const struct _jlog_meta_info *meta) {
+  return meta->format_flags || meta->spare_limit || meta->unit_limit_hi ||
+         meta->record_size || meta->index_interval > 1 ||
+         meta->dedup_window || meta->retain_age || meta->retain_bytes ||
+         meta->retain_bytes_hi;
+}
+
+/* grow an open jlog's metastore to the full struct, for a feature turned
+ * on after it was made.  One write puts meta_ext and the zeroed fields
+ * behind it in place, and contexts that have it mapped see them at once */
+static int __jlog_extend_metastore(jlog_ctx *ctx) {
+  struct _jlog_meta_info tail;
+  int rv = 0;
+
+  if(JLOG_META_EXTENDED(ctx->meta)) return 0;
+  if(!jlog_file_lock(ctx->metastore)) {
+    ctx->last_error = JLOG_ERR_LOCK;
+    ctx->last_errno = errno;
+    return -1;
+  }
+  if(!JLOG_META_EXTENDED(ctx->meta)) {
+    memset(&tail, 0, sizeof(tail));
+    tail.meta_ext = JLOG_META_EXT;
+    if(!jlog_file_pwrite(ctx->metastore, (char *)&tail + JLOG_META_BASE_SIZE,
+                         sizeof(tail) - JLOG_META_BASE_SIZE,
+                         JLOG_META_BASE_SIZE)) {
+      ctx->last_error = JLOG_ERR_FILE_WRITE;
+      ctx->last_errno = errno;
+      rv = -1;
+    }
+  }
+  jlog_file_unlock(ctx->metastore);
+  return rv;
+}
+
+/* called by writers once records are visible in a segment file */
+static void __jlog_notify_readers(jlog_ctx *ctx)
+{
+  /* without the counter readers watch the directory instead */
+  if(!ctx->meta_is_mapped || !JLOG_META_EXTENDED(ctx->meta)) return;
+  __sync_add_and_fetch(&ctx->meta->write_seq, 1);
+#ifdef JLOG_USE_FUTEX
+  {
+    u_int32_t waiters = ctx->meta->waiters;
+    /* nobody asleep means the count is stale, left by readers that died
+     * waiting; those still counting themselves in see write_seq move */
+    if(waiters &&
+       syscall(SYS_futex, &ctx->meta->write_seq, FUTEX_WAKE, INT_MAX,
+               NULL, NULL, 0) == 0)
+      __sync_bool_compare_and_swap(&ctx->meta->waiters, waiters, 0);
+  }
+#endif
+}
+
 static int __jlog_map_pre_commit(jlog_ctx *ctx)
 {
   off_t pre_commit_size = 0;
@@ -761,9 +1340,19 @@ static int __jlog_map_pre_commit(jlog_ctx *ctx)
 
 
 int jlog_get_checkpoint(jlog_ctx *ctx, const char *s, jlog_id *id) {
+  jlog_cptable_slot *slot;
   jlog_file *f;
   int rv = -1;
 
+  switch(__jlog_use_cptable(ctx)) {
+    case -1: return -1;
+    case 1:
+      slot = __jlog_cptable_find(ctx, s);
+      if(!slot || slot->state != JLOG_CPSLOT_SET) return -1;
+      __jlog_cptable_read(slot, id);
+      return 0;
+  }
+
   if(ctx->subscriber_name && !strcmp(ctx->subscriber_name, s)) {
     if(!ctx->checkpoint) {
       ctx->checkpoint = __jlog_open_named_checkpoint(ctx, s, 0);
@@ -782,13 +1371,28 @@ int jlog_get_checkpoint(jlog_ctx *ctx, const char *s, jlog_id *id) {
   return rv;
 }
 
-static int __jlog_set_checkpoint(jlog_ctx *ctx, const char *s, const jlog_id *id)
+/* `recycle` is passed on to the unlinks of segments the move leaves
+ * behind; see __jlog_unlink_datafile */
+static int __jlog_write_checkpoint(jlog_ctx *ctx, const char *s,
+                                   const jlog_id *id, int recycle)
 {
-  jlog_file *f;
+  jlog_cptable_slot *slot;
+  jlog_file *f = NULL;
   int rv = -1;
-  jlog_id old_id;
+  jlog_id old_id, earliest;
   u_int32_t log;
 
+  switch(__jlog_use_cptable(ctx)) {
+    case -1: return -1;
+    case 1:
+      if(!(slot = __jlog_cptable_find(ctx, s))) return -1;
+      if(slot->state == JLOG_CPSLOT_SET) __jlog_cptable_read(slot, &old_id);
+      else old_id.log = id->log;
+      if(__jlog_cptable_write(ctx, slot, id) != 0) return -1;
+      rv = 0;
+      goto written;
+  }
+
   if(ctx->subscriber_name && !strcmp(ctx->subscriber_name, s)) {
     if(!ctx->checkpoint) {
       ctx->checkpoint = __jlog_open_named_checkpoint(ctx, s, 0);
@@ -819,10 +1423,27 @@ static int __jlog_set_checkpoint(jlog_ctx *ctx, const char *s, const jlog_id *id
   jlog_file_unlock(f);
   rv = 0;
 
-  for (log = old_id.log; log < id->log; log++) {
-    if (__jlog_pending_readers(ctx, log) == 0) {
-      __jlog_unlink_datafile(ctx, log);
-    }
+ written:
+  if (ctx->subscriber_name && !strcmp(ctx->subscriber_name, s)) {
+    /* whatever we just wrote supersedes progress held back in memory */
+    ctx->cp_pending = 0;
+    ctx->cp_pending_count = 0;
+    gettimeofday(&ctx->cp_written, NULL);
+    __jlog_drop_consumed(ctx, id);
+  }
+
+  /* a segment is still needed if any checkpoint is at or before it, so
+   * one scan for the earliest checkpoint settles every segment we just
+   * moved past */
+  if (old_id.log < id->log &&
+      __jlog_scan_checkpoints(ctx, old_id.log, &earliest) >= 0) {
+    for (log = old_id.log; log < id->log && log < earliest.log; log++)
+      if (__jlog_unlink_datafile(ctx, log, recycle) != 0) break;
+    /* first_log may only pass segments known to be gone: none below
+     * old_id (another subscriber may have held them) and none from a
+     * failed unlink on */
+    if (ctx->meta_is_mapped && ctx->meta->first_log >= old_id.log)
+      __jlog_note_first_log(ctx, log);
   }
 
  failset:
@@ -830,6 +1451,11 @@ static int __jlog_set_checkpoint(jlog_ctx *ctx, const char *s, const jlog_id *id
   return rv;
 }
 
+static int __jlog_set_checkpoint(jlog_ctx *ctx, const char *s, const jlog_id *id)
+{
+  return __jlog_write_checkpoint(ctx, s, id, 1);
+}
+
 static int __jlog_close_metastore(jlog_ctx *ctx) {
   if (ctx->metastore) {
     jlog_file_close(ctx->metastore);
@@ -888,71 +1514,685 @@ static jlog_file *__jlog_open_named_checkpoint(jlog_ctx *ctx, const char *cpname
   return jlog_file_open(name, flags, ctx->file_mode, ctx->multi_process);
 }
 
-static jlog_file *__jlog_open_reader(jlog_ctx *ctx, u_int32_t log) {
+static int __jlog_cptable_filename(jlog_ctx *ctx, char *file) {
+  int len = strlen(ctx->path);
+  if((len + 1 + sizeof(CPTABLE_FILE)) > MAXPATHLEN) return -1;
+  memcpy(file, ctx->path, len);
+  file[len++] = IFS_CH;
+  memcpy(&file[len], CPTABLE_FILE, sizeof(CPTABLE_FILE));
+  return 0;
+}
+
+static int __jlog_create_cptable(jlog_ctx *ctx) {
   char file[MAXPATHLEN];
+  jlog_cptable_header hdr;
+  jlog_file *f;
+  int rv = -1;
 
-  memset(file, 0, sizeof(file));
-  if(ctx->current_log != log) {
-    __jlog_close_reader(ctx);
-    __jlog_close_indexer(ctx);
+  if(__jlog_cptable_filename(ctx, file) != 0) return -1;
+  if(!(f = jlog_file_open(file, O_CREAT|O_EXCL, ctx->file_mode, ctx->multi_process)))
+    return -1;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = CPTABLE_MAGIC;
+  hdr.nslots = CPTABLE_SLOTS;
+  if(jlog_file_truncate(f, sizeof(hdr) + CPTABLE_SLOTS * sizeof(jlog_cptable_slot)) &&
+     jlog_file_pwrite(f, &hdr, sizeof(hdr), 0) &&
+     jlog_file_sync(f))
+    rv = 0;
+  jlog_file_close(f);
+  return rv;
+}
+
+/* 1 if this jlog keeps its checkpoints in the table (now mapped), 0 if in
+ * cp.<hex> files, -1 if it should have a table and we can't get at it */
+static int __jlog_use_cptable(jlog_ctx *ctx) {
+  char file[MAXPATHLEN];
+  jlog_cptable_header *hdr;
+  void *base;
+  size_t len;
+  int save_error, save_errno;
+
+  if(ctx->cptable) return 1;
+  if(!ctx->meta_is_mapped) {
+    /* subscribers may be managed from a context that never opened the
+     * jlog; find out which format it is without leaving errors behind */
+    save_error = ctx->last_error;
+    save_errno = ctx->last_errno;
+    if((!ctx->metastore && __jlog_open_metastore(ctx) != 0) ||
+       __jlog_restore_metastore(ctx, 0) != 0) {
+      ctx->last_error = save_error;
+      ctx->last_errno = save_errno;
+      return 0;
+    }
   }
-  if(ctx->data) {
-    return ctx->data;
+  if(!(ctx->meta->format_flags & JLOG_FORMAT_CHECKPOINT_TABLE)) return 0;
+
+  if(__jlog_cptable_filename(ctx, file) != 0) return -1;
+  if(!ctx->cptable_file &&
+     !(ctx->cptable_file = jlog_file_open(file, 0, ctx->file_mode, ctx->multi_process)))
+    return -1;
+  if(!jlog_file_map_rdwr(ctx->cptable_file, &base, &len)) return -1;
+  hdr = base;
+  if(len < sizeof(*hdr) || hdr->magic != CPTABLE_MAGIC ||
+     len < sizeof(*hdr) + (size_t)hdr->nslots * sizeof(jlog_cptable_slot)) {
+    munmap(base, len);
+    return -1;
   }
-  STRSETDATAFILE(ctx, file, log);
-#ifdef DEBUG
-  fprintf(stderr, "opening log file[ro]: '%s'\n", file);
-#endif
-  ctx->data = jlog_file_open(file, 0, ctx->file_mode, ctx->multi_process);
-  ctx->current_log = log;
-  return ctx->data;
+  ctx->cptable = base;
+  ctx->cptable_len = len;
+  return 1;
 }
 
-static int __jlog_munmap_reader(jlog_ctx *ctx) {
-  if(ctx->mmap_base) {
-    munmap(ctx->mmap_base, ctx->mmap_len);
-    ctx->mmap_base = NULL;
-    ctx->mmap_len = 0;
-  }
+static void __jlog_close_cptable(jlog_ctx *ctx) {
+  if(ctx->cptable) munmap(ctx->cptable, ctx->cptable_len);
+  ctx->cptable = NULL;
+  if(ctx->cptable_file) jlog_file_close(ctx->cptable_file);
+  ctx->cptable_file = NULL;
+}
+
+static int __jlog_dedup_filename(jlog_ctx *ctx, char *file) {
+  int len = strlen(ctx->path);
+  if((len + 1 + sizeof(DEDUP_FILE)) > MAXPATHLEN) return -1;
+  memcpy(file, ctx->path, len);
+  file[len++] = IFS_CH;
+  memcpy(&file[len], DEDUP_FILE, sizeof(DEDUP_FILE));
   return 0;
 }
 
-static int __jlog_mmap_reader(jlog_ctx *ctx, u_int32_t log) {
-  if(ctx->current_log == log && ctx->mmap_base) return 0;
-  __jlog_open_reader(ctx, log);
-  if(!ctx->data)
+static size_t __jlog_dedup_size(u_int32_t nkeys, u_int32_t nbloom,
+                                u_int32_t nindex) {
+  return sizeof(jlog_dedup_header) + (size_t)nkeys * sizeof(u_int64_t) +
+         nbloom + (size_t)nindex * sizeof(u_int32_t);
+}
+
+static int __jlog_create_dedup(jlog_ctx *ctx) {
+  char file[MAXPATHLEN];
+  jlog_dedup_header hdr;
+  jlog_file *f;
+  int rv = -1;
+
+  if(__jlog_dedup_filename(ctx, file) != 0) return -1;
+  if(!(f = jlog_file_open(file, O_CREAT|O_EXCL, ctx->file_mode, ctx->multi_process)))
     return -1;
-  if (!jlog_file_map_read(ctx->data, &ctx->mmap_base, &ctx->mmap_len)) {
-    ctx->mmap_base = NULL;
-    ctx->last_error = JLOG_ERR_FILE_READ;
-    ctx->last_errno = errno;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = DEDUP_MAGIC;
+  hdr.nkeys = ctx->meta->dedup_window;
+  for(hdr.nbloom = 64; hdr.nbloom < hdr.nkeys * DEDUP_BLOOM_PER_KEY; )
+    hdr.nbloom <<= 1;
+  for(hdr.nindex = 64; hdr.nindex < hdr.nkeys * DEDUP_INDEX_PER_KEY; )
+    hdr.nindex <<= 1;
+  if(jlog_file_truncate(f, __jlog_dedup_size(hdr.nkeys, hdr.nbloom,
+                                             hdr.nindex)) &&
+     jlog_file_pwrite(f, &hdr, sizeof(hdr), 0) &&
+     jlog_file_sync(f))
+    rv = 0;
+  jlog_file_close(f);
+  return rv;
+}
+
+static int __jlog_open_dedup(jlog_ctx *ctx) {
+  char file[MAXPATHLEN];
+  jlog_dedup_header *hdr;
+  void *base;
+  size_t len;
+
+  if(ctx->dedup) return 0;
+  if(__jlog_dedup_filename(ctx, file) != 0) return -1;
+  if(!ctx->dedup_file &&
+     !(ctx->dedup_file = jlog_file_open(file, 0, ctx->file_mode, ctx->multi_process)))
+    return -1;
+  if(!jlog_file_map_rdwr(ctx->dedup_file, &base, &len)) return -1;
+  hdr = base;
+  if(len < sizeof(*hdr) || hdr->magic != DEDUP_MAGIC || !hdr->nkeys ||
+     hdr->nbloom & (hdr->nbloom - 1) || hdr->head >= hdr->nkeys ||
+     hdr->count > hdr->nkeys || hdr->nindex & (hdr->nindex - 1) ||
+     (hdr->nindex && hdr->nindex <= hdr->nkeys) ||
+     len < __jlog_dedup_size(hdr->nkeys, hdr->nbloom, hdr->nindex)) {
+    munmap(base, len);
+    errno = EINVAL;
     return -1;
   }
+  ctx->dedup = base;
+  ctx->dedup_len = len;
   return 0;
 }
 
-static jlog_file *__jlog_open_writer(jlog_ctx *ctx) {
-  char file[MAXPATHLEN] = {0};
+static void __jlog_close_dedup(jlog_ctx *ctx) {
+  if(ctx->dedup) munmap(ctx->dedup, ctx->dedup_len);
+  ctx->dedup = NULL;
+  if(ctx->dedup_file) jlog_file_close(ctx->dedup_file);
+  ctx->dedup_file = NULL;
+}
 
-  if(ctx->data) {
-    /* Still open */
-    return ctx->data;
+/* FNV-1a, finished with a 64-bit mix so every bit of the result counts */
+static u_int64_t __jlog_key_hash(const void *key, size_t len) {
+  const u_int8_t *p = key;
+  u_int64_t h = 0xcbf29ce484222325ULL;
+
+  while(len--) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+#define DEDUP_RING(d) ((u_int64_t *)((d) + 1))
+#define DEDUP_BLOOM(d) ((u_int8_t *)(DEDUP_RING(d) + (d)->nkeys))
+#define DEDUP_PROBE(d, h, i) \
+  (((u_int32_t)(h) + (i) * (((h) >> 32) | 1)) & ((d)->nbloom - 1))
+#define DEDUP_INDEX(d) ((u_int32_t *)(DEDUP_BLOOM(d) + (d)->nbloom))
+#define DEDUP_HOME(d, h) ((u_int32_t)((h) >> 40) & ((d)->nindex - 1))
+
+/* with the dedup file locked: 1 if h is among the window's keys */
+static int __jlog_dedup_seen(jlog_ctx *ctx, u_int64_t h) {
+  jlog_dedup_header *d = ctx->dedup;
+  u_int64_t *ring = DEDUP_RING(d);
+  u_int8_t *bloom = DEDUP_BLOOM(d);
+  u_int32_t *index = DEDUP_INDEX(d);
+  u_int32_t i, slot = d->head;
+
+  for(i = 0; i < DEDUP_HASHES; i++)
+    if(!bloom[DEDUP_PROBE(d, h, i)]) return 0;
+  if(d->nindex) {
+    for(i = DEDUP_HOME(d, h); index[i]; i = (i + 1) & (d->nindex - 1))
+      if(ring[index[i] - 1] == h) return 1;
+    return 0;
+  }
+  /* newest first: a retry is usually of something just written */
+  for(i = 0; i < d->count; i++) {
+    slot = slot ? slot - 1 : d->nkeys - 1;
+    if(ring[slot] == h) return 1;
   }
+  return 0;
+}
 
-  FASSERT(ctx != NULL, "__jlog_open_writer");
-  if(!jlog_file_lock(ctx->metastore))
-    SYS_FAIL(JLOG_ERR_LOCK);
-  int x;
-  x = __jlog_restore_metastore(ctx, 1);
-  if(x) {
-    FASSERT(x == 0, "__jlog_open_writer calls jlog_restore_metastore");
-    SYS_FAIL(JLOG_ERR_META_OPEN);
+/* drop ring slot `slot` from the table, moving back any entry after it
+ * in the run that could no longer be reached past the hole */
+static void __jlog_dedup_unindex(jlog_dedup_header *d, u_int32_t slot) {
+  u_int64_t *ring = DEDUP_RING(d);
+  u_int32_t *index = DEDUP_INDEX(d);
+  u_int32_t mask = d->nindex - 1, i, j, home;
+
+  for(i = DEDUP_HOME(d, ring[slot]); index[i] != slot + 1; i = (i + 1) & mask)
+    if(!index[i]) return;
+  for(j = (i + 1) & mask; index[j]; j = (j + 1) & mask) {
+    home = DEDUP_HOME(d, ring[index[j] - 1]);
+    /* stays if its home lies cyclically in (i, j] */
+    if(i <= j ? (home > i && home <= j) : (home > i || home <= j)) continue;
+    index[i] = index[j];
+    i = j;
+  }
+  index[i] = 0;
+}
+
+/* with the dedup file locked: h joins the window, pushing out the oldest
+ * key once it is full.  Counters that saturate stay put, which can only
+ * cost a needless look in the table later */
+static void __jlog_dedup_note(jlog_ctx *ctx, u_int64_t h) {
+  jlog_dedup_header *d = ctx->dedup;
+  u_int64_t *ring = DEDUP_RING(d);
+  u_int8_t *bloom = DEDUP_BLOOM(d), *c;
+  u_int32_t *index = DEDUP_INDEX(d);
+  u_int32_t i;
+
+  if(d->count == d->nkeys) {
+    for(i = 0; i < DEDUP_HASHES; i++) {
+      c = &bloom[DEDUP_PROBE(d, ring[d->head], i)];
+      if(*c && *c != 0xff) (*c)--;
+    }
+    if(d->nindex) __jlog_dedup_unindex(d, d->head);
   }
-  ctx->current_log =  ctx->meta->storage_log;
-  STRSETDATAFILE(ctx, file, ctx->current_log);
-#ifdef DEBUG
-  fprintf(stderr, "opening log file[rw]: '%s'\n", file);
-#endif
+  else d->count++;
+  ring[d->head] = h;
+  for(i = 0; i < DEDUP_HASHES; i++) {
+    c = &bloom[DEDUP_PROBE(d, h, i)];
+    if(*c != 0xff) (*c)++;
+  }
+  if(d->nindex) {
+    for(i = DEDUP_HOME(d, h); index[i]; i = (i + 1) & (d->nindex - 1));
+    index[i] = d->head + 1;
+  }
+  if(++d->head == d->nkeys) d->head = 0;
+}
+
+static jlog_cptable_slot *__jlog_cptable_find(jlog_ctx *ctx, const char *s) {
+  jlog_cptable_slot *slot;
+  int own = ctx->subscriber_name && !strcmp(ctx->subscriber_name, s);
+  u_int32_t i;
+
+  if(own && ctx->cpslot >= 0) {
+    slot = CPTABLE_SLOT(ctx, ctx->cpslot);
+    if(slot->state != JLOG_CPSLOT_FREE && !strncmp(slot->name, s, sizeof(slot->name)))
+      return slot;
+  }
+  if(strlen(s) >= CPTABLE_NAME_MAX) return NULL;
+  for(i = 0; i < CPTABLE_NSLOTS(ctx); i++) {
+    slot = CPTABLE_SLOT(ctx, i);
+    if(slot->state != JLOG_CPSLOT_FREE && !strcmp(slot->name, s)) {
+      if(own) ctx->cpslot = i;
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+/* readers retry until they see the same even sequence on both sides;
+ * the bound only matters if a writer died halfway through its store */
+static void __jlog_cptable_read(jlog_cptable_slot *slot, jlog_id *id) {
+  volatile u_int32_t *seq = &slot->seq;
+  u_int32_t before;
+  int tries = 0;
+
+  do {
+    before = *seq;
+    __sync_synchronize();
+    *id = *(volatile jlog_id *)&slot->id;
+    __sync_synchronize();
+  } while((before & 1 || before != *seq) && ++tries < 1000000);
+}
+
+/* writers of one slot are serialized by the table's lock, so the two
+ * increments always bracket a single store */
+static int __jlog_cptable_write(jlog_ctx *ctx, jlog_cptable_slot *slot,
+                                const jlog_id *id) {
+  if(!jlog_file_lock(ctx->cptable_file)) return -1;
+  __sync_fetch_and_add(&slot->seq, 1);
+  *(volatile jlog_id *)&slot->id = *id;
+  slot->state = JLOG_CPSLOT_SET;
+  __sync_fetch_and_add(&slot->seq, 1);
+  jlog_file_unlock(ctx->cptable_file);
+  if(ctx->meta->safety == JLOG_SAFE) {
+    long pagesize = sysconf(_SC_PAGESIZE);
+    uintptr_t page = (uintptr_t)slot & ~(uintptr_t)(pagesize - 1);
+    msync((void *)page, ((uintptr_t)(slot + 1) - page), MS_SYNC);
+  }
+  return 0;
+}
+
+/* the new slot starts out at `at`, where the subscriber is about to be
+ * put, so pruning treats it as a reader from the moment it exists */
+static int __jlog_cptable_add(jlog_ctx *ctx, const char *s, const jlog_id *at) {
+  jlog_cptable_slot *slot = NULL;
+  u_int32_t i;
+
+  if(strlen(s) >= CPTABLE_NAME_MAX) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if(!jlog_file_lock(ctx->cptable_file)) return -1;
+  if(__jlog_cptable_find(ctx, s)) {
+    jlog_file_unlock(ctx->cptable_file);
+    errno = EEXIST;
+    return -1;
+  }
+  for(i = 0; i < CPTABLE_NSLOTS(ctx); i++) {
+    if(CPTABLE_SLOT(ctx, i)->state == JLOG_CPSLOT_FREE) {
+      slot = CPTABLE_SLOT(ctx, i);
+      break;
+    }
+  }
+  if(slot) {
+    slot->id = *at;
+    memset(slot->reserved, 0, sizeof(slot->reserved));
+    memcpy(slot->name, s, strlen(s) + 1);
+    __sync_synchronize();
+    slot->state = JLOG_CPSLOT_NEW;
+  }
+  jlog_file_unlock(ctx->cptable_file);
+  if(!slot) {
+    errno = ENOSPC;
+    return -1;
+  }
+  return 0;
+}
+
+static int __jlog_cptable_remove(jlog_ctx *ctx, const char *s) {
+  jlog_cptable_slot *slot;
+
+  if(!jlog_file_lock(ctx->cptable_file)) return -1;
+  if((slot = __jlog_cptable_find(ctx, s))) {
+    slot->state = JLOG_CPSLOT_FREE;
+    __sync_synchronize();
+    memset(slot->name, 0, sizeof(slot->name));
+  }
+  jlog_file_unlock(ctx->cptable_file);
+  if(!slot) {
+    errno = ENOENT;
+    return -1;
+  }
+  return 0;
+}
+
+static jlog_file *__jlog_open_reader(jlog_ctx *ctx, u_int32_t log) {
+  char file[MAXPATHLEN];
+
+  memset(file, 0, sizeof(file));
+  if(ctx->current_log != log) {
+    __jlog_close_reader(ctx);
+    __jlog_close_indexer(ctx);
+  }
+  if(ctx->data) {
+    return ctx->data;
+  }
+  STRSETDATAFILE(ctx, file, log);
+#ifdef DEBUG
+  fprintf(stderr, "opening log file[ro]: '%s'\n", file);
+#endif
+  ctx->data = jlog_file_open(file, 0, ctx->file_mode, ctx->multi_process);
+  ctx->current_log = log;
+  return ctx->data;
+}
+
+static int __jlog_munmap_reader(jlog_ctx *ctx) {
+  if(ctx->mmap_base) {
+    munmap(ctx->mmap_base, ctx->mmap_len);
+    ctx->mmap_base = NULL;
+    ctx->mmap_len = 0;
+  }
+  return 0;
+}
+
+static int __jlog_mmap_reader(jlog_ctx *ctx, u_int32_t log) {
+  if(ctx->current_log == log && ctx->mmap_base) return 0;
+  __jlog_open_reader(ctx, log);
+  if(!ctx->data)
+    return -1;
+  if (!jlog_file_map_read(ctx->data, &ctx->mmap_base, &ctx->mmap_len)) {
+    ctx->mmap_base = NULL;
+    ctx->last_error = JLOG_ERR_FILE_READ;
+    ctx->last_errno = errno;
+    return -1;
+  }
+#if defined(HAVE_MADVISE) && defined(MADV_SEQUENTIAL)
+  madvise(ctx->mmap_base, ctx->mmap_len, MADV_SEQUENTIAL);
+  madvise(ctx->mmap_base, ctx->mmap_len, MADV_WILLNEED);
+#endif
+  return 0;
+}
+
+/* readers are about to run off the end of a closed segment; get the
+ * next one coming off the disk before they fault on it */
+static void __jlog_readahead(jlog_ctx *ctx, u_int32_t log, u_int64_t data_off) {
+  char file[MAXPATHLEN];
+  jlog_file *next;
+
+  if(ctx->readahead_log == log + 1) return;
+  if(log >= ctx->meta->storage_log) return;
+  if(data_off < READAHEAD_THRESHOLD(JLOG_UNIT_LIMIT(ctx->meta))) return;
+  ctx->readahead_log = log + 1;
+
+  memset(file, 0, sizeof(file));
+  STRSETDATAFILE(ctx, file, log + 1);
+  if((next = jlog_file_open(file, 0, ctx->file_mode, ctx->multi_process))) {
+    jlog_file_willneed(next, 0, 0);
+    jlog_file_close(next);
+  }
+}
+
+static void __jlog_unmap_closed(jlog_closed_segment *seg) {
+  if(seg->idx_base) munmap((void *)seg->idx_base, seg->idx_len);
+  if(seg->data_base) munmap(seg->data_base, seg->data_len);
+  memset(seg, 0, sizeof(*seg));
+}
+
+static void __jlog_release_closed(jlog_ctx *ctx) {
+  int i;
+  for(i = 0; i < JLOG_CLOSED_CACHE; i++) __jlog_unmap_closed(&ctx->closed[i]);
+}
+
+static jlog_closed_segment *__jlog_find_closed(jlog_ctx *ctx, u_int32_t log) {
+  jlog_closed_segment *seg;
+  int i;
+  for(i = 0; i < JLOG_CLOSED_CACHE; i++) {
+    seg = &ctx->closed[i];
+    if(!seg->data_base || seg->log != log) continue;
+    /* a segment recycled since we mapped it has lost its name (names
+     * are never reused), and the spare may be refilled under us */
+    if(seg->spare_gen != ctx->meta->spare_tail) {
+      if(!__jlog_segment_exists(ctx, log)) {
+        __jlog_unmap_closed(seg);
+        return NULL;
+      }
+      seg->spare_gen = ctx->meta->spare_tail;
+    }
+    seg->used = ++ctx->closed_tick;
+    return seg;
+  }
+  return NULL;
+}
+
+/* our checkpoint has moved on to log: the segments behind it will not
+ * be read again, and any since unlinked or recycled are only pinning
+ * their pages, so let them go rather than wait to be evicted */
+static void __jlog_prune_closed(jlog_ctx *ctx, u_int32_t log) {
+  jlog_closed_segment *seg;
+  int i;
+
+  if(log == ctx->closed_pruned) return;
+  ctx->closed_pruned = log;
+  for(i = 0; i < JLOG_CLOSED_CACHE; i++) {
+    seg = &ctx->closed[i];
+    if(!seg->data_base) continue;
+    if(seg->log < log || !__jlog_segment_exists(ctx, seg->log))
+      __jlog_unmap_closed(seg);
+  }
+}
+
+/* called once resync has seen the close marker on log; from here on
+ * reads and resyncs of that segment need neither locks nor fstat */
+static void __jlog_map_closed(jlog_ctx *ctx, u_int32_t log) {
+  char file[MAXPATHLEN];
+  void *idx_base, *data_base;
+  size_t idx_len, data_len, len;
+  u_int64_t *idx;
+  u_int32_t last_marker, spare_gen;
+  jlog_closed_segment *seg;
+  int i;
+
+  if(__jlog_find_closed(ctx, log)) return;
+  /* read before mapping, so a recycle racing us is noticed next time */
+  spare_gen = ctx->meta->spare_tail;
+  __sync_synchronize();
+
+  memset(file, 0, sizeof(file));
+  STRSETDATAFILE(ctx, file, log);
+  len = strlen(file);
+  if(IS_FIXED_RECORDS(ctx)) {
+    /* resync has already checked the segment ends on a whole record */
+    if(!jlog_map_path_read(file, &data_base, &data_len)) return;
+    idx_base = NULL;
+    idx_len = 0;
+    last_marker = data_len / FIXED_STRIDE(ctx);
+    goto install;
+  }
+  if((len + sizeof(INDEX_EXT)) > sizeof(file)) return;
+  memcpy(file + len, INDEX_EXT, sizeof(INDEX_EXT));
+  if(!jlog_map_path_read(file, &idx_base, &idx_len)) return;
+  idx = idx_base;
+  /* only a record followed by the close marker counts; an empty
+   * segment has no marker to distinguish it from an open one */
+  if(idx_len % sizeof(u_int64_t) || idx_len < 2 * sizeof(u_int64_t) ||
+     (IS_SPARSE_INDEX(ctx) ?
+        idx_len < 3 * sizeof(u_int64_t) ||
+        idx[idx_len / sizeof(u_int64_t) - 2] != JLOG_SPARSE_CLOSE :
+        idx[idx_len / sizeof(u_int64_t) - 1] != 0)) {
+    munmap(idx_base, idx_len);
+    return;
+  }
+  file[len] = '\0';
+  if(!jlog_map_path_read(file, &data_base, &data_len)) {
+    munmap(idx_base, idx_len);
+    return;
+  }
+  if(IS_SPARSE_INDEX(ctx))
+    last_marker = JLOG_SPARSE_COUNT(idx[idx_len / sizeof(u_int64_t) - 1]);
+  else last_marker = idx_len / sizeof(u_int64_t) - 1;
+ install:
+  /* an empty slot, or else the least recently used */
+  seg = &ctx->closed[0];
+  for(i = 0; i < JLOG_CLOSED_CACHE && seg->data_base; i++) {
+    if(!ctx->closed[i].data_base || ctx->closed[i].used < seg->used)
+      seg = &ctx->closed[i];
+  }
+  __jlog_unmap_closed(seg);
+  seg->log = log;
+  seg->last_marker = last_marker;
+  seg->used = ++ctx->closed_tick;
+  seg->spare_gen = spare_gen;
+  seg->idx_base = idx_base;
+  seg->idx_len = idx_len;
+  seg->data_base = data_base;
+  seg->data_len = data_len;
+}
+
+/* where marker starts in a mapped closed segment; stepping forward from
+ * the indexed record before it if the index is sparse
+ * @return 0 on success, -1 if the index and data don't add up */
+static int __jlog_closed_offset(jlog_ctx *ctx, jlog_closed_segment *seg,
+                                u_int32_t marker, u_int64_t *off) {
+  const char *base = seg->data_base;
+  u_int32_t skip;
+  size_t span;
+
+  if(!seg->idx_base) {
+    *off = (u_int64_t)(marker - 1) * FIXED_STRIDE(ctx);
+    return *off < seg->data_len ? 0 : -1;
+  }
+  *off = seg->idx_base[(marker - 1) / INDEX_INTERVAL(ctx)];
+  if(*off == 0 && marker > INDEX_INTERVAL(ctx)) return -1;
+  for(skip = (marker - 1) % INDEX_INTERVAL(ctx); skip > 0; skip--) {
+    span = __jlog_record_span(ctx, seg->log, base + *off, base + seg->data_len);
+    if(!span) return -1;
+    *off += span;
+  }
+  return *off < seg->data_len ? 0 : -1;
+}
+
+/* returns 1 if the messages were read from the closed segment mapping,
+ * -1 on a definitive error, and 0 if the caller should take the usual
+ * locked path (not mapped, or something there didn't add up) */
+static int __jlog_read_closed(jlog_ctx *ctx, const jlog_id *id, int count, jlog_message *m) {
+  jlog_closed_segment *seg = __jlog_find_closed(ctx, id->log);
+  size_t hdr_size;
+  u_int64_t data_off = 0;
+  u_int32_t disk_len;
+  int i;
+
+  if(!seg) return 0;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(id->marker == seg->last_marker + 1) {
+    /* close tag; not a real offset */
+    ctx->last_error = JLOG_ERR_CLOSE_LOGID;
+    ctx->last_errno = 0;
+    return -1;
+  }
+  if(id->marker < 1 || id->marker + (count - 1) > seg->last_marker) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_LOGID;
+    ctx->last_errno = 0;
+    return -1;
+  }
+
+  for(i = 0; i < count; i++) {
+    jlog_message *msg = &m[i];
+
+    if(i == 0 && __jlog_closed_offset(ctx, seg, id->marker, &data_off) != 0)
+      goto fallback;
+    if(data_off >= seg->data_len)
+      goto fallback;
+    hdr_size = __jlog_parse_header(ctx, id->log,
+                                   ((u_int8_t *)seg->data_base) + data_off,
+                                   seg->data_len - data_off, 1,
+                                   &msg->aligned_header, &disk_len, NULL);
+    if(!hdr_size || data_off + hdr_size + disk_len > seg->data_len)
+      goto fallback;
+    msg->header = &msg->aligned_header;
+    msg->mess_len = msg->header->mlen;
+
+    if (WANT_DECOMPRESS(ctx)) {
+      if (ctx->mess_data_size < msg->aligned_header.mlen) {
+        ctx->mess_data = realloc(ctx->mess_data, msg->aligned_header.mlen * 2);
+        ctx->mess_data_size = msg->aligned_header.mlen * 2;
+      }
+      jlog_decompress((((char *)seg->data_base) + data_off + hdr_size),
+                      disk_len, ctx->mess_data, ctx->mess_data_size);
+      msg->mess = ctx->mess_data;
+    } else {
+      msg->mess_len = disk_len;
+      msg->mess = (((u_int8_t *)seg->data_base) + data_off + hdr_size);
+    }
+    data_off += hdr_size + disk_len;
+  }
+  __jlog_readahead(ctx, id->log, data_off);
+  return 1;
+
+ fallback:
+  /* the locked path knows how to repair; let it, and remap afterward */
+  __jlog_unmap_closed(seg);
+  return 0;
+}
+
+/* once the slowest subscriber has checkpointed past the front of a
+ * segment, those pages only crowd out the rest of the page cache */
+static void __jlog_drop_consumed(jlog_ctx *ctx, const jlog_id *id) {
+  jlog_id earliest;
+  u_int64_t off;
+
+  if(ctx->context_mode != JLOG_READ || id->marker < 1) return;
+  if(!ctx->data || ctx->current_log != id->log) return;
+  if(IS_FIXED_RECORDS(ctx))
+    off = (u_int64_t)(id->marker - 1) * FIXED_STRIDE(ctx);
+  else if(!ctx->index ||
+          !jlog_file_pread(ctx->index, &off, sizeof(off),
+                           (id->marker - 1) / INDEX_INTERVAL(ctx) *
+                             sizeof(u_int64_t)))
+    return;
+  /* only rescan the checkpoints every DONTNEED_CHUNK of progress */
+  if(ctx->dontneed_log == id->log && off < ctx->dontneed_off + DONTNEED_CHUNK)
+    return;
+  ctx->dontneed_log = id->log;
+  ctx->dontneed_off = off;
+
+  if(__jlog_scan_checkpoints(ctx, id->log, &earliest) < 0) return;
+  if(earliest.log != id->log || earliest.marker < 1) return;
+  if(earliest.marker != id->marker) {
+    if(IS_FIXED_RECORDS(ctx))
+      off = (u_int64_t)(earliest.marker - 1) * FIXED_STRIDE(ctx);
+    else if(!jlog_file_pread(ctx->index, &off, sizeof(off),
+                             (earliest.marker - 1) / INDEX_INTERVAL(ctx) *
+                               sizeof(u_int64_t)))
+      return;
+  }
+  if(off > 0) jlog_file_dontneed(ctx->data, 0, off);
+}
+
+static jlog_file *__jlog_open_writer(jlog_ctx *ctx) {
+  char file[MAXPATHLEN] = {0};
+
+  if(ctx->data) {
+    /* Still open */
+    return ctx->data;
+  }
+
+  FASSERT(ctx != NULL, "__jlog_open_writer");
+  if(!jlog_file_lock(ctx->metastore))
+    SYS_FAIL(JLOG_ERR_LOCK);
+  int x;
+  x = __jlog_restore_metastore(ctx, 1);
+  if(x) {
+    FASSERT(x == 0, "__jlog_open_writer calls jlog_restore_metastore");
+    SYS_FAIL(JLOG_ERR_META_OPEN);
+  }
+  ctx->current_log =  ctx->meta->storage_log;
+  STRSETDATAFILE(ctx, file, ctx->current_log);
+#ifdef DEBUG
+  fprintf(stderr, "opening log file[rw]: '%s'\n", file);
+#endif
   ctx->data = jlog_file_open(file, O_CREAT, ctx->file_mode, ctx->multi_process);
   FASSERT(ctx->data != NULL, "__jlog_open_writer calls jlog_file_open");
   if ( ctx->data == NULL )
@@ -990,6 +2230,19 @@ static int __jlog_close_checkpoint(jlog_ctx *ctx) {
   return 0;
 }
 
+static int __jlog_close_lease(jlog_ctx *ctx) {
+  if (ctx->lease) {
+    jlog_file_close(ctx->lease);
+    ctx->lease = NULL;
+  }
+  if (ctx->lease_fd >= 0) {
+    close(ctx->lease_fd);
+    ctx->lease_fd = -1;
+  }
+  ctx->lease_token = 0;
+  return 0;
+}
+
 static jlog_file *__jlog_open_indexer(jlog_ctx *ctx, u_int32_t log) {
   char file[MAXPATHLEN];
   int len;
@@ -1023,31 +2276,171 @@ static int __jlog_close_indexer(jlog_ctx *ctx) {
   return 0;
 }
 
+/* with fixed-size records there is no index to bring up to date: the
+ * last marker is however many whole records the segment holds */
+static int
+__jlog_resync_fixed(jlog_ctx *ctx, u_int32_t log, jlog_id *last, int *closed)
+{
+  off_t data_len;
+  int is_closed;
+
+  /* the writer fills a segment before moving storage_log past it, so
+   * once that is seen the length read next is the final one */
+  is_closed = log < ctx->meta->storage_log;
+  if ((data_len = jlog_file_size(ctx->data)) == -1)
+    SYS_FAIL(JLOG_ERR_FILE_SEEK);
+  if (is_closed && data_len % FIXED_STRIDE(ctx)) {
+#ifdef DEBUG
+    fprintf(stderr, "closed segment holds a partial record\n");
+#endif
+    SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
+  }
+  if(last) {
+    last->log = log;
+    last->marker = data_len / FIXED_STRIDE(ctx);
+  }
+  if(closed) *closed = is_closed;
+  if(is_closed && ctx->context_mode == JLOG_READ) __jlog_map_closed(ctx, log);
+ finish:
+  if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
+  return -1;
+}
+
+/* file names segment log's index of the records tagged tag
+ * @return 0, -1 if the path doesn't fit */
+static int __jlog_tag_index_filename(jlog_ctx *ctx, char *file, u_int32_t log,
+                                     u_int8_t tag) {
+  int len;
+
+  memset(file, 0, MAXPATHLEN);
+  STRSETDATAFILE(ctx, file, log);
+  len = strlen(file);
+  if((len + sizeof(TAGIDX_EXT) + 2) > MAXPATHLEN) return -1;
+  memcpy(file + len, TAGIDX_EXT, sizeof(TAGIDX_EXT) - 1);
+  len += sizeof(TAGIDX_EXT) - 1;
+  file[len++] = __jlog_hexchars[tag >> 4];
+  file[len++] = __jlog_hexchars[tag & 0xf];
+  file[len] = '\0';
+  return 0;
+}
+
+/* only v3 headers carry tags, so other jlogs never have tag indexes */
+static void __jlog_unlink_tag_indexes(jlog_ctx *ctx, u_int32_t log) {
+  char file[MAXPATHLEN];
+  int tag;
+
+  if(!IS_COMPACT_HEADERS(ctx)) return;
+  for(tag = 1; tag < 256; tag++)
+    if(JLOG_TAG_USED(ctx->meta, tag) &&
+       __jlog_tag_index_filename(ctx, file, log, tag) == 0) unlink(file);
+}
+
+static int __jlog_tag_mark_cmp(const void *a, const void *b) {
+  const jlog_tag_mark *l = a, *r = b;
+  if(l->tag != r->tag) return l->tag < r->tag ? -1 : 1;
+  if(l->marker != r->marker) return l->marker < r->marker ? -1 : 1;
+  return 0;
+}
+
+static int __jlog_tag_mark_cmp_marker(const void *a, const void *b) {
+  const jlog_tag_mark *l = a, *r = b;
+  if(l->marker != r->marker) return l->marker < r->marker ? -1 : 1;
+  return 0;
+}
+
+static int __jlog_tag_mark_pend(jlog_ctx *ctx, u_int32_t marker, u_int8_t tag) {
+  if(ctx->tag_pend_len == ctx->tag_pend_alloc) {
+    size_t n = ctx->tag_pend_alloc ? ctx->tag_pend_alloc * 2 : 64;
+    jlog_tag_mark *p = realloc(ctx->tag_pend, n * sizeof(*p));
+    if(!p) return -1;
+    ctx->tag_pend = p;
+    ctx->tag_pend_alloc = n;
+  }
+  ctx->tag_pend[ctx->tag_pend_len].marker = marker;
+  ctx->tag_pend[ctx->tag_pend_len].tag = tag;
+  ctx->tag_pend_len++;
+  return 0;
+}
+
+/* appends the pending tagged records to segment log's tag indexes; the
+ * caller holds the segment's index lock.  A record may be pended again
+ * after a restart, so only markers past an index's last one go in */
+static int __jlog_flush_tag_marks(jlog_ctx *ctx, u_int32_t log) {
+  char file[MAXPATHLEN];
+  u_int32_t buf[BUFFERED_INDICES], lastm;
+  size_t i = 0, n;
+  u_int8_t tag;
+  jlog_file *f;
+  off_t len;
+  int ok;
+
+  if(!ctx->tag_pend_len) return 0;
+  qsort(ctx->tag_pend, ctx->tag_pend_len, sizeof(*ctx->tag_pend),
+        __jlog_tag_mark_cmp);
+  while(i < ctx->tag_pend_len) {
+    tag = ctx->tag_pend[i].tag;
+    if(__jlog_tag_index_filename(ctx, file, log, tag) != 0) return -1;
+    if(!JLOG_TAG_USED(ctx->meta, tag))
+      __sync_fetch_and_or(&ctx->meta->tags_used[tag >> 5], 1U << (tag & 31));
+    f = jlog_file_open(file, O_CREAT, ctx->file_mode, ctx->multi_process);
+    if(!f) return -1;
+    lastm = 0;
+    ok = (len = jlog_file_size(f)) >= 0;
+    /* an append cut short is simply written over */
+    if(ok) len -= len % sizeof(u_int32_t);
+    if(ok && len)
+      ok = jlog_file_pread(f, &lastm, sizeof(lastm), len - sizeof(lastm));
+    for(n = 0; ok && i < ctx->tag_pend_len && ctx->tag_pend[i].tag == tag;
+        i++) {
+      if(ctx->tag_pend[i].marker <= lastm) continue;
+      buf[n++] = ctx->tag_pend[i].marker;
+      if(n == BUFFERED_INDICES) {
+        ok = jlog_file_pwrite(f, buf, n * sizeof(*buf), len);
+        len += n * sizeof(*buf);
+        n = 0;
+      }
+    }
+    if(ok && n) ok = jlog_file_pwrite(f, buf, n * sizeof(*buf), len);
+    jlog_file_close(f);
+    if(!ok) return -1;
+  }
+  ctx->tag_pend_len = 0;
+  return 0;
+}
+
 static int
 ___jlog_resync_index(jlog_ctx *ctx, u_int32_t log, jlog_id *last, int *closed) 
 {
   u_int64_t indices[BUFFERED_INDICES];
   jlog_message_header_compressed logmhdr;
-  uint32_t *message_disk_len = &logmhdr.mlen;
+  u_int32_t disk_len, marker, interval;
   off_t index_off, data_off, data_len, recheck_data_len;
-  size_t hdr_size = sizeof(jlog_message_header);
-  u_int64_t index;
-  int i, second_try = 0;
-
-  if (IS_COMPRESS_MAGIC(ctx)) {
-    hdr_size = sizeof(jlog_message_header_compressed);
-    message_disk_len = &logmhdr.compressed_len;
-  }
+  ssize_t hdr_size;
+  u_int64_t index, tail[2];
+  int i, second_try = 0, is_closed = 0;
+  jlog_closed_segment *seg;
+  u_int8_t tag;
 
   ctx->last_error = JLOG_ERR_SUCCESS;
   if(closed) *closed = 0;
 
+  if((seg = __jlog_find_closed(ctx, log)) != NULL) {
+    if(last) {
+      last->log = log;
+      last->marker = seg->last_marker;
+    }
+    if(closed) *closed = 1;
+    return 0;
+  }
+
   __jlog_open_reader(ctx, log);
   if (!ctx->data) {
     ctx->last_error = JLOG_ERR_FILE_OPEN;
     ctx->last_errno = errno;
     return -1;
   }
+  if (IS_FIXED_RECORDS(ctx))
+    return __jlog_resync_fixed(ctx, log, last, closed);
 
 #define RESTART do { \
   if (second_try == 0) { \
@@ -1061,6 +2454,7 @@ ___jlog_resync_index(jlog_ctx *ctx, u_int32_t log, jlog_id *last, int *closed)
 } while (0)
 
 restart:
+  ctx->tag_pend_len = 0;
   __jlog_open_indexer(ctx, log);
   if (!ctx->index) {
     ctx->last_error = JLOG_ERR_IDX_OPEN;
@@ -1074,6 +2468,8 @@ restart:
   }
 
   data_off = 0;
+  marker = 1;  /* of the record at data_off */
+  interval = INDEX_INTERVAL(ctx);
   if ((data_len = jlog_file_size(ctx->data)) == -1)
     SYS_FAIL(JLOG_ERR_FILE_SEEK);
   if ((index_off = jlog_file_size(ctx->index)) == -1)
@@ -1086,7 +2482,26 @@ restart:
     RESTART;
   }
 
-  if (index_off > sizeof(u_int64_t)) {
+  if (IS_SPARSE_INDEX(ctx) && index_off > sizeof(u_int64_t)) {
+    if (!jlog_file_pread(ctx->index, tail, sizeof(tail),
+                         index_off - sizeof(tail)))
+    {
+      SYS_FAIL(JLOG_ERR_IDX_READ);
+    }
+    if (tail[0] == JLOG_SPARSE_CLOSE) {
+      if(last) {
+        last->log = log;
+        last->marker = JLOG_SPARSE_COUNT(tail[1]);
+      }
+      if(closed) *closed = 1;
+      is_closed = 1;
+      goto finish;
+    }
+    if (tail[1] > data_len)
+      RESTART;
+    data_off = tail[1];
+  }
+  else if (index_off > sizeof(u_int64_t)) {
     if (!jlog_file_pread(ctx->index, &index, sizeof(index),
                          index_off - sizeof(u_int64_t)))
     {
@@ -1102,6 +2517,7 @@ restart:
         last->marker = (index_off / sizeof(u_int64_t)) - 1;
       }
       if(closed) *closed = 1;
+      is_closed = 1;
       goto finish;
     } else {
       if (index > data_len) {
@@ -1116,33 +2532,51 @@ restart:
 
   if (index_off > 0) {
     /* We are adding onto a partial index so we must advance a record */
-    if (!jlog_file_pread(ctx->data, &logmhdr, hdr_size, data_off))
+    hdr_size = __jlog_pread_header(ctx, ctx->data, log, data_off, data_len,
+                                   0, &logmhdr, &disk_len, NULL);
+    if (hdr_size < 0)
       SYS_FAIL(JLOG_ERR_FILE_READ);
-    if ((data_off += hdr_size + *message_disk_len) > data_len)
+    if (hdr_size == 0 || (data_off += hdr_size + disk_len) > data_len)
       RESTART;
+    marker = (index_off / sizeof(u_int64_t) - 1) * interval + 2;
   }
 
   i = 0;
-  while (data_off + hdr_size <= data_len) {
+  while (data_off + (off_t)__jlog_min_header(ctx) <= data_len) {
     off_t next_off = data_off;
 
-    if (!jlog_file_pread(ctx->data, &logmhdr, hdr_size, data_off))
+    hdr_size = __jlog_pread_header(ctx, ctx->data, log, data_off, data_len,
+                                   0, &logmhdr, &disk_len, &tag);
+    if (hdr_size < 0)
       SYS_FAIL(JLOG_ERR_FILE_READ);
-    if (logmhdr.reserved != ctx->meta->hdr_magic) {
+    if (hdr_size == 0) {
+      /* a v3 header may just not be all there yet */
+      if (IS_COMPACT_HEADERS(ctx) && data_len - data_off < JLOG_V3_MAX_HDR)
+        break;
 #ifdef DEBUG
-      fprintf(stderr, "logmhdr.reserved == %d\n", logmhdr.reserved);
+      fprintf(stderr, "bad record header at %llu\n", data_off);
 #endif
       SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
     }
-    if ((next_off += hdr_size + *message_disk_len) > data_len)
+    if ((next_off += hdr_size + disk_len) > data_len)
       break;
+    if (tag && __jlog_tag_mark_pend(ctx, marker, tag) != 0)
+      SYS_FAIL(JLOG_ERR_IDX_WRITE);
 
+    /* a sparse index only takes every interval'th record */
+    if ((marker++ - 1) % interval) {
+      data_off = next_off;
+      continue;
+    }
     /* Write our new index offset */
     indices[i++] = data_off;
     if(i >= BUFFERED_INDICES) {
 #ifdef DEBUG
       fprintf(stderr, "writing %i offsets\n", i);
 #endif
+      /* tags go first: indexed records are never looked at again */
+      if (__jlog_flush_tag_marks(ctx, log) != 0)
+        SYS_FAIL(JLOG_ERR_IDX_WRITE);
       if (!jlog_file_pwrite(ctx->index, indices, i * sizeof(u_int64_t), index_off))
         RESTART;
       index_off += i * sizeof(u_int64_t);
@@ -1150,6 +2584,8 @@ restart:
     }
     data_off = next_off;
   }
+  if (__jlog_flush_tag_marks(ctx, log) != 0)
+    SYS_FAIL(JLOG_ERR_IDX_WRITE);
   if(i > 0) {
 #ifdef DEBUG
     fprintf(stderr, "writing %i offsets\n", i);
@@ -1160,7 +2596,7 @@ restart:
   }
   if(last) {
     last->log = log;
-    last->marker = index_off / sizeof(u_int64_t);
+    last->marker = marker - 1;
   }
   if(log < ctx->meta->storage_log) {
 
@@ -1196,13 +2632,21 @@ restart:
      * we can't write the closing marker if the data segment had no records
      * in it, since it will be confused with an index to offset 0 by the
      * next reader; this only happens when segments are repaired */
-    if (index_off) {
+    if (index_off && IS_SPARSE_INDEX(ctx)) {
+      tail[0] = JLOG_SPARSE_CLOSE;
+      tail[1] = JLOG_SPARSE_TAIL(marker - 1, interval);
+      if (!jlog_file_pwrite(ctx->index, tail, sizeof(tail), index_off))
+        RESTART;
+      index_off += sizeof(tail);
+    }
+    else if (index_off) {
       index = 0;
       if (!jlog_file_pwrite(ctx->index, &index, sizeof(u_int64_t), index_off))
         RESTART;
       index_off += sizeof(u_int64_t);
     }
     if(closed) *closed = 1;
+    is_closed = 1;
   }
 #undef RESTART
 
@@ -1211,7 +2655,10 @@ finish:
 #ifdef DEBUG
   fprintf(stderr, "index is %s\n", closed?(*closed?"closed":"open"):"unknown");
 #endif
-  if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
+  if(ctx->last_error == JLOG_ERR_SUCCESS) {
+    if(is_closed && ctx->context_mode == JLOG_READ) __jlog_map_closed(ctx, log);
+    return 0;
+  }
   return -1;
 }
 
@@ -1226,6 +2673,10 @@ static int __jlog_resync_index(jlog_ctx *ctx, u_int32_t log, jlog_id *last, int
     /* We can't fix the file if someone may write to it again */
     if(log >= ctx->meta->storage_log) break;
 
+    if(IS_FIXED_RECORDS(ctx)) {
+      jlog_repair_datafile(ctx, log);
+      continue;
+    }
     jlog_file_lock(ctx->index);
     /* it doesn't really matter what jlog_repair_datafile returns
      * we'll keep retrying anyway */
@@ -1239,16 +2690,23 @@ static int __jlog_resync_index(jlog_ctx *ctx, u_int32_t log, jlog_id *last, int
 jlog_ctx *jlog_new(const char *path) {
   jlog_ctx *ctx;
   ctx = calloc(1, sizeof(*ctx));
+  if(!ctx) return NULL;
+  if(!(ctx->path = strdup(path))) {
+    free(ctx);
+    return NULL;
+  }
   ctx->meta = &ctx->pre_init;
   ctx->pre_init.unit_limit = DEFAULT_UNIT_LIMIT;
   ctx->pre_init.safety = DEFAULT_SAFETY;
   ctx->pre_init.hdr_magic = DEFAULT_HDR_MAGIC;
   ctx->file_mode = DEFAULT_FILE_MODE;
   ctx->context_mode = JLOG_NEW;
-  ctx->path = strdup(path);
   ctx->desired_pre_commit_buffer_len = PRE_COMMIT_BUFFER_SIZE_DEFAULT;
   ctx->pre_commit_buffer_size_specified = 0;
   ctx->multi_process = 1;
+  ctx->wait_fd = -1;
+  ctx->lease_fd = -1;
+  ctx->cpslot = -1;
   pthread_mutex_init(&ctx->write_lock, NULL);
   //  fassertxsetpath(path);
   return ctx;
@@ -1286,7 +2744,11 @@ size_t jlog_raw_size(jlog_ctx *ctx) {
 }
 
 const char *jlog_ctx_err_string(jlog_ctx *ctx) {
-  switch (ctx->last_error) {
+  return jlog_err_string(ctx->last_error);
+}
+
+const char *jlog_err_string(jlog_err err) {
+  switch (err) {
 #define MSG_O_MATIC(x)  case x: return #x;
     MSG_O_MATIC( JLOG_ERR_SUCCESS);
     MSG_O_MATIC( JLOG_ERR_ILLEGAL_INIT);
@@ -1346,6 +2808,25 @@ int jlog_ctx_alter_safety(jlog_ctx *ctx, jlog_safety safety) {
   return -1;
 }
 
+int jlog_ctx_alter_spare_segments(jlog_ctx *ctx, u_int32_t count) {
+  if(ctx->meta->spare_limit == count) return 0;
+  if(ctx->context_mode == JLOG_APPEND ||
+     ctx->context_mode == JLOG_NEW) {
+    if(ctx->context_mode == JLOG_APPEND && __jlog_extend_metastore(ctx) != 0)
+      goto finish;
+    ctx->meta->spare_limit = count;
+    if(ctx->context_mode == JLOG_APPEND) {
+      if(__jlog_save_metastore(ctx, 0) != 0) {
+        FASSERT(0, "jlog_ctx_alter_spare_segments calls jlog_save_metastore");
+        SYS_FAIL(JLOG_ERR_CREATE_META);
+      }
+    }
+    return 0;
+  }
+ finish:
+  return -1;
+}
+
 int jlog_ctx_set_multi_process(jlog_ctx *ctx, uint8_t mp) {
   ctx->multi_process = mp;
   return 0;
@@ -1361,6 +2842,67 @@ int jlog_ctx_set_use_compression(jlog_ctx *ctx, uint8_t use) {
   return 0;
 }
 
+int jlog_ctx_set_checkpoint_table(jlog_ctx *ctx, uint8_t use) {
+  if(ctx->context_mode != JLOG_NEW) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
+    return -1;
+  }
+  if(use) ctx->pre_init.format_flags |= JLOG_FORMAT_CHECKPOINT_TABLE;
+  else ctx->pre_init.format_flags &= ~JLOG_FORMAT_CHECKPOINT_TABLE;
+  return 0;
+}
+int jlog_ctx_set_compact_headers(jlog_ctx *ctx, uint8_t use) {
+  if(ctx->context_mode != JLOG_NEW) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
+    return -1;
+  }
+  if(use) ctx->pre_init.format_flags |= JLOG_FORMAT_COMPACT_HEADERS;
+  else ctx->pre_init.format_flags &= ~JLOG_FORMAT_COMPACT_HEADERS;
+  return 0;
+}
+int jlog_ctx_set_nsec_timestamps(jlog_ctx *ctx, uint8_t use) {
+  if(ctx->context_mode != JLOG_NEW) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
+    return -1;
+  }
+  if(use) ctx->pre_init.format_flags |= JLOG_FORMAT_NSEC_TIME;
+  else ctx->pre_init.format_flags &= ~JLOG_FORMAT_NSEC_TIME;
+  return 0;
+}
+int jlog_ctx_set_fixed_record_size(jlog_ctx *ctx, u_int32_t size) {
+  if(ctx->context_mode != JLOG_NEW) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
+    return -1;
+  }
+  ctx->pre_init.record_size = size;
+  return 0;
+}
+int jlog_ctx_set_sparse_index(jlog_ctx *ctx, u_int32_t interval) {
+  if(ctx->context_mode != JLOG_NEW) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
+    return -1;
+  }
+  ctx->pre_init.index_interval = interval;
+  return 0;
+}
+int jlog_ctx_set_dedup_window(jlog_ctx *ctx, u_int32_t keys) {
+  if(ctx->context_mode != JLOG_NEW) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
+    return -1;
+  }
+  if(keys > DEDUP_MAX_KEYS) {
+    ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+    ctx->last_errno = EINVAL;
+    return -1;
+  }
+  ctx->pre_init.dedup_window = keys;
+  return 0;
+}
+int jlog_ctx_set_clock(jlog_ctx *ctx, jlog_clock clock) {
+  ctx->clock = clock;
+  ctx->batch_time = 0;
+  return 0;
+}
 int jlog_ctx_set_compression_provider(jlog_ctx *ctx, jlog_compression_provider_choice cp) {
   if ((ctx->pre_init.hdr_magic & DEFAULT_HDR_MAGIC_COMPRESSION) == DEFAULT_HDR_MAGIC_COMPRESSION) {
     /* compression mode is on, set the proper flag */
@@ -1376,6 +2918,54 @@ int jlog_ctx_set_pre_commit_buffer_size(jlog_ctx *ctx, size_t s) {
   return 0;
 }
 
+/* v3 records wait in the pre-commit buffer with absolute times; rewrite
+ * them against the base of the segment they are about to land at off in.
+ * Records only ever shrink, so the result fits in a buffer as large */
+static int __jlog_v3_rebase(jlog_ctx *ctx, off_t off, u_int8_t **out, size_t *len) {
+  u_int64_t base = 0;
+  ssize_t n;
+
+  if(ctx->v3_scratch_len < *len) {
+    free(ctx->v3_scratch);
+    if((ctx->v3_scratch = malloc(*len)) == NULL) {
+      ctx->v3_scratch_len = 0;
+      return -1;
+    }
+    ctx->v3_scratch_len = *len;
+  }
+  if(off > 0 && __jlog_segment_base(ctx, ctx->current_log, &base) != 0)
+    return -1;
+  n = __jlog_v3_reencode(ctx, ctx->pre_commit_buffer, *len, 0, off > 0, base,
+                         ctx->v3_scratch);
+  if(n < 0) return -1;
+  *out = ctx->v3_scratch;
+  *len = n;
+  return 0;
+}
+
+/* writes the pre-commit buffer out at *off in the locked data file and
+ * empties it; *off is advanced past what was written */
+static int __jlog_write_pre_commit(jlog_ctx *ctx, off_t *off) {
+  u_int8_t *out = ctx->pre_commit_buffer;
+  size_t len = (u_int8_t *)ctx->pre_commit_pos - out;
+
+  if(len > 0 && IS_COMPACT_HEADERS(ctx) &&
+     __jlog_v3_rebase(ctx, *off, &out, &len) != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if(!jlog_file_pwrite(ctx->data, out, len, *off)) return -1;
+  *off += len;
+  ctx->batch_time = 0;
+
+  /* rewind the pre_commit_buffer to beginning */
+  ctx->pre_commit_pos = ctx->pre_commit_buffer;
+  /* ensure we save this in the mmapped data */
+  *ctx->pre_commit_pointer = 0;
+  __jlog_notify_readers(ctx);
+  return 0;
+}
+
 static int 
 _jlog_ctx_flush_pre_commit_buffer_no_lock(jlog_ctx *ctx)
 {
@@ -1408,7 +2998,7 @@ _jlog_ctx_flush_pre_commit_buffer_no_lock(jlog_ctx *ctx)
 
   if ((current_offset = jlog_file_size(ctx->data)) == -1)
     SYS_FAIL(JLOG_ERR_FILE_SEEK);
-  if(ctx->meta->unit_limit <= current_offset) {
+  if(JLOG_UNIT_LIMIT(ctx->meta) <= (u_int64_t)current_offset) {
     jlog_file_unlock(ctx->data);
     __jlog_close_writer(ctx);
     __jlog_metastore_atomic_increment(ctx);
@@ -1416,21 +3006,12 @@ _jlog_ctx_flush_pre_commit_buffer_no_lock(jlog_ctx *ctx)
   }
 
   /* we have to flush our pre_commit_buffer out to the real log */
-  if (!jlog_file_pwrite(ctx->data, ctx->pre_commit_buffer, 
-                        ctx->pre_commit_pos - ctx->pre_commit_buffer, 
-                        current_offset)) {
+  if (__jlog_write_pre_commit(ctx, &current_offset) != 0) {
     FASSERT(0, "jlog_file_pwrite failed in jlog_ctx_write_message");
     SYS_FAIL(JLOG_ERR_FILE_WRITE);
   }
 
-  current_offset += ctx->pre_commit_pos - ctx->pre_commit_buffer;
-
-  /* rewind the pre_commit_buffer to beginning */
-  ctx->pre_commit_pos = ctx->pre_commit_buffer;
-  /* ensure we save this in the mmapped data */
-  *ctx->pre_commit_pointer = 0;
-
-  if(ctx->meta->unit_limit <= current_offset) {
+  if(JLOG_UNIT_LIMIT(ctx->meta) <= (u_int64_t)current_offset) {
     jlog_file_unlock(ctx->data);
     __jlog_close_writer(ctx);
     __jlog_metastore_atomic_increment(ctx);
@@ -1448,14 +3029,20 @@ int jlog_ctx_flush_pre_commit_buffer(jlog_ctx *ctx)
   pthread_mutex_lock(&ctx->write_lock);
   rv = _jlog_ctx_flush_pre_commit_buffer_no_lock(ctx);
   pthread_mutex_unlock(&ctx->write_lock);
+  __jlog_retain_if_due(ctx);
   return rv;
 }
 
 int jlog_ctx_alter_journal_size(jlog_ctx *ctx, size_t size) {
-  if(ctx->meta->unit_limit == size) return 0;
+  if(JLOG_UNIT_LIMIT(ctx->meta) == (u_int64_t)size) return 0;
   if(ctx->context_mode == JLOG_APPEND ||
      ctx->context_mode == JLOG_NEW) {
-    ctx->meta->unit_limit = size;
+    if(ctx->context_mode == JLOG_APPEND && ((u_int64_t)size >> 32) &&
+       __jlog_extend_metastore(ctx) != 0)
+      goto finish;
+    ctx->meta->unit_limit = (u_int64_t)size & 0xffffffff;
+    if(ctx->context_mode == JLOG_NEW || JLOG_META_EXTENDED(ctx->meta))
+      ctx->meta->unit_limit_hi = (u_int64_t)size >> 32;
     if(ctx->context_mode == JLOG_APPEND) {
       if(__jlog_save_metastore(ctx, 0) != 0) {
         FASSERT(0, "jlog_ctx_alter_journal_size calls jlog_save_metastore");
@@ -1467,6 +3054,30 @@ int jlog_ctx_alter_journal_size(jlog_ctx *ctx, size_t size) {
  finish:
   return -1;
 }
+int jlog_ctx_set_retention(jlog_ctx *ctx, u_int32_t max_age,
+                           u_int64_t max_bytes) {
+  if(ctx->context_mode == JLOG_APPEND ||
+     ctx->context_mode == JLOG_NEW) {
+    if(ctx->context_mode == JLOG_APPEND) {
+      /* turning off what was never on leaves an older metastore alone */
+      if(!max_age && !max_bytes && !JLOG_META_EXTENDED(ctx->meta)) return 0;
+      if(__jlog_extend_metastore(ctx) != 0) goto finish;
+    }
+    ctx->meta->retain_age = max_age;
+    ctx->meta->retain_bytes = max_bytes & 0xffffffff;
+    ctx->meta->retain_bytes_hi = max_bytes >> 32;
+    if(ctx->context_mode == JLOG_APPEND) {
+      if(__jlog_save_metastore(ctx, 0) != 0) {
+        FASSERT(0, "jlog_ctx_set_retention calls jlog_save_metastore");
+        SYS_FAIL(JLOG_ERR_CREATE_META);
+      }
+    }
+    return 0;
+  }
+  ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
+ finish:
+  return -1;
+}
 int jlog_ctx_alter_mode(jlog_ctx *ctx, int mode) {
   ctx->file_mode = mode;
   return 0;
@@ -1560,6 +3171,8 @@ int jlog_ctx_open_reader(jlog_ctx *ctx, const char *subscriber) {
   }
   if(jlog_get_checkpoint(ctx, ctx->subscriber_name, &dummy))
     SYS_FAIL(JLOG_ERR_INVALID_SUBSCRIBER);
+  if(__jlog_load_tag_filter(ctx) != 0)
+    SYS_FAIL(JLOG_ERR_OPEN);
   if(__jlog_restore_metastore(ctx, 0)) {
     FASSERT(0, "jlog_ctx_open_reader calls jlog_restore_metastore");
     SYS_FAIL(JLOG_ERR_META_OPEN);
@@ -1585,6 +3198,13 @@ int jlog_ctx_init(jlog_ctx *ctx) {
     ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
     return -1;
   }
+  if(ctx->pre_init.record_size &&
+     ((ctx->pre_init.hdr_magic & DEFAULT_HDR_MAGIC_COMPRESSION) ==
+        DEFAULT_HDR_MAGIC_COMPRESSION ||
+      (ctx->pre_init.format_flags & JLOG_FORMAT_COMPACT_HEADERS))) {
+    ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+    return -1;
+  }
   ctx->context_mode = JLOG_INIT;
   while((rv = stat(ctx->path, &sb)) == -1 && errno == EINTR);
   if(rv == 0 || errno != ENOENT) {
@@ -1603,10 +3223,16 @@ int jlog_ctx_init(jlog_ctx *ctx) {
     FASSERT(0, "jlog_ctx_init calls jlog_open_metastore");
     SYS_FAIL(JLOG_ERR_CREATE_META);
   }
+  if(__jlog_meta_wants_ext(ctx->meta)) ctx->meta->meta_ext = JLOG_META_EXT;
   if(__jlog_save_metastore(ctx, 0) != 0) {
     FASSERT(0, "jlog_ctx_init calls jlog_save_metastore");
     SYS_FAIL(JLOG_ERR_CREATE_META);
   }
+  if((ctx->meta->format_flags & JLOG_FORMAT_CHECKPOINT_TABLE) &&
+     __jlog_create_cptable(ctx) != 0)
+    SYS_FAIL(JLOG_ERR_CREATE_META);
+  if(ctx->meta->dedup_window && __jlog_create_dedup(ctx) != 0)
+    SYS_FAIL(JLOG_ERR_CREATE_META);
   //  FASSERT(0, "Start of fassert log");
  finish:
   FASSERT(ctx->last_error == JLOG_ERR_SUCCESS, "jlog_ctx_init failed");
@@ -1615,6 +3241,9 @@ int jlog_ctx_init(jlog_ctx *ctx) {
 }
 
 int jlog_ctx_close(jlog_ctx *ctx) {
+  __jlog_prefetch_stop(ctx);
+  jlog_ctx_flush_checkpoint(ctx);
+  __jlog_reclaim_stop(ctx);
   jlog_ctx_flush_pre_commit_buffer(ctx);
   __jlog_close_writer(ctx);
   __jlog_close_pre_commit(ctx);
@@ -1622,6 +3251,15 @@ int jlog_ctx_close(jlog_ctx *ctx) {
   __jlog_close_reader(ctx);
   __jlog_close_metastore(ctx);
   __jlog_close_checkpoint(ctx);
+  __jlog_group_release(ctx);
+  __jlog_close_lease(ctx);
+  __jlog_close_cptable(ctx);
+  __jlog_close_dedup(ctx);
+  __jlog_release_closed(ctx);
+  if(ctx->wait_fd >= 0) close(ctx->wait_fd);
+  if(ctx->v3_scratch) free(ctx->v3_scratch);
+  free(ctx->tag_pend);
+  free(ctx->tag_marks);
   if(ctx->subscriber_name) free(ctx->subscriber_name);
   if(ctx->path) free(ctx->path);
   free(ctx);
@@ -1630,6 +3268,7 @@ int jlog_ctx_close(jlog_ctx *ctx) {
 
 static int __jlog_metastore_atomic_increment(jlog_ctx *ctx) {
   char file[MAXPATHLEN] = {0};
+  int rolled = 0;
 
 #ifdef DEBUG
   fprintf(stderr, "atomic increment on %u\n", ctx->current_log);
@@ -1647,6 +3286,7 @@ static int __jlog_metastore_atomic_increment(jlog_ctx *ctx) {
     /* We're the first ones to it, so we get to increment it */
     ctx->current_log++;
     STRSETDATAFILE(ctx, file, ctx->current_log);
+    __jlog_take_spare(ctx, file);
     ctx->data = jlog_file_open(file, O_CREAT, ctx->file_mode, ctx->multi_process);
     ctx->meta->storage_log = ctx->current_log;
     if(__jlog_save_metastore(ctx, 1)) {
@@ -1654,6 +3294,7 @@ static int __jlog_metastore_atomic_increment(jlog_ctx *ctx) {
               "jlog_metastore_atomic_increment calls jlog_save_metastore");
       SYS_FAIL(JLOG_ERR_META_OPEN);
     }
+    rolled = 1;
   }
  finish:
   jlog_file_unlock(ctx->metastore);
@@ -1661,13 +3302,93 @@ static int __jlog_metastore_atomic_increment(jlog_ctx *ctx) {
    * it may have advanced farther than we know.
    */
   ctx->current_log = ctx->meta->storage_log;
-  if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
-  return -1;
+  if(ctx->last_error != JLOG_ERR_SUCCESS) return -1;
+  /* retention works a segment at a time, so whoever starts one checks
+   * it, once write_lock is dropped (see __jlog_retain_if_due) */
+  if(rolled && (ctx->meta->retain_age || JLOG_RETAIN_BYTES(ctx->meta)))
+    ctx->retain_due = 1;
+  return 0;
 }
 
-int jlog_ctx_write_message(jlog_ctx *ctx, jlog_message *mess, struct timeval *when) {
-  struct timeval now;
+/* retention owed since a rollover, run by a writer after it lets go of
+ * write_lock so the directory and checkpoint work never holds up the
+ * other writers; one thread at a time, and a failure there is no reason
+ * to fail the write */
+static void __jlog_retain_if_due(jlog_ctx *ctx) {
+  jlog_err save_error;
+  int save_errno;
+
+  if(!ctx->retain_due || __sync_lock_test_and_set(&ctx->retain_busy, 1))
+    return;
+  ctx->retain_due = 0;
+  save_error = ctx->last_error;
+  save_errno = ctx->last_errno;
+  jlog_ctx_enforce_retention(ctx);
+  ctx->last_error = save_error;
+  ctx->last_errno = save_errno;
+  __sync_lock_release(&ctx->retain_busy);
+}
+
+/* a cheap monotonic reading in ns for aging JLOG_CLOCK_BATCH's reading;
+ * always 0 without a coarse monotonic clock, so only the count bounds it */
+static u_int64_t __jlog_clock_mono(void) {
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC_COARSE)
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (u_int64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#else
+  return 0;
+#endif
+}
+
+/* the time for a message written without one, as ctx->clock says */
+static void __jlog_clock_read(jlog_ctx *ctx, struct timespec *ts) {
+  u_int64_t t;
+
+  if(ctx->clock == JLOG_CLOCK_BATCH && (t = ctx->batch_time) != 0 &&
+     __sync_add_and_fetch(&ctx->batch_uses, 1) < CLOCK_BATCH_USES &&
+     __jlog_clock_mono() - ctx->batch_mono < CLOCK_BATCH_NSEC) {
+    ts->tv_sec = t / 1000000000ULL;
+    ts->tv_nsec = t % 1000000000ULL;
+    return;
+  }
+#if HAVE_CLOCK_GETTIME
+#ifdef CLOCK_REALTIME_COARSE
+  if(ctx->clock == JLOG_CLOCK_COARSE)
+    clock_gettime(CLOCK_REALTIME_COARSE, ts);
+  else
+#endif
+    clock_gettime(CLOCK_REALTIME, ts);
+#else
+  {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    ts->tv_sec = now.tv_sec;
+    ts->tv_nsec = now.tv_usec * 1000;
+  }
+#endif
+  if(ctx->clock == JLOG_CLOCK_BATCH) {
+    ctx->batch_time = (u_int64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+    ctx->batch_uses = 0;
+    ctx->batch_mono = __jlog_clock_mono();
+  }
+}
+
+static const struct timespec *__jlog_timeval_ts(const struct timeval *tv,
+                                                struct timespec *ts) {
+  if(!tv) return NULL;
+  ts->tv_sec = tv->tv_sec;
+  ts->tv_nsec = tv->tv_usec * 1000;
+  return ts;
+}
+
+static int __jlog_write_message(jlog_ctx *ctx, jlog_message *mess,
+                                const struct timespec *when, int precompressed,
+                                u_int8_t tag) {
+  struct timespec now;
   jlog_message_header_compressed hdr;
+  u_int8_t v3hdr[JLOG_V3_MAX_HDR];
+  u_int64_t base;
   off_t current_offset = 0;
   size_t hdr_size = sizeof(jlog_message_header);
   int i = 0;
@@ -1682,20 +3403,32 @@ int jlog_ctx_write_message(jlog_ctx *ctx, jlog_message *mess, struct timeval *wh
     ctx->last_errno = EPERM;
     return -1;
   }
+  if(IS_FIXED_RECORDS(ctx) && mess->mess_len != ctx->meta->record_size) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EINVAL;
+    return -1;
+  }
+  /* only the v3 header has room for a tag */
+  if(tag && !IS_COMPACT_HEADERS(ctx)) {
+    ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+    ctx->last_errno = EINVAL;
+    return -1;
+  }
 
   /* build the data we want to write outside of any lock */
   hdr.reserved = ctx->meta->hdr_magic;
-  if (when) {
-    hdr.tv_sec = when->tv_sec;
-    hdr.tv_usec = when->tv_usec;
-  } else {
-    gettimeofday(&now, NULL);
-    hdr.tv_sec = now.tv_sec;
-    hdr.tv_usec = now.tv_usec;
+  if (!when) {
+    __jlog_clock_read(ctx, &now);
+    when = &now;
   }
+  hdr.tv_sec = when->tv_sec;
+  if (ctx->meta->format_flags & JLOG_FORMAT_NSEC_TIME)
+    hdr.tv_usec = when->tv_nsec;
+  else
+    hdr.tv_usec = when->tv_nsec / 1000;
 
   /* we store the original message size in the header */
-  hdr.mlen = mess->mess_len;
+  hdr.mlen = precompressed ? mess->header->mlen : mess->mess_len;
 
   struct iovec v[2];
   v[0].iov_base = (void *) &hdr;
@@ -1706,7 +3439,11 @@ int jlog_ctx_write_message(jlog_ctx *ctx, jlog_message *mess, struct timeval *wh
   v[1].iov_base = compress_space;
   size_t compressed_len = sizeof(compress_space);
 
-  if (IS_COMPRESS_MAGIC(ctx)) {
+  if (precompressed) {
+    hdr.compressed_len = mess->mess_len;
+    v[1].iov_base = mess->mess;
+    v[1].iov_len = mess->mess_len;
+  } else if (IS_COMPRESS_MAGIC(ctx)) {
     if (jlog_compress(mess->mess, mess->mess_len, (char **)&v[1].iov_base, &compressed_len) != 0) {
       FASSERT(0, "jlog_compress failed in jlog_ctx_write_message");
       SYS_FAIL(JLOG_ERR_FILE_WRITE);
@@ -1718,6 +3455,12 @@ int jlog_ctx_write_message(jlog_ctx *ctx, jlog_message *mess, struct timeval *wh
     v[1].iov_len = mess->mess_len;
   }
 
+  if (IS_COMPACT_HEADERS(ctx)) {
+    /* absolute for now; the delta needs to know where this will land */
+    v[0].iov_base = v3hdr;
+    v[0].iov_len = __jlog_v3_encode(ctx, v3hdr, &hdr, tag, 0, 0);
+  }
+
   size_t total_size = v[0].iov_len + v[1].iov_len;
 
   /* now grab the file lock and write to pre_commit or file depending */
@@ -1754,28 +3497,22 @@ int jlog_ctx_write_message(jlog_ctx *ctx, jlog_message *mess, struct timeval *wh
     if ((current_offset = jlog_file_size(ctx->data)) == -1)
       SYS_FAIL(JLOG_ERR_FILE_SEEK);
 
-    if(ctx->meta->unit_limit <= current_offset) {
+    if(JLOG_UNIT_LIMIT(ctx->meta) <= (u_int64_t)current_offset) {
       jlog_file_unlock(ctx->data);
       __jlog_close_writer(ctx);
       __jlog_metastore_atomic_increment(ctx);
-      if (IS_COMPRESS_MAGIC(ctx) && v[1].iov_base != compress_space) {
+      if (IS_COMPRESS_MAGIC(ctx) && !precompressed &&
+          v[1].iov_base != compress_space) {
         free(v[1].iov_base);
       }
       goto begin;
     }
 
     /* we have to flush our pre_commit_buffer out to the real log */
-    if (!jlog_file_pwrite(ctx->data, ctx->pre_commit_buffer, 
-                          ctx->pre_commit_pos - ctx->pre_commit_buffer, 
-                          current_offset)) {
+    if (__jlog_write_pre_commit(ctx, &current_offset) != 0) {
       FASSERT(0, "jlog_file_pwrite failed in jlog_ctx_write_message");
       SYS_FAIL(JLOG_ERR_FILE_WRITE);
     }
-
-    /* rewind the pre_commit_buffer to beginning */
-    ctx->pre_commit_pos = ctx->pre_commit_buffer;
-    /* ensure we save this in the mmapped data */
-    *ctx->pre_commit_pointer = 0;
   }
  
   if (total_size <= ctx->pre_commit_buffer_len) {
@@ -1791,33 +3528,105 @@ int jlog_ctx_write_message(jlog_ctx *ctx, jlog_message *mess, struct timeval *wh
     }
   } else {
     /* incoming message won't fit in pre_commit buffer, write directly */
+    if (IS_COMPACT_HEADERS(ctx) && current_offset > 0) {
+      if (__jlog_segment_base(ctx, ctx->current_log, &base) != 0)
+        SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
+      v[0].iov_len = __jlog_v3_encode(ctx, v3hdr, &hdr, tag, 1, base);
+    }
     if (!jlog_file_pwritev(ctx->data, v, 2, current_offset)) {
       FASSERT(0, "jlog_file_pwritev failed in jlog_ctx_write_message");
       SYS_FAIL(JLOG_ERR_FILE_WRITE);
     }
+    __jlog_notify_readers(ctx);
   }
 
   current_offset += v[0].iov_len + v[1].iov_len;
   
-  if (IS_COMPRESS_MAGIC(ctx) && v[1].iov_base != compress_space) {
+  if (IS_COMPRESS_MAGIC(ctx) && !precompressed &&
+      v[1].iov_base != compress_space) {
     free(v[1].iov_base);
   }
 
-  if(ctx->meta->unit_limit <= current_offset) {
+  if(JLOG_UNIT_LIMIT(ctx->meta) <= (u_int64_t)current_offset) {
     jlog_file_unlock(ctx->data);
     __jlog_close_writer(ctx);
     __jlog_metastore_atomic_increment(ctx);
     pthread_mutex_unlock(&ctx->write_lock);
+    __jlog_retain_if_due(ctx);
     return 0;
   }
  finish:
   jlog_file_unlock(ctx->data);
   pthread_mutex_unlock(&ctx->write_lock);
-  if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
+  if(ctx->last_error == JLOG_ERR_SUCCESS) {
+    __jlog_retain_if_due(ctx);
+    return 0;
+  }
   return -1;
 }
 
+int jlog_ctx_write_message(jlog_ctx *ctx, jlog_message *mess, struct timeval *when) {
+  struct timespec ts;
+  return __jlog_write_message(ctx, mess, __jlog_timeval_ts(when, &ts), 0, 0);
+}
+
+int jlog_ctx_write_message_ts(jlog_ctx *ctx, jlog_message *mess,
+                              const struct timespec *when) {
+  return __jlog_write_message(ctx, mess, when, 0, 0);
+}
+
+void jlog_message_timespec(jlog_ctx *ctx, const jlog_message *m,
+                           struct timespec *ts) {
+  ts->tv_sec = m->header->tv_sec;
+  if (ctx->meta->format_flags & JLOG_FORMAT_NSEC_TIME)
+    ts->tv_nsec = m->header->tv_usec;
+  else
+    ts->tv_nsec = m->header->tv_usec * 1000;
+}
+
+int jlog_ctx_write_compressed_message(jlog_ctx *ctx, jlog_message *mess,
+                                      struct timeval *when) {
+  struct timespec ts;
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  /* the payload is only meaningful to a jlog using the same provider */
+  if(!IS_COMPRESS_MAGIC(ctx) || !mess->header ||
+     mess->header->reserved != ctx->meta->hdr_magic) {
+    ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+    ctx->last_errno = EINVAL;
+    return -1;
+  }
+  return __jlog_write_message(ctx, mess, __jlog_timeval_ts(when, &ts), 1, 0);
+}
+
+int jlog_ctx_set_read_flags(jlog_ctx *ctx, u_int32_t flags) {
+  ctx->read_flags = flags;
+  return 0;
+}
+
+int jlog_message_decompress(jlog_ctx *ctx, jlog_message *m) {
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  /* ordinary reads decompress into mess_data, prefetched ones into the
+   * slot handed out; either way there is nothing left to do */
+  if(!IS_COMPRESS_MAGIC(ctx) || m->mess == ctx->mess_data ||
+     (ctx->prefetch && m->mess == ctx->prefetch->held)) return 0;
+  if (ctx->mess_data_size < m->header->mlen) {
+    ctx->mess_data = realloc(ctx->mess_data, m->header->mlen * 2);
+    ctx->mess_data_size = m->header->mlen * 2;
+  }
+  if (jlog_decompress(m->mess, m->mess_len, ctx->mess_data,
+                      ctx->mess_data_size) != 0) {
+    ctx->last_error = JLOG_ERR_FILE_CORRUPT;
+    ctx->last_errno = 0;
+    return -1;
+  }
+  m->mess = ctx->mess_data;
+  m->mess_len = m->header->mlen;
+  return 0;
+}
+
 int jlog_ctx_read_checkpoint(jlog_ctx *ctx, const jlog_id *chkpt) {
+  struct timeval now;
+
   ctx->last_error = JLOG_ERR_SUCCESS;
   
   if(ctx->context_mode != JLOG_READ) {
@@ -1825,59 +3634,456 @@ int jlog_ctx_read_checkpoint(jlog_ctx *ctx, const jlog_id *chkpt) {
     ctx->last_errno = EPERM;
     return -1;
   }
+  if(ctx->cp_defer_ms || ctx->cp_defer_count) {
+    ctx->cp_pending_id = *chkpt;
+    ctx->cp_pending = 1;
+    ctx->cp_pending_count++;
+    if(ctx->cp_defer_count && ctx->cp_pending_count >= ctx->cp_defer_count)
+      return jlog_ctx_flush_checkpoint(ctx);
+    if(ctx->cp_defer_ms) {
+      gettimeofday(&now, NULL);
+      if((now.tv_sec - ctx->cp_written.tv_sec) * 1000 +
+         (now.tv_usec - ctx->cp_written.tv_usec) / 1000 >= ctx->cp_defer_ms)
+        return jlog_ctx_flush_checkpoint(ctx);
+    }
+    return 0;
+  }
   if(__jlog_set_checkpoint(ctx, ctx->subscriber_name, chkpt) != 0) {
     ctx->last_error = JLOG_ERR_CHECKPOINT;
     ctx->last_errno = 0;
     return -1;
   }
+  __jlog_prune_closed(ctx, chkpt->log);
   return 0;
 }
 
-int jlog_ctx_remove_subscriber(jlog_ctx *ctx, const char *s) {
+int jlog_ctx_flush_checkpoint(jlog_ctx *ctx) {
+  jlog_id id;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(!ctx->cp_pending) return 0;
+  id = ctx->cp_pending_id;
+  if(__jlog_set_checkpoint(ctx, ctx->subscriber_name, &id) != 0) {
+    ctx->last_error = JLOG_ERR_CHECKPOINT;
+    ctx->last_errno = 0;
+    return -1;
+  }
+  __jlog_prune_closed(ctx, id.log);
+  return 0;
+}
+
+int jlog_ctx_set_checkpoint_interval(jlog_ctx *ctx, u_int32_t ms, u_int32_t count) {
+  ctx->cp_defer_ms = ms;
+  ctx->cp_defer_count = count;
+  if(!ms && !count) return jlog_ctx_flush_checkpoint(ctx);
+  return 0;
+}
+
+static jlog_file *__jlog_open_lease(jlog_ctx *ctx) {
   char name[MAXPATHLEN];
-  int rv;
+  int len;
 
-  compute_checkpoint_filename(ctx, s, name);
-  rv = unlink(name);
+  if(ctx->lease) return ctx->lease;
+  compute_checkpoint_filename(ctx, ctx->subscriber_name, name);
+  len = strlen(ctx->path);
+  name[len + 1] = 'l';
+  name[len + 2] = 'g';
+  ctx->lease = jlog_file_open(name, O_CREAT, ctx->file_mode, ctx->multi_process);
+  return ctx->lease;
+}
 
-  if (rv == 0) {
-    ctx->last_error = JLOG_ERR_SUCCESS;
-    return 1;
+/* the lease file is small (one record per segment in flight) so it is
+ * simply read and rewritten whole under its lock */
+static int __jlog_load_leases(jlog_ctx *ctx, jlog_lease **leases, int *cnt) {
+  off_t len;
+
+  *leases = NULL;
+  *cnt = 0;
+  if((len = jlog_file_size(ctx->lease)) == -1) return -1;
+  len -= len % sizeof(jlog_lease);
+  /* leave room for the one lease a claim may add */
+  if(!(*leases = malloc(len + sizeof(jlog_lease)))) return -1;
+  if(len && !jlog_file_pread(ctx->lease, *leases, len, 0)) {
+    free(*leases);
+    *leases = NULL;
+    return -1;
   }
-  if (errno == ENOENT) {
-    ctx->last_error = JLOG_ERR_INVALID_SUBSCRIBER;
+  *cnt = len / sizeof(jlog_lease);
+  return 0;
+}
+
+static int __jlog_store_leases(jlog_ctx *ctx, jlog_lease *leases, int cnt) {
+  if(cnt && !jlog_file_pwrite(ctx->lease, leases, cnt * sizeof(jlog_lease), 0))
+    return -1;
+  if(!jlog_file_truncate(ctx->lease, cnt * sizeof(jlog_lease))) return -1;
+  if(ctx->meta->safety == JLOG_SAFE) jlog_file_sync(ctx->lease);
+  return 0;
+}
+
+static int __jlog_find_lease(jlog_lease *leases, int cnt, u_int32_t log) {
+  int i;
+  for(i = 0; i < cnt; i++)
+    if(leases[i].log == log) return i;
+  return -1;
+}
+
+/* move the group checkpoint up to the low watermark: through every
+ * finished segment and into the first unfinished one as far as its
+ * owner has checkpointed; leases behind it are forgotten */
+static int __jlog_group_advance(jlog_ctx *ctx, jlog_lease *leases, int *cnt,
+                                const jlog_id *chkpt) {
+  jlog_id wm = *chkpt;
+  u_int32_t log = chkpt->log;
+  int i, j;
+
+  while((i = __jlog_find_lease(leases, *cnt, log)) >= 0) {
+    if(log > wm.log || leases[i].marker > wm.marker) {
+      wm.log = log;
+      wm.marker = leases[i].marker;
+    }
+    if(leases[i].state != JLOG_LEASE_DONE) break;
+    log++;
+  }
+  if(wm.log == chkpt->log && wm.marker == chkpt->marker) return 0;
+  if(__jlog_set_checkpoint(ctx, ctx->subscriber_name, &wm) != 0) return -1;
+  for(i = j = 0; i < *cnt; i++)
+    if(leases[i].log >= wm.log) leases[j++] = leases[i];
+  *cnt = j;
+  return 0;
+}
+
+/* pick this context's token and, where open file description locks
+ * exist, lock its byte in lk.<hex name> for as long as we are open */
+static int __jlog_lease_token(jlog_ctx *ctx) {
+  static u_int32_t seq;
+  u_int32_t token;
+  int tries;
+
+  if(ctx->lease_token) return 0;
+#ifdef F_OFD_SETLK
+  {
+    char name[MAXPATHLEN];
+    int len = strlen(ctx->path);
+    compute_checkpoint_filename(ctx, ctx->subscriber_name, name);
+    name[len + 1] = LEASELOCK_PREFIX[0];
+    name[len + 2] = LEASELOCK_PREFIX[1];
+    ctx->lease_fd = open(name, O_RDWR|O_CREAT|O_CLOEXEC, ctx->file_mode);
+  }
+#endif
+  for(tries = 0; tries < 64; tries++) {
+    token = ((u_int32_t)getpid() * 2654435761U) ^ (u_int32_t)time(NULL) ^
+            (u_int32_t)(uintptr_t)ctx ^ __sync_add_and_fetch(&seq, 0x9e3779b9U);
+    token &= 0x7fffffff;
+    if(!token) continue;
+#ifdef F_OFD_SETLK
+    if(ctx->lease_fd >= 0) {
+      struct flock fl;
+      memset(&fl, 0, sizeof(fl));
+      fl.l_type = F_WRLCK;
+      fl.l_whence = SEEK_SET;
+      fl.l_start = token;
+      fl.l_len = 1;
+      if(fcntl(ctx->lease_fd, F_OFD_SETLK, &fl) != 0) {
+        if(errno == EAGAIN || errno == EACCES) continue;  /* taken */
+        /* no such locks here; fall back to the pid alone */
+        close(ctx->lease_fd);
+        ctx->lease_fd = -1;
+      }
+    }
+#endif
+    ctx->lease_token = token;
     return 0;
   }
+  errno = EAGAIN;
   return -1;
 }
 
-int jlog_ctx_add_subscriber(jlog_ctx *ctx, const char *s, jlog_position whence) {
-  jlog_id chkpt;
-  jlog_ctx *tmpctx = NULL;
-  jlog_file *jchkpt;
-  ctx->last_error = JLOG_ERR_SUCCESS;
+static int __jlog_lease_mine(jlog_ctx *ctx, const jlog_lease *lease) {
+  return lease->pid == (u_int32_t)getpid() && lease->token == ctx->lease_token;
+}
 
-  jchkpt = __jlog_open_named_checkpoint(ctx, s, O_CREAT|O_EXCL);
-  if(!jchkpt) {
-    ctx->last_errno = errno;
-    if(errno == EEXIST)
-      ctx->last_error = JLOG_ERR_SUBSCRIBER_EXISTS;
-    else
-      ctx->last_error = JLOG_ERR_OPEN;
+/* with the token's lock its owner is alive exactly while the lock is
+ * held, whatever has since become of its pid; without, ask the pid */
+static int __jlog_owner_dead(jlog_ctx *ctx, const jlog_lease *lease) {
+#ifdef F_OFD_GETLK
+  if(ctx->lease_fd >= 0 && lease->token) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = lease->token;
+    fl.l_len = 1;
+    if(fcntl(ctx->lease_fd, F_OFD_GETLK, &fl) == 0)
+      return fl.l_type == F_UNLCK;
+  }
+#endif
+  return kill((pid_t)lease->pid, 0) == -1 && errno == ESRCH;
+}
+
+int jlog_ctx_group_claim(jlog_ctx *ctx, jlog_id *start, jlog_id *finish) {
+  jlog_lease *leases = NULL;
+  jlog_id chkpt, last;
+  u_int32_t me = getpid(), log;
+  int cnt = 0, i, l = -1, closed, created, locked = 0, count = 0;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
     return -1;
   }
-  jlog_file_close(jchkpt);
-  
-  if(whence == JLOG_BEGIN) {
-    memset(&chkpt, 0, sizeof(chkpt));
-    jlog_ctx_first_log_id(ctx, &chkpt);
-    if(__jlog_set_checkpoint(ctx, s, &chkpt) != 0) {
-      ctx->last_error = JLOG_ERR_CHECKPOINT;
-      ctx->last_errno = 0;
-      return -1;
+  if(!__jlog_open_lease(ctx))
+    SYS_FAIL(JLOG_ERR_FILE_OPEN);
+  if(__jlog_lease_token(ctx) != 0)
+    SYS_FAIL(JLOG_ERR_LOCK);
+  if(!jlog_file_lock(ctx->lease))
+    SYS_FAIL(JLOG_ERR_LOCK);
+  locked = 1;
+  __jlog_restore_metastore(ctx, 0);
+  __jlog_wait_reset(ctx);
+  if(jlog_get_checkpoint(ctx, ctx->subscriber_name, &chkpt))
+    SYS_FAIL(JLOG_ERR_INVALID_SUBSCRIBER);
+  if(__jlog_load_leases(ctx, &leases, &cnt) != 0)
+    SYS_FAIL(JLOG_ERR_FILE_READ);
+
+  /* a lease whose owner died goes back up for grabs, progress intact */
+  for(i = 0; i < cnt; i++) {
+    if(leases[i].state != JLOG_LEASE_CLAIMED) continue;
+    if(__jlog_lease_mine(ctx, &leases[i])) l = i;
+    else if(__jlog_owner_dead(ctx, &leases[i]))
+      leases[i].state = JLOG_LEASE_FREE;
+  }
+
+  while(1) {
+    created = 0;
+    if(l < 0) {
+      /* the earliest orphan first, then the next segment nobody has */
+      for(i = 0; i < cnt; i++)
+        if(leases[i].state == JLOG_LEASE_FREE &&
+           (l < 0 || leases[i].log < leases[l].log)) l = i;
+      if(l >= 0) {
+        leases[l].state = JLOG_LEASE_CLAIMED;
+        leases[l].pid = me;
+        leases[l].token = ctx->lease_token;
+      }
     }
-    return 0;
-  }
+    if(l < 0) {
+      for(log = chkpt.log; __jlog_find_lease(leases, cnt, log) >= 0; log++);
+      if(log > ctx->meta->storage_log) break;
+      l = cnt++;
+      leases[l].log = log;
+      leases[l].marker = (log == chkpt.log) ? chkpt.marker : 0;
+      leases[l].pid = me;
+      leases[l].token = ctx->lease_token;
+      leases[l].state = JLOG_LEASE_CLAIMED;
+      created = 1;
+    }
+    if(__jlog_resync_index(ctx, leases[l].log, &last, &closed) != 0)
+      goto finish;
+    if(last.marker > leases[l].marker) {
+      start->log = finish->log = leases[l].log;
+      start->marker = leases[l].marker + 1;
+      finish->marker = last.marker;
+      count = last.marker - leases[l].marker;
+      break;
+    }
+    if(!closed) {
+      /* the writer's segment, and nothing new in it yet */
+      if(created) cnt--;
+      break;
+    }
+    leases[l].marker = last.marker;
+    leases[l].state = JLOG_LEASE_DONE;
+    l = -1;
+    /* only one spare slot was allocated; settle before adding more */
+    if(__jlog_group_advance(ctx, leases, &cnt, &chkpt) != 0)
+      SYS_FAIL(JLOG_ERR_CHECKPOINT);
+    if(jlog_get_checkpoint(ctx, ctx->subscriber_name, &chkpt))
+      SYS_FAIL(JLOG_ERR_INVALID_SUBSCRIBER);
+    if(__jlog_store_leases(ctx, leases, cnt) != 0)
+      SYS_FAIL(JLOG_ERR_FILE_WRITE);
+    free(leases);
+    if(__jlog_load_leases(ctx, &leases, &cnt) != 0)
+      SYS_FAIL(JLOG_ERR_FILE_READ);
+  }
+  if(__jlog_group_advance(ctx, leases, &cnt, &chkpt) != 0)
+    SYS_FAIL(JLOG_ERR_CHECKPOINT);
+  if(__jlog_store_leases(ctx, leases, cnt) != 0)
+    SYS_FAIL(JLOG_ERR_FILE_WRITE);
+
+ finish:
+  if(locked) jlog_file_unlock(ctx->lease);
+  free(leases);
+  if(ctx->last_error == JLOG_ERR_SUCCESS) return count;
+  return -1;
+}
+
+int jlog_ctx_group_checkpoint(jlog_ctx *ctx, const jlog_id *id) {
+  jlog_lease *leases = NULL;
+  jlog_id chkpt, last;
+  int cnt = 0, l, closed, locked = 0;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_CHECKPOINT;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  if(!__jlog_open_lease(ctx))
+    SYS_FAIL(JLOG_ERR_FILE_OPEN);
+  if(!jlog_file_lock(ctx->lease))
+    SYS_FAIL(JLOG_ERR_LOCK);
+  locked = 1;
+  if(jlog_get_checkpoint(ctx, ctx->subscriber_name, &chkpt))
+    SYS_FAIL(JLOG_ERR_INVALID_SUBSCRIBER);
+  if(__jlog_load_leases(ctx, &leases, &cnt) != 0)
+    SYS_FAIL(JLOG_ERR_FILE_READ);
+  l = __jlog_find_lease(leases, cnt, id->log);
+  if(l < 0 || leases[l].state != JLOG_LEASE_CLAIMED ||
+     !__jlog_lease_mine(ctx, &leases[l])) {
+    /* someone decided we were dead and took this over */
+    errno = EPERM;
+    SYS_FAIL(JLOG_ERR_ILLEGAL_CHECKPOINT);
+  }
+  if(id->marker > leases[l].marker) leases[l].marker = id->marker;
+  if(__jlog_resync_index(ctx, id->log, &last, &closed) != 0)
+    goto finish;
+  if(closed && leases[l].marker >= last.marker)
+    leases[l].state = JLOG_LEASE_DONE;
+  if(__jlog_group_advance(ctx, leases, &cnt, &chkpt) != 0)
+    SYS_FAIL(JLOG_ERR_CHECKPOINT);
+  if(__jlog_store_leases(ctx, leases, cnt) != 0)
+    SYS_FAIL(JLOG_ERR_FILE_WRITE);
+
+ finish:
+  if(locked) jlog_file_unlock(ctx->lease);
+  free(leases);
+  if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
+  return -1;
+}
+
+/* hand back anything we were working on so the rest of the group need
+ * not wait to notice we are gone */
+static void __jlog_group_release(jlog_ctx *ctx) {
+  jlog_lease *leases;
+  int cnt, i, dirty = 0;
+
+  if(!ctx->lease || !jlog_file_lock(ctx->lease)) return;
+  if(__jlog_load_leases(ctx, &leases, &cnt) == 0) {
+    for(i = 0; i < cnt; i++) {
+      if(leases[i].state == JLOG_LEASE_CLAIMED &&
+         __jlog_lease_mine(ctx, &leases[i])) {
+        leases[i].state = JLOG_LEASE_FREE;
+        dirty = 1;
+      }
+    }
+    if(dirty) __jlog_store_leases(ctx, leases, cnt);
+    free(leases);
+  }
+  jlog_file_unlock(ctx->lease);
+}
+
+static void __jlog_tag_filter_filename(jlog_ctx *ctx, const char *s,
+                                       char *name) {
+  int len = strlen(ctx->path);
+  compute_checkpoint_filename(ctx, s, name);
+  name[len + 1] = TAGFILTER_PREFIX[0];
+  name[len + 2] = TAGFILTER_PREFIX[1];
+}
+
+/* a subscriber without a filter file takes every record */
+static int __jlog_load_tag_filter(jlog_ctx *ctx) {
+  char name[MAXPATHLEN];
+  jlog_file *f;
+  int ok;
+
+  __jlog_tag_filter_filename(ctx, ctx->subscriber_name, name);
+  if(!(f = jlog_file_open(name, 0, ctx->file_mode, ctx->multi_process)))
+    return errno == ENOENT ? 0 : -1;
+  ok = jlog_file_pread(f, ctx->tag_filter, sizeof(ctx->tag_filter), 0);
+  jlog_file_close(f);
+  if(!ok) return -1;
+  ctx->tag_filtered = 1;
+  return 0;
+}
+
+int jlog_ctx_remove_subscriber(jlog_ctx *ctx, const char *s) {
+  char name[MAXPATHLEN];
+  int rv;
+
+  compute_checkpoint_filename(ctx, s, name);
+  switch(__jlog_use_cptable(ctx)) {
+    case -1: rv = -1; break;
+    case 1: rv = __jlog_cptable_remove(ctx, s); break;
+    default: rv = unlink(name);
+  }
+  if (rv == 0) {
+    /* and any consumer group leases that went with it */
+    int len = strlen(ctx->path);
+    name[len + 1] = 'l';
+    name[len + 2] = 'g';
+    unlink(name);
+    name[len + 1] = LEASELOCK_PREFIX[0];
+    name[len + 2] = LEASELOCK_PREFIX[1];
+    unlink(name);
+    /* and its tag filter */
+    name[len + 1] = TAGFILTER_PREFIX[0];
+    name[len + 2] = TAGFILTER_PREFIX[1];
+    unlink(name);
+  }
+
+  if (rv == 0) {
+    ctx->last_error = JLOG_ERR_SUCCESS;
+    return 1;
+  }
+  if (errno == ENOENT) {
+    ctx->last_error = JLOG_ERR_INVALID_SUBSCRIBER;
+    return 0;
+  }
+  return -1;
+}
+
+int jlog_ctx_add_subscriber(jlog_ctx *ctx, const char *s, jlog_position whence) {
+  jlog_id chkpt;
+  jlog_ctx *tmpctx = NULL;
+  jlog_file *jchkpt;
+  int added = 0;
+  ctx->last_error = JLOG_ERR_SUCCESS;
+
+  switch(__jlog_use_cptable(ctx)) {
+    case 1:
+      memset(&chkpt, 0, sizeof(chkpt));
+      if(whence == JLOG_BEGIN) jlog_ctx_first_log_id(ctx, &chkpt);
+      else chkpt.log = ctx->meta->storage_log;
+      added = (__jlog_cptable_add(ctx, s, &chkpt) == 0);
+      break;
+    case 0:
+      jchkpt = __jlog_open_named_checkpoint(ctx, s, O_CREAT|O_EXCL);
+      if(jchkpt) {
+        jlog_file_close(jchkpt);
+        added = 1;
+      }
+      break;
+  }
+  if(!added) {
+    ctx->last_errno = errno;
+    if(errno == EEXIST)
+      ctx->last_error = JLOG_ERR_SUBSCRIBER_EXISTS;
+    else
+      ctx->last_error = JLOG_ERR_OPEN;
+    return -1;
+  }
+  
+  if(whence == JLOG_BEGIN) {
+    memset(&chkpt, 0, sizeof(chkpt));
+    jlog_ctx_first_log_id(ctx, &chkpt);
+    if(__jlog_set_checkpoint(ctx, s, &chkpt) != 0) {
+      ctx->last_error = JLOG_ERR_CHECKPOINT;
+      ctx->last_errno = 0;
+      return -1;
+    }
+    return 0;
+  }
   if(whence == JLOG_END) {
     jlog_id start, finish;
     memset(&chkpt, 0, sizeof(chkpt));
@@ -1908,6 +4114,43 @@ int jlog_ctx_add_subscriber(jlog_ctx *ctx, const char *s, jlog_position whence)
   return -1;
 }
 
+int jlog_ctx_add_subscriber_filtered(jlog_ctx *ctx, const char *s,
+                                     jlog_position whence,
+                                     const u_int8_t *tags, int ntags) {
+  u_int8_t filter[32];
+  char name[MAXPATHLEN];
+  jlog_file *f;
+  int i, ok, err;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  memset(filter, 0, sizeof(filter));
+  for(i = 0; i < ntags; i++) {
+    if(!tags[i]) break;
+    filter[tags[i] >> 3] |= 1 << (tags[i] & 7);
+  }
+  if(ntags <= 0 || i < ntags) {
+    ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+    ctx->last_errno = EINVAL;
+    return -1;
+  }
+  if(jlog_ctx_add_subscriber(ctx, s, whence) != 0) return -1;
+
+  __jlog_tag_filter_filename(ctx, s, name);
+  f = jlog_file_open(name, O_CREAT, ctx->file_mode, ctx->multi_process);
+  ok = f && jlog_file_truncate(f, 0) &&
+       jlog_file_pwrite(f, filter, sizeof(filter), 0);
+  err = errno;
+  if(f) jlog_file_close(f);
+  if(!ok) {
+    /* an unfiltered subscriber is not what was asked for */
+    jlog_ctx_remove_subscriber(ctx, s);
+    ctx->last_error = JLOG_ERR_FILE_WRITE;
+    ctx->last_errno = err;
+    return -1;
+  }
+  return 0;
+}
+
 int jlog_ctx_add_subscriber_copy_checkpoint(jlog_ctx *old_ctx, const char *new,
                                 const char *old) {
   jlog_id chkpt;
@@ -1968,6 +4211,72 @@ int jlog_ctx_write(jlog_ctx *ctx, const void *data, size_t len) {
   return jlog_ctx_write_message(ctx, &m, NULL);
 }
 
+int jlog_ctx_write_message_keyed(jlog_ctx *ctx, jlog_message *mess,
+                                 struct timeval *when,
+                                 const void *key, size_t key_len) {
+  struct timespec ts;
+  u_int64_t h;
+  int rv;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_APPEND) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  if(!ctx->meta->dedup_window) {
+    ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+    ctx->last_errno = EINVAL;
+    return -1;
+  }
+  if(__jlog_open_dedup(ctx) != 0) {
+    ctx->last_error = JLOG_ERR_OPEN;
+    ctx->last_errno = errno;
+    return -1;
+  }
+  h = __jlog_key_hash(key, key_len);
+  /* held across the write so two writers can't both miss the key; the
+   * key only counts once its record is down (or in the pre-commit
+   * buffer), so a failed write can be retried */
+  if(!jlog_file_lock(ctx->dedup_file)) {
+    ctx->last_error = JLOG_ERR_LOCK;
+    ctx->last_errno = errno;
+    return -1;
+  }
+  if(__jlog_dedup_seen(ctx, h)) {
+    jlog_file_unlock(ctx->dedup_file);
+    return 1;
+  }
+  rv = __jlog_write_message(ctx, mess, __jlog_timeval_ts(when, &ts), 0, 0);
+  if(rv == 0) __jlog_dedup_note(ctx, h);
+  jlog_file_unlock(ctx->dedup_file);
+  return rv;
+}
+
+int jlog_ctx_write_tagged(jlog_ctx *ctx, u_int8_t tag,
+                          const void *data, size_t len) {
+  jlog_message m;
+  m.mess = (void *)data;
+  m.mess_len = len;
+  return __jlog_write_message(ctx, &m, NULL, 0, tag);
+}
+
+/* file names the segment just resynced into last; it has started once
+ * it holds a record, which its index (if it keeps one) records on disk.
+ * @return 1 if so, 0 if not, -1 if the index path doesn't fit */
+static int __jlog_segment_started(jlog_ctx *ctx, char *file,
+                                  const jlog_id *last) {
+  struct stat sb = {0};
+  int ferr, len;
+
+  if(IS_FIXED_RECORDS(ctx)) return last->marker != 0;
+  len = strlen(file);
+  if((len + sizeof(INDEX_EXT)) > MAXPATHLEN) return -1;
+  memcpy(file + len, INDEX_EXT, sizeof(INDEX_EXT));
+  while((ferr = stat(file, &sb)) == -1 && errno == EINTR);
+  return ferr == 0 && sb.st_size != 0;
+}
+
 static int __jlog_find_first_log_after(jlog_ctx *ctx, jlog_id *chkpt,
                                 jlog_id *start, jlog_id *finish) {
   jlog_id last;
@@ -1979,7 +4288,7 @@ static int __jlog_find_first_log_after(jlog_ctx *ctx, jlog_id *chkpt,
     if(ctx->last_error == JLOG_ERR_FILE_OPEN &&
         ctx->last_errno == ENOENT) {
       char file[MAXPATHLEN];
-      int ferr, len;
+      int ferr, started;
       struct stat sb = {0};
 
       memset(file, 0, sizeof(file));
@@ -1998,11 +4307,8 @@ static int __jlog_find_first_log_after(jlog_ctx *ctx, jlog_id *chkpt,
         memcpy(finish, start, sizeof(*start));
         return 0;
       }
-      len = strlen(file);
-      if((len + sizeof(INDEX_EXT)) > sizeof(file)) return -1;
-      memcpy(file + len, INDEX_EXT, sizeof(INDEX_EXT));
-      while((ferr = stat(file, &sb)) == -1 && errno == EINTR);
-      if(ferr != 0 || sb.st_size == 0) {
+      if((started = __jlog_segment_started(ctx, file, &last)) < 0) return -1;
+      if(!started) {
         /* We don't advance past where people are writing */
         memcpy(finish, start, sizeof(*start));
         return 0;
@@ -2020,7 +4326,7 @@ static int __jlog_find_first_log_after(jlog_ctx *ctx, jlog_id *chkpt,
 
   if(!memcmp(start, &last, sizeof(last)) && closed) {
     char file[MAXPATHLEN];
-    int ferr, len;
+    int ferr, started;
     struct stat sb = {0};
 
     memset(file, 0, sizeof(file));
@@ -2045,11 +4351,8 @@ static int __jlog_find_first_log_after(jlog_ctx *ctx, jlog_id *chkpt,
       memcpy(finish, start, sizeof(*start));
       return 0;
     }
-    len = strlen(file);
-    if((len + sizeof(INDEX_EXT)) > sizeof(file)) return -1;
-    memcpy(file + len, INDEX_EXT, sizeof(INDEX_EXT));
-    while((ferr = stat(file, &sb)) == -1 && errno == EINTR);
-    if(ferr != 0 || sb.st_size == 0) {
+    if((started = __jlog_segment_started(ctx, file, &last)) < 0) return -1;
+    if(!started) {
       /* We don't advance past where people are writing */
       memcpy(finish, start, sizeof(*start));
       return 0;
@@ -2061,19 +4364,131 @@ static int __jlog_find_first_log_after(jlog_ctx *ctx, jlog_id *chkpt,
   memcpy(finish, &last, sizeof(last));
   return 0;
 }
+/* finds marker in a sparsely indexed segment by stepping forward from
+ * the indexed record before it through the reader's mapping
+ * @return JLOG_ERR_SUCCESS or the error to fail with */
+static int __jlog_sparse_offset(jlog_ctx *ctx, const jlog_id *id,
+                                off_t index_len, u_int64_t *data_off) {
+  u_int32_t interval = INDEX_INTERVAL(ctx), skip;
+  u_int64_t entries = index_len / sizeof(u_int64_t), tail[2], slot;
+  const char *base;
+  size_t span;
+
+  if (entries >= 3) {
+    if (!jlog_file_pread(ctx->index, tail, sizeof(tail),
+                         index_len - sizeof(tail)))
+      return JLOG_ERR_IDX_READ;
+    if (tail[0] == JLOG_SPARSE_CLOSE) {
+      if (id->marker == JLOG_SPARSE_COUNT(tail[1]) + 1)
+        return JLOG_ERR_CLOSE_LOGID;
+      if (id->marker > JLOG_SPARSE_COUNT(tail[1])) return JLOG_ERR_ILLEGAL_LOGID;
+      entries -= 2;
+    }
+  }
+  slot = (id->marker - 1) / interval;
+  if (slot >= entries) return JLOG_ERR_ILLEGAL_LOGID;
+  if (!jlog_file_pread(ctx->index, data_off, sizeof(u_int64_t),
+                       slot * sizeof(u_int64_t)))
+    return JLOG_ERR_IDX_READ;
+  /* an offset of 0 anywhere but the start means corruption */
+  if (*data_off == 0 && slot != 0) return JLOG_ERR_IDX_CORRUPT;
+
+  if (__jlog_mmap_reader(ctx, id->log) != 0) return JLOG_ERR_FILE_READ;
+  base = ctx->mmap_base;
+  for (skip = (id->marker - 1) % interval; skip > 0; skip--) {
+    /* past the end of what we have mapped: not written yet, as far as
+     * we can tell */
+    span = __jlog_record_span(ctx, id->log, base + *data_off,
+                              base + ctx->mmap_len);
+    if (!span) return JLOG_ERR_ILLEGAL_LOGID;
+    *data_off += span;
+  }
+  return JLOG_ERR_SUCCESS;
+}
+
+/* fixed-size records: marker n starts (n - 1) strides into the segment,
+ * so there is no index to consult and nothing for a lock to protect */
+static int __jlog_read_fixed(jlog_ctx *ctx, const jlog_id *id, int count,
+                             jlog_message *m) {
+  u_int64_t stride = FIXED_STRIDE(ctx), data_off = 0, last;
+  u_int32_t disk_len;
+  size_t hdr_size;
+  off_t data_len;
+  int i, is_closed;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if (ctx->context_mode != JLOG_READ)
+    SYS_FAIL(JLOG_ERR_ILLEGAL_WRITE);
+  if (id->marker < 1)
+    SYS_FAIL(JLOG_ERR_ILLEGAL_LOGID);
+
+  is_closed = id->log < ctx->meta->storage_log;
+  __jlog_open_reader(ctx, id->log);
+  if(!ctx->data)
+    SYS_FAIL(JLOG_ERR_FILE_OPEN);
+  if ((data_len = jlog_file_size(ctx->data)) == -1)
+    SYS_FAIL(JLOG_ERR_FILE_SEEK);
+  last = data_len / stride;
+  if (id->marker + (u_int64_t)(count - 1) > last) {
+    if (is_closed && id->marker == last + 1) {
+      /* close tag; not a real offset */
+      ctx->last_error = JLOG_ERR_CLOSE_LOGID;
+      ctx->last_errno = 0;
+      return -1;
+    }
+    SYS_FAIL(JLOG_ERR_ILLEGAL_LOGID);
+  }
+
+  if(__jlog_mmap_reader(ctx, id->log) != 0)
+    SYS_FAIL(JLOG_ERR_FILE_READ);
+  if(ctx->mmap_len < last * stride) {
+    /* mapped before the segment grew to what we just saw */
+    __jlog_munmap_reader(ctx);
+    if(__jlog_mmap_reader(ctx, id->log) != 0)
+      SYS_FAIL(JLOG_ERR_FILE_READ);
+    if(ctx->mmap_len < last * stride)
+      SYS_FAIL(JLOG_ERR_FILE_READ);
+  }
+
+  for(i = 0; i < count; i++) {
+    jlog_message *msg = &m[i];
+
+    data_off = (id->marker - 1 + i) * stride;
+    hdr_size = __jlog_parse_header(ctx, id->log,
+                                   ((u_int8_t *)ctx->mmap_base) + data_off,
+                                   stride, 1, &msg->aligned_header, &disk_len,
+                                   NULL);
+    if(!hdr_size || disk_len != ctx->meta->record_size)
+      SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
+    msg->header = &msg->aligned_header;
+    msg->mess_len = disk_len;
+    msg->mess = ((u_int8_t *)ctx->mmap_base) + data_off + hdr_size;
+  }
+  __jlog_readahead(ctx, id->log, data_off);
+
+ finish:
+  if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
+  return -1;
+}
+
 int jlog_ctx_read_message(jlog_ctx *ctx, const jlog_id *id, jlog_message *m) {
   off_t index_len;
   u_int64_t data_off;
-  int with_lock = 0;
+  int with_lock = 0, locked = 0;
   size_t hdr_size = 0;
-  uint32_t *message_disk_len = &m->aligned_header.mlen;
+  u_int32_t disk_len;
 
-  if (IS_COMPRESS_MAGIC(ctx)) {
-    hdr_size = sizeof(jlog_message_header_compressed);
-    message_disk_len = &m->aligned_header.compressed_len;
-  } else {
-    hdr_size = sizeof(jlog_message_header);
+  if (ctx->prefetch && WANT_DECOMPRESS(ctx) &&
+      __jlog_prefetch_take(ctx, id, m)) return 0;
+
+  if (ctx->context_mode == JLOG_READ) {
+    switch(__jlog_read_closed(ctx, id, 1, m)) {
+      case 1: return 0;
+      case -1: return -1;
+    }
   }
+  if (IS_FIXED_RECORDS(ctx))
+    return __jlog_read_fixed(ctx, id, 1, m);
 
  once_more_with_lock:
 
@@ -2096,48 +4511,63 @@ int jlog_ctx_read_message(jlog_ctx *ctx, const jlog_id *id, jlog_message *m) {
       with_lock = 0;
       SYS_FAIL(JLOG_ERR_LOCK);
     }
+    locked = 1;
   }
 
   if ((index_len = jlog_file_size(ctx->index)) == -1)
     SYS_FAIL(JLOG_ERR_IDX_SEEK);
   if (index_len % sizeof(u_int64_t))
     SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
-  if (id->marker * sizeof(u_int64_t) > index_len) {
-    SYS_FAIL(JLOG_ERR_ILLEGAL_LOGID);
-  }
-
-  if (!jlog_file_pread(ctx->index, &data_off, sizeof(u_int64_t),
-                       (id->marker - 1) * sizeof(u_int64_t)))
-  {
-    SYS_FAIL(JLOG_ERR_IDX_READ);
-  }
-  if (data_off == 0 && id->marker != 1) {
-    if (id->marker * sizeof(u_int64_t) == index_len) {
-      /* close tag; not a real offset */
+  if (IS_SPARSE_INDEX(ctx)) {
+    int err = __jlog_sparse_offset(ctx, id, index_len, &data_off);
+    if (err == JLOG_ERR_CLOSE_LOGID) {
       ctx->last_error = JLOG_ERR_CLOSE_LOGID;
       ctx->last_errno = 0;
-      if(with_lock) jlog_file_unlock(ctx->index);
+      if(locked) jlog_file_unlock(ctx->index);
       return -1;
-    } else {
-      /* an offset of 0 in the middle of an index means curruption */
-      SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
+    }
+    if (err != JLOG_ERR_SUCCESS)
+      SYS_FAIL(err);
+  } else {
+    if (id->marker * sizeof(u_int64_t) > index_len) {
+      SYS_FAIL(JLOG_ERR_ILLEGAL_LOGID);
+    }
+
+    if (!jlog_file_pread(ctx->index, &data_off, sizeof(u_int64_t),
+                         (id->marker - 1) * sizeof(u_int64_t)))
+    {
+      SYS_FAIL(JLOG_ERR_IDX_READ);
+    }
+    if (data_off == 0 && id->marker != 1) {
+      if (id->marker * sizeof(u_int64_t) == index_len) {
+        /* close tag; not a real offset */
+        ctx->last_error = JLOG_ERR_CLOSE_LOGID;
+        ctx->last_errno = 0;
+        if(locked) jlog_file_unlock(ctx->index);
+        return -1;
+      } else {
+        /* an offset of 0 in the middle of an index means curruption */
+        SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
+      }
     }
   }
 
   if(__jlog_mmap_reader(ctx, id->log) != 0)
     SYS_FAIL(JLOG_ERR_FILE_READ);
 
-  if(data_off > ctx->mmap_len - hdr_size) {
+  if(data_off >= ctx->mmap_len ||
+     !(hdr_size = __jlog_parse_header(ctx, id->log,
+                                      ((u_int8_t *)ctx->mmap_base) + data_off,
+                                      ctx->mmap_len - data_off, 1,
+                                      &m->aligned_header, &disk_len,
+                                      NULL))) {
 #ifdef DEBUG
     fprintf(stderr, "read idx off end: %llu\n", data_off);
 #endif
     SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
   }
 
-  memcpy(&m->aligned_header, ((u_int8_t *)ctx->mmap_base) + data_off,
-         hdr_size);
-
-  if(data_off + hdr_size + *message_disk_len > ctx->mmap_len) {
+  if(data_off + hdr_size + disk_len > ctx->mmap_len) {
 #ifdef DEBUG
     fprintf(stderr, "read idx off end: %llu %llu\n", data_off, ctx->mmap_len);
 #endif
@@ -2146,7 +4576,7 @@ int jlog_ctx_read_message(jlog_ctx *ctx, const jlog_id *id, jlog_message *m) {
 
   m->header = &m->aligned_header;
 
-  if (IS_COMPRESS_MAGIC(ctx)) {
+  if (WANT_DECOMPRESS(ctx)) {
     if (ctx->mess_data_size < m->aligned_header.mlen) {
       ctx->mess_data = realloc(ctx->mess_data, m->aligned_header.mlen * 2);
       ctx->mess_data_size = m->aligned_header.mlen * 2;
@@ -2156,12 +4586,13 @@ int jlog_ctx_read_message(jlog_ctx *ctx, const jlog_id *id, jlog_message *m) {
     m->mess_len = m->header->mlen;
     m->mess = ctx->mess_data;
   } else {
-    m->mess_len = m->header->mlen;
+    m->mess_len = disk_len;
     m->mess = (((u_int8_t *)ctx->mmap_base) + data_off + hdr_size);
   }
+  __jlog_readahead(ctx, id->log, data_off);
 
  finish:
-  if(with_lock) jlog_file_unlock(ctx->index);
+  if(locked) jlog_file_unlock(ctx->index);
   if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
   if(!with_lock) {
     if (ctx->last_error == JLOG_ERR_IDX_CORRUPT) {
@@ -2179,18 +4610,331 @@ int jlog_ctx_read_message(jlog_ctx *ctx, const jlog_id *id, jlog_message *m) {
   }
   return -1;
 }
+static void *__jlog_prefetch_thread(void *vctx) {
+  jlog_ctx *ctx = vctx;
+  jlog_prefetch *pf = ctx->prefetch;
+  jlog_prefetch_slot *slot;
+  jlog_message m;
+  jlog_id last;
+  u_int32_t gen, synced_log = 0;
+  char *buf;
+  size_t buf_size;
+  int i, rv, synced = 0, closed, onward;
+
+  pthread_mutex_lock(&pf->lock);
+  while(!pf->stop) {
+    slot = NULL;
+    if(!pf->exhausted) {
+      for(i = 0; i < pf->depth; i++)
+        if(pf->slots[i].state == JLOG_PREFETCH_EMPTY) {
+          slot = &pf->slots[i];
+          break;
+        }
+    }
+    if(!slot) {
+      pthread_cond_wait(&pf->cv, &pf->lock);
+      continue;
+    }
+    slot->state = JLOG_PREFETCH_BUSY;
+    slot->id = pf->next;
+    pf->next.marker++;
+    gen = pf->gen;
+    pthread_mutex_unlock(&pf->lock);
+
+    if(!synced || synced_log != slot->id.log) {
+      /* lets a closed segment be read from its mapping, lock-free */
+      __jlog_resync_index(pf->hctx, slot->id.log, &last, NULL);
+      synced_log = slot->id.log;
+      synced = 1;
+    }
+    rv = jlog_ctx_read_message(pf->hctx, &slot->id, &m);
+    if(rv == 0) {
+      /* the helper decompressed into its own mess_data; trade buffers
+       * rather than copying the message out */
+      buf = pf->hctx->mess_data;
+      buf_size = pf->hctx->mess_data_size;
+      pf->hctx->mess_data = slot->buf;
+      pf->hctx->mess_data_size = slot->buf_size;
+      slot->buf = buf;
+      slot->buf_size = buf_size;
+      slot->header = m.aligned_header;
+    }
+    /* off the end of a segment that will get no more, the reader's next
+     * interval starts the one after it */
+    onward = rv != 0 &&
+             __jlog_resync_index(pf->hctx, slot->id.log, &last, &closed) == 0 &&
+             closed && slot->id.marker > last.marker;
+
+    pthread_mutex_lock(&pf->lock);
+    if(rv == 0 && gen == pf->gen) slot->state = JLOG_PREFETCH_READY;
+    else {
+      slot->state = JLOG_PREFETCH_EMPTY;
+      if(gen == pf->gen && onward) {
+        pf->next.log = slot->id.log + 1;
+        pf->next.marker = 1;
+      }
+      else if(gen == pf->gen) pf->exhausted = 1;
+    }
+    pthread_cond_broadcast(&pf->cv);
+  }
+  pthread_mutex_unlock(&pf->lock);
+  return NULL;
+}
+
+/* returns 1 if id came out of the ring; otherwise the helper is pointed
+ * just past id and the caller reads it the ordinary way */
+static int __jlog_prefetch_take(jlog_ctx *ctx, const jlog_id *id, jlog_message *m) {
+  jlog_prefetch *pf = ctx->prefetch;
+  jlog_prefetch_slot *slot;
+  int i, hit = 0;
+
+  pthread_mutex_lock(&pf->lock);
+  for(i = 0; i < pf->depth; i++)
+    if(pf->slots[i].state == JLOG_PREFETCH_HELD)
+      pf->slots[i].state = JLOG_PREFETCH_EMPTY;
+  pf->held = NULL;
+ again:
+  for(i = 0; i < pf->depth; i++) {
+    slot = &pf->slots[i];
+    if(slot->id.log != id->log || slot->id.marker != id->marker) continue;
+    if(slot->state == JLOG_PREFETCH_BUSY) {
+      pthread_cond_wait(&pf->cv, &pf->lock);
+      goto again;
+    }
+    if(slot->state == JLOG_PREFETCH_READY) {
+      slot->state = JLOG_PREFETCH_HELD;
+      m->aligned_header = slot->header;
+      m->header = &m->aligned_header;
+      m->mess_len = slot->header.mlen;
+      m->mess = pf->held = slot->buf;
+      hit = 1;
+    }
+    break;
+  }
+  if(!hit) {
+    pf->gen++;
+    for(i = 0; i < pf->depth; i++)
+      if(pf->slots[i].state == JLOG_PREFETCH_READY)
+        pf->slots[i].state = JLOG_PREFETCH_EMPTY;
+    pf->next = *id;
+    pf->next.marker++;
+    pf->exhausted = 0;
+  }
+  pthread_cond_broadcast(&pf->cv);
+  pthread_mutex_unlock(&pf->lock);
+  return hit;
+}
+
+int jlog_ctx_set_prefetch(jlog_ctx *ctx, int depth) {
+  jlog_prefetch *pf;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  __jlog_prefetch_stop(ctx);
+  /* uncompressed messages come straight out of the mapping */
+  if(depth <= 0 || !IS_COMPRESS_MAGIC(ctx)) return 0;
+
+  pf = calloc(1, sizeof(*pf));
+  if(!pf || !(pf->slots = calloc(depth, sizeof(*pf->slots)))) {
+    free(pf);
+    ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+    ctx->last_errno = ENOMEM;
+    return -1;
+  }
+  pf->depth = depth;
+  pf->exhausted = 1;  /* nothing to do until the first read */
+  if(!(pf->hctx = jlog_new(ctx->path))) {
+    free(pf->slots);
+    free(pf);
+    ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+    ctx->last_errno = ENOMEM;
+    return -1;
+  }
+  pf->hctx->multi_process = ctx->multi_process;
+  if(jlog_ctx_open_reader(pf->hctx, ctx->subscriber_name) != 0) {
+    ctx->last_error = pf->hctx->last_error;
+    ctx->last_errno = pf->hctx->last_errno;
+    jlog_ctx_close(pf->hctx);
+    free(pf->slots);
+    free(pf);
+    return -1;
+  }
+  pthread_mutex_init(&pf->lock, NULL);
+  pthread_cond_init(&pf->cv, NULL);
+  ctx->prefetch = pf;
+  if(pthread_create(&pf->thread, NULL, __jlog_prefetch_thread, ctx) != 0) {
+    ctx->last_errno = errno;
+    ctx->prefetch = NULL;
+    pthread_cond_destroy(&pf->cv);
+    pthread_mutex_destroy(&pf->lock);
+    jlog_ctx_close(pf->hctx);
+    free(pf->slots);
+    free(pf);
+    ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+    return -1;
+  }
+  return 0;
+}
+
+static void __jlog_prefetch_stop(jlog_ctx *ctx) {
+  jlog_prefetch *pf = ctx->prefetch;
+  int i;
+
+  if(!pf) return;
+  pthread_mutex_lock(&pf->lock);
+  pf->stop = 1;
+  pthread_cond_broadcast(&pf->cv);
+  pthread_mutex_unlock(&pf->lock);
+  pthread_join(pf->thread, NULL);
+  pthread_cond_destroy(&pf->cv);
+  pthread_mutex_destroy(&pf->lock);
+  jlog_ctx_close(pf->hctx);
+  for(i = 0; i < pf->depth; i++) free(pf->slots[i].buf);
+  free(pf->slots);
+  free(pf);
+  ctx->prefetch = NULL;
+}
+
+static void *__jlog_reclaim_thread(void *arg) {
+  jlog_ctx *ctx = arg;
+  jlog_reclaim *rc = ctx->reclaim;
+  struct timeval now;
+  struct timespec until;
+  u_int32_t log;
+
+  pthread_mutex_lock(&rc->lock);
+  while(1) {
+    while(!rc->count && !rc->stop) pthread_cond_wait(&rc->cv, &rc->lock);
+    if(!rc->count) break;
+    log = rc->queue[rc->head];
+    rc->head = (rc->head + 1) % rc->size;
+    rc->count--;
+    pthread_mutex_unlock(&rc->lock);
+
+    __jlog_unlink_segment(ctx, log);
+
+    pthread_mutex_lock(&rc->lock);
+    /* pace ourselves, but a stop means drain what is left right away */
+    if(rc->per_second && rc->count && !rc->stop) {
+      gettimeofday(&now, NULL);
+      until.tv_sec = now.tv_sec;
+      until.tv_nsec = now.tv_usec * 1000L + 1000000000L / rc->per_second;
+      until.tv_sec += until.tv_nsec / 1000000000L;
+      until.tv_nsec %= 1000000000L;
+      while(!rc->stop &&
+            pthread_cond_timedwait(&rc->cv, &rc->lock, &until) != ETIMEDOUT);
+    }
+  }
+  pthread_mutex_unlock(&rc->lock);
+  return NULL;
+}
+
+static int __jlog_reclaim_queue(jlog_ctx *ctx, u_int32_t log) {
+  jlog_reclaim *rc = ctx->reclaim;
+  u_int32_t *queue;
+  int i;
+
+  pthread_mutex_lock(&rc->lock);
+  if(rc->count == rc->size) {
+    queue = malloc((rc->size ? rc->size * 2 : 16) * sizeof(*queue));
+    if(!queue) {
+      pthread_mutex_unlock(&rc->lock);
+      return -1;
+    }
+    for(i = 0; i < rc->count; i++)
+      queue[i] = rc->queue[(rc->head + i) % rc->size];
+    free(rc->queue);
+    rc->queue = queue;
+    rc->head = 0;
+    rc->size = rc->size ? rc->size * 2 : 16;
+  }
+  rc->queue[(rc->head + rc->count) % rc->size] = log;
+  rc->count++;
+  pthread_cond_signal(&rc->cv);
+  pthread_mutex_unlock(&rc->lock);
+  return 0;
+}
+
+int jlog_ctx_set_async_reclaim(jlog_ctx *ctx, int enable, u_int32_t per_second) {
+  jlog_reclaim *rc;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->reclaim) {
+    if(enable) {
+      pthread_mutex_lock(&ctx->reclaim->lock);
+      ctx->reclaim->per_second = per_second;
+      pthread_cond_signal(&ctx->reclaim->cv);
+      pthread_mutex_unlock(&ctx->reclaim->lock);
+      return 0;
+    }
+    __jlog_reclaim_stop(ctx);
+    return 0;
+  }
+  if(!enable) return 0;
+
+  rc = calloc(1, sizeof(*rc));
+  if(!rc) {
+    ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+    ctx->last_errno = ENOMEM;
+    return -1;
+  }
+  rc->per_second = per_second;
+  pthread_mutex_init(&rc->lock, NULL);
+  pthread_cond_init(&rc->cv, NULL);
+  ctx->reclaim = rc;
+  if(pthread_create(&rc->thread, NULL, __jlog_reclaim_thread, ctx) != 0) {
+    ctx->last_errno = errno;
+    ctx->reclaim = NULL;
+    pthread_cond_destroy(&rc->cv);
+    pthread_mutex_destroy(&rc->lock);
+    free(rc);
+    ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+    return -1;
+  }
+  return 0;
+}
+
+static void __jlog_reclaim_stop(jlog_ctx *ctx) {
+  jlog_reclaim *rc = ctx->reclaim;
+
+  if(!rc) return;
+  pthread_mutex_lock(&rc->lock);
+  rc->stop = 1;
+  pthread_cond_broadcast(&rc->cv);
+  pthread_mutex_unlock(&rc->lock);
+  pthread_join(rc->thread, NULL);
+  pthread_cond_destroy(&rc->cv);
+  pthread_mutex_destroy(&rc->lock);
+  free(rc->queue);
+  free(rc);
+  ctx->reclaim = NULL;
+}
+
 int jlog_ctx_bulk_read_messages(jlog_ctx *ctx, const jlog_id *id, const int count, jlog_message *m) {
   off_t index_len;
   u_int64_t data_off;
-  int with_lock = 0;
+  int with_lock = 0, locked = 0;
   size_t hdr_size = 0;
-  uint32_t *message_disk_len;
+  u_int32_t disk_len;
   int i;
 
   if (count <= 0) {
     return 0;
   }
 
+  if (ctx->context_mode == JLOG_READ) {
+    switch(__jlog_read_closed(ctx, id, count, m)) {
+      case 1: return 0;
+      case -1: return -1;
+    }
+  }
+  if (IS_FIXED_RECORDS(ctx))
+    return __jlog_read_fixed(ctx, id, count, m);
+
  once_more_with_lock:
 
   data_off = 0;
@@ -2214,32 +4958,45 @@ int jlog_ctx_bulk_read_messages(jlog_ctx *ctx, const jlog_id *id, const int coun
       with_lock = 0;
       SYS_FAIL(JLOG_ERR_LOCK);
     }
+    locked = 1;
   }
 
   if ((index_len = jlog_file_size(ctx->index)) == -1)
     SYS_FAIL(JLOG_ERR_IDX_SEEK);
   if (index_len % sizeof(u_int64_t))
     SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
-  if (id->marker * sizeof(u_int64_t) > index_len) {
-    SYS_FAIL(JLOG_ERR_ILLEGAL_LOGID);
-  }
-
-  if (!jlog_file_pread(ctx->index, &data_off, sizeof(u_int64_t),
-                       (id->marker - 1) * sizeof(u_int64_t)))
-  {
-    SYS_FAIL(JLOG_ERR_IDX_READ);
-  }
-
-  if (data_off == 0 && id->marker != 1) {
-    if (id->marker * sizeof(u_int64_t) == index_len) {
-      /* close tag; not a real offset */
+  if (IS_SPARSE_INDEX(ctx)) {
+    int err = __jlog_sparse_offset(ctx, id, index_len, &data_off);
+    if (err == JLOG_ERR_CLOSE_LOGID) {
       ctx->last_error = JLOG_ERR_CLOSE_LOGID;
       ctx->last_errno = 0;
-      if(with_lock) jlog_file_unlock(ctx->index);
+      if(locked) jlog_file_unlock(ctx->index);
       return -1;
-    } else {
-      /* an offset of 0 in the middle of an index means curruption */
-      SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
+    }
+    if (err != JLOG_ERR_SUCCESS)
+      SYS_FAIL(err);
+  } else {
+    if (id->marker * sizeof(u_int64_t) > index_len) {
+      SYS_FAIL(JLOG_ERR_ILLEGAL_LOGID);
+    }
+
+    if (!jlog_file_pread(ctx->index, &data_off, sizeof(u_int64_t),
+                         (id->marker - 1) * sizeof(u_int64_t)))
+    {
+      SYS_FAIL(JLOG_ERR_IDX_READ);
+    }
+
+    if (data_off == 0 && id->marker != 1) {
+      if (id->marker * sizeof(u_int64_t) == index_len) {
+        /* close tag; not a real offset */
+        ctx->last_error = JLOG_ERR_CLOSE_LOGID;
+        ctx->last_errno = 0;
+        if(locked) jlog_file_unlock(ctx->index);
+        return -1;
+      } else {
+        /* an offset of 0 in the middle of an index means curruption */
+        SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
+      }
     }
   }
 
@@ -2248,26 +5005,20 @@ int jlog_ctx_bulk_read_messages(jlog_ctx *ctx, const jlog_id *id, const int coun
 
   for (i=0; i < count; i++) {
     jlog_message *msg = &m[i];
-    message_disk_len = &msg->aligned_header.mlen;
-
-    if (IS_COMPRESS_MAGIC(ctx)) {
-      hdr_size = sizeof(jlog_message_header_compressed);
-      message_disk_len = &msg->aligned_header.compressed_len;
-    } else {
-      hdr_size = sizeof(jlog_message_header);
-    }
 
-    if(data_off > ctx->mmap_len - hdr_size) {
+    if(data_off >= ctx->mmap_len ||
+       !(hdr_size = __jlog_parse_header(ctx, id->log,
+                                        ((u_int8_t *)ctx->mmap_base) + data_off,
+                                        ctx->mmap_len - data_off, 1,
+                                        &msg->aligned_header, &disk_len,
+                                        NULL))) {
 #ifdef DEBUG
       fprintf(stderr, "read idx off end: %llu\n", data_off);
 #endif
       SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
     }
 
-    memcpy(&msg->aligned_header, ((u_int8_t *)ctx->mmap_base) + data_off,
-           hdr_size);
-
-    if(data_off + hdr_size + *message_disk_len > ctx->mmap_len) {
+    if(data_off + hdr_size + disk_len > ctx->mmap_len) {
 #ifdef DEBUG
       fprintf(stderr, "read idx off end: %llu %llu\n", data_off, ctx->mmap_len);
 #endif
@@ -2276,7 +5027,7 @@ int jlog_ctx_bulk_read_messages(jlog_ctx *ctx, const jlog_id *id, const int coun
 
     msg->header = &msg->aligned_header;
 
-    if (IS_COMPRESS_MAGIC(ctx)) {
+    if (WANT_DECOMPRESS(ctx)) {
       if (ctx->mess_data_size < msg->aligned_header.mlen) {
         ctx->mess_data = realloc(ctx->mess_data, msg->aligned_header.mlen * 2);
         ctx->mess_data_size = msg->aligned_header.mlen * 2;
@@ -2285,33 +5036,230 @@ int jlog_ctx_bulk_read_messages(jlog_ctx *ctx, const jlog_id *id, const int coun
                       msg->header->compressed_len, ctx->mess_data, ctx->mess_data_size);
       msg->mess_len = msg->header->mlen;
       msg->mess = ctx->mess_data;
-      data_off += msg->header->compressed_len;
     } else {
-      msg->mess_len = msg->header->mlen;
+      msg->mess_len = disk_len;
       msg->mess = (((u_int8_t *)ctx->mmap_base) + data_off + hdr_size);
-      data_off += msg->mess_len;
     }
-    data_off += hdr_size;
+    data_off += hdr_size + disk_len;
+  }
+  __jlog_readahead(ctx, id->log, data_off);
+ finish:
+  if(locked) jlog_file_unlock(ctx->index);
+  if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
+  if(!with_lock) {
+    if (ctx->last_error == JLOG_ERR_IDX_CORRUPT) {
+      if (jlog_file_lock(ctx->index)) {
+        jlog_file_truncate(ctx->index, 0);
+        jlog_file_unlock(ctx->index);
+      }
+    }
+    ___jlog_resync_index(ctx, id->log, NULL, NULL);
+    with_lock = 1;
+#ifdef DEBUG
+    fprintf(stderr, "read retrying with lock\n");
+#endif
+    goto once_more_with_lock;
+  }
+  return -1;
+}
+/* where the newest segment ends, for jlogs whose metastore has no
+ * write_seq to watch */
+static u_int64_t __jlog_write_mark(jlog_ctx *ctx) {
+  char file[MAXPATHLEN];
+  struct stat sb;
+  u_int32_t log = ctx->meta->storage_log;
+
+  memset(file, 0, sizeof(file));
+  STRSETDATAFILE(ctx, file, log);
+  if(stat(file, &sb) != 0) sb.st_size = 0;
+  return ((u_int64_t)log << 32) | (u_int32_t)sb.st_size;
+}
+
+/* remember what the writers had published as of this read_interval, so
+ * that jlog_ctx_wait only sleeps if nothing new has arrived since */
+static void __jlog_wait_reset(jlog_ctx *ctx) {
+  if(ctx->meta_is_mapped)
+    ctx->last_write_seq = *(volatile u_int32_t *)&ctx->meta->write_seq;
+  if(ctx->wait_polls) ctx->last_write_mark = __jlog_write_mark(ctx);
+#if HAVE_SYS_INOTIFY_H
+  if(ctx->wait_fd >= 0) {
+    char buf[4096];
+    while(read(ctx->wait_fd, buf, sizeof(buf)) > 0);
+  }
+#endif
+}
+
+int jlog_ctx_wait_fd(jlog_ctx *ctx) {
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  if(ctx->wait_fd >= 0) return ctx->wait_fd;
+#if HAVE_SYS_INOTIFY_H
+  ctx->wait_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if(ctx->wait_fd >= 0 &&
+     inotify_add_watch(ctx->wait_fd, ctx->path,
+                       IN_MODIFY|IN_CREATE|IN_MOVED_TO) >= 0)
+    return ctx->wait_fd;
+  ctx->last_error = JLOG_ERR_OPEN;
+  ctx->last_errno = errno;
+  if(ctx->wait_fd >= 0) close(ctx->wait_fd);
+  ctx->wait_fd = -1;
+#else
+  ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+  ctx->last_errno = ENOTSUP;
+#endif
+  return -1;
+}
+
+#if HAVE_SYS_INOTIFY_H
+/* drain the directory watch; 1 if it saw a segment written or added */
+static int __jlog_wait_events(jlog_ctx *ctx) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  ssize_t n, off;
+  int hit = 0;
+
+  while((n = read(ctx->wait_fd, buf, sizeof(buf))) > 0) {
+    for(off = 0; off + (ssize_t)sizeof(*ev) <= n; off += sizeof(*ev) + ev->len) {
+      ev = (const struct inotify_event *)(buf + off);
+      if(ev->len && strlen(ev->name) == 8 &&
+         strspn(ev->name, "0123456789abcdef") == 8)
+        hit = 1;
+    }
+  }
+  return hit;
+}
+#endif
+
+#ifdef JLOG_USE_FUTEX
+/* a writer may zero the count under a reader about to leave it */
+static void __jlog_waiters_leave(volatile u_int32_t *waiters) {
+  u_int32_t w;
+  while((w = *waiters) != 0 &&
+        !__sync_bool_compare_and_swap(waiters, w, w - 1));
+}
+#endif
+
+int jlog_ctx_wait(jlog_ctx *ctx, const struct timeval *timeout) {
+  volatile u_int32_t *seq;
+  struct timeval now, until;
+  useconds_t sleeptime = 1000;
+#ifdef JLOG_USE_FUTEX
+  struct timespec ts, tnow, tuntil;
+  int rv;
+#endif
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  if(__jlog_restore_metastore(ctx, 0) != 0) return -1;
+  seq = (volatile u_int32_t *)&ctx->meta->write_seq;
+  if(JLOG_META_EXTENDED(ctx->meta) && *seq != ctx->last_write_seq) return 1;
+  /* don't sit on deferred progress while idle */
+  if(jlog_ctx_flush_checkpoint(ctx) != 0) return -1;
+
+#ifdef JLOG_USE_FUTEX
+  if(JLOG_META_EXTENDED(ctx->meta)) {
+    if(timeout) {
+      clock_gettime(CLOCK_MONOTONIC, &tuntil);
+      tuntil.tv_sec += timeout->tv_sec + (tuntil.tv_nsec / 1000 +
+                                          timeout->tv_usec) / 1000000;
+      tuntil.tv_nsec = (tuntil.tv_nsec / 1000 + timeout->tv_usec) % 1000000 * 1000;
+    }
+    /* sleep in slices: a wake-up lost to a writer clearing a stale waiter
+     * count then costs at most one slice */
+    while(1) {
+      ts.tv_sec = WAIT_SLICE_SEC;
+      ts.tv_nsec = 0;
+      if(timeout) {
+        clock_gettime(CLOCK_MONOTONIC, &tnow);
+        if(tnow.tv_sec > tuntil.tv_sec ||
+           (tnow.tv_sec == tuntil.tv_sec && tnow.tv_nsec >= tuntil.tv_nsec))
+          break;
+        if(tuntil.tv_sec - tnow.tv_sec <= WAIT_SLICE_SEC) {
+          ts.tv_sec = tuntil.tv_sec - tnow.tv_sec;
+          ts.tv_nsec = tuntil.tv_nsec - tnow.tv_nsec;
+          if(ts.tv_nsec < 0) {
+            ts.tv_sec--;
+            ts.tv_nsec += 1000000000;
+          }
+        }
+      }
+      __sync_add_and_fetch(&ctx->meta->waiters, 1);
+      rv = syscall(SYS_futex, seq, FUTEX_WAIT, ctx->last_write_seq, &ts, NULL, 0);
+      __jlog_waiters_leave(&ctx->meta->waiters);
+      if(rv == -1 && errno != ETIMEDOUT && errno != EAGAIN && errno != EINTR) {
+        ctx->last_error = JLOG_ERR_LOCK;
+        ctx->last_errno = errno;
+        return -1;
+      }
+      if(rv == 0 || errno != ETIMEDOUT || *seq != ctx->last_write_seq) break;
+    }
+    return (*seq != ctx->last_write_seq) ? 1 : 0;
   }
- finish:
-  if(with_lock) jlog_file_unlock(ctx->index);
-  if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
-  if(!with_lock) {
-    if (ctx->last_error == JLOG_ERR_IDX_CORRUPT) {
-      if (jlog_file_lock(ctx->index)) {
-        jlog_file_truncate(ctx->index, 0);
-        jlog_file_unlock(ctx->index);
+#endif
+  /* No futex, or no count of writes in an older metastore to sleep on;
+   * watch the directory if we can, otherwise the counter or, lacking
+   * that, where the newest segment ends.  Without the counter, watching
+   * only starts now, so the first wait reports that something may have
+   * come in since read_interval and leaves the caller to look. */
+#if HAVE_SYS_INOTIFY_H && HAVE_POLL_H
+  {
+    int fresh = ctx->wait_fd < 0, ms = -1;
+    if(jlog_ctx_wait_fd(ctx) >= 0) {
+      struct pollfd pfd;
+      if(fresh && !JLOG_META_EXTENDED(ctx->meta)) return 1;
+      gettimeofday(&until, NULL);
+      if(timeout) timeradd(&until, timeout, &until);
+      pfd.fd = ctx->wait_fd;
+      pfd.events = POLLIN;
+      /* readers checkpointing and indexing write here too; only a
+       * segment being written or added means anything */
+      while(1) {
+        if(timeout) {
+          gettimeofday(&now, NULL);
+          if(!timercmp(&now, &until, <)) break;
+          timersub(&until, &now, &now);
+          ms = now.tv_sec * 1000 + (now.tv_usec + 999) / 1000;
+        }
+        pfd.revents = 0;
+        if(poll(&pfd, 1, ms) < 0 && errno != EINTR) {
+          ctx->last_error = JLOG_ERR_LOCK;
+          ctx->last_errno = errno;
+          return -1;
+        }
+        if(JLOG_META_EXTENDED(ctx->meta) && *seq != ctx->last_write_seq)
+          return 1;
+        if((pfd.revents & POLLIN) && __jlog_wait_events(ctx)) return 1;
       }
+      return 0;
     }
-    ___jlog_resync_index(ctx, id->log, NULL, NULL);
-    with_lock = 1;
-#ifdef DEBUG
-    fprintf(stderr, "read retrying with lock\n");
+    ctx->last_error = JLOG_ERR_SUCCESS;
+  }
 #endif
-    goto once_more_with_lock;
+  if(!JLOG_META_EXTENDED(ctx->meta) && !ctx->wait_polls) {
+    ctx->wait_polls = 1;
+    return 1;
   }
-  return -1;
+  gettimeofday(&until, NULL);
+  if(timeout) timeradd(&until, timeout, &until);
+  while(JLOG_META_EXTENDED(ctx->meta) ? *seq == ctx->last_write_seq :
+        __jlog_write_mark(ctx) == ctx->last_write_mark) {
+    gettimeofday(&now, NULL);
+    if(timeout && !timercmp(&now, &until, <)) break;
+    usleep(sleeptime);
+    if(sleeptime < 100000) sleeptime *= 2;
+  }
+  if(JLOG_META_EXTENDED(ctx->meta)) return (*seq != ctx->last_write_seq) ? 1 : 0;
+  return (__jlog_write_mark(ctx) != ctx->last_write_mark) ? 1 : 0;
 }
+
 int jlog_ctx_read_interval(jlog_ctx *ctx, jlog_id *start, jlog_id *finish) {
   jlog_id chkpt;
   int count = 0;
@@ -2324,7 +5272,10 @@ int jlog_ctx_read_interval(jlog_ctx *ctx, jlog_id *start, jlog_id *finish) {
   }
 
   __jlog_restore_metastore(ctx, 0);
-  if(jlog_get_checkpoint(ctx, ctx->subscriber_name, &chkpt))
+  __jlog_wait_reset(ctx);
+  if(ctx->cp_pending)
+    chkpt = ctx->cp_pending_id;
+  else if(jlog_get_checkpoint(ctx, ctx->subscriber_name, &chkpt))
     SYS_FAIL(JLOG_ERR_INVALID_SUBSCRIBER);
   if(__jlog_find_first_log_after(ctx, &chkpt, start, finish) != 0)
     goto finish; /* Leave whatever error was set in find_first_log_after */
@@ -2367,15 +5318,133 @@ int jlog_ctx_read_interval(jlog_ctx *ctx, jlog_id *start, jlog_id *finish) {
   return -1;
 }
 
-int jlog_ctx_first_log_id(jlog_ctx *ctx, jlog_id *id) {
+/* loads the records of segment log, through marker upto, carrying a tag
+ * our filter wants, in marker order */
+static int __jlog_load_tag_marks(jlog_ctx *ctx, u_int32_t log, u_int32_t upto) {
+  char file[MAXPATHLEN];
+  u_int32_t buf[BUFFERED_INDICES];
+  size_t n, j;
+  jlog_file *f;
+  off_t len, off;
+  int tag, ok;
+
+  ctx->tag_marks_valid = 0;
+  ctx->tag_marks_len = 0;
+  for(tag = 1; tag < 256; tag++) {
+    if(!(ctx->tag_filter[tag >> 3] & (1 << (tag & 7)))) continue;
+    if(__jlog_tag_index_filename(ctx, file, log, tag) != 0) return -1;
+    if(!(f = jlog_file_open(file, 0, ctx->file_mode, ctx->multi_process))) {
+      if(errno == ENOENT) continue;  /* nothing so tagged yet */
+      return -1;
+    }
+    ok = (len = jlog_file_size(f)) >= 0;
+    len -= len % sizeof(u_int32_t);
+    for(off = 0; ok && off < len; off += n * sizeof(u_int32_t)) {
+      n = (len - off) / sizeof(u_int32_t);
+      if(n > BUFFERED_INDICES) n = BUFFERED_INDICES;
+      if(!(ok = jlog_file_pread(f, buf, n * sizeof(u_int32_t), off))) break;
+      for(j = 0; j < n && buf[j] <= upto; j++) {
+        if(ctx->tag_marks_len == ctx->tag_marks_alloc) {
+          size_t na = ctx->tag_marks_alloc ? ctx->tag_marks_alloc * 2 : 64;
+          jlog_tag_mark *p = realloc(ctx->tag_marks, na * sizeof(*p));
+          if(!p) {
+            ok = 0;
+            break;
+          }
+          ctx->tag_marks = p;
+          ctx->tag_marks_alloc = na;
+        }
+        ctx->tag_marks[ctx->tag_marks_len].marker = buf[j];
+        ctx->tag_marks[ctx->tag_marks_len].tag = tag;
+        ctx->tag_marks_len++;
+      }
+      if(j < n) break;
+    }
+    jlog_file_close(f);
+    if(!ok) return -1;
+  }
+  /* each index is ascending; no record is in two */
+  if(ctx->tag_marks_len)
+    qsort(ctx->tag_marks, ctx->tag_marks_len, sizeof(*ctx->tag_marks),
+          __jlog_tag_mark_cmp_marker);
+  ctx->tag_marks_log = log;
+  ctx->tag_marks_upto = upto;
+  ctx->tag_marks_valid = 1;
+  return 0;
+}
+
+int jlog_ctx_filter_next(jlog_ctx *ctx, jlog_id *id, const jlog_id *end) {
+  jlog_id last;
+  size_t lo, hi, mid;
+  int closed;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  if(id->marker == 0) id->marker = 1;
+  while(id->log < end->log ||
+        (id->log == end->log && id->marker <= end->marker)) {
+    if(!ctx->tag_filtered) return 1;
+    if(!ctx->tag_marks_valid || ctx->tag_marks_log != id->log ||
+       (id->log == end->log ? end->marker : 0xffffffff) >
+         ctx->tag_marks_upto) {
+      /* resync leaves the tag indexes current through last */
+      if(__jlog_resync_index(ctx, id->log, &last, &closed) != 0)
+        return -1;
+      if(__jlog_load_tag_marks(ctx, id->log, last.marker) != 0)
+        SYS_FAIL(JLOG_ERR_IDX_READ);
+      /* a closed segment's are complete */
+      if(closed) ctx->tag_marks_upto = 0xffffffff;
+    }
+    lo = 0;
+    hi = ctx->tag_marks_len;
+    while(lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if(ctx->tag_marks[mid].marker < id->marker) lo = mid + 1;
+      else hi = mid;
+    }
+    if(lo < ctx->tag_marks_len &&
+       (id->log < end->log || ctx->tag_marks[lo].marker <= end->marker)) {
+      id->marker = ctx->tag_marks[lo].marker;
+      return 1;
+    }
+    if(id->log == end->log) break;
+    id->log++;
+    id->marker = 1;
+  }
+  return 0;
+ finish:
+  return -1;
+}
+
+static void __jlog_note_first_log(jlog_ctx *ctx, u_int32_t log) {
+  u_int32_t cur;
+
+  if(!ctx->meta_is_mapped || !JLOG_META_EXTENDED(ctx->meta)) return;
+  while((cur = ctx->meta->first_log) < log &&
+        !__sync_bool_compare_and_swap(&ctx->meta->first_log, cur, log));
+}
+
+static int __jlog_segment_exists(jlog_ctx *ctx, u_int32_t log) {
+  char file[MAXPATHLEN];
+
+  memset(file, 0, sizeof(file));
+  STRSETDATAFILE(ctx, file, log);
+  return access(file, F_OK) == 0;
+}
+
+/* as __jlog_first_live_log, but always from the directory, so it also
+ * finds segments below first_log that the bookkeeping lost */
+static int __jlog_scan_first_log(jlog_ctx *ctx, u_int32_t *first) {
   DIR *d;
   struct dirent *de;
-  ctx->last_error = JLOG_ERR_SUCCESS;
   u_int32_t log;
   int found = 0;
 
-  id->log = 0xffffffff;
-  id->marker = 0;
+  *first = 0xffffffff;
   d = opendir(ctx->path);
   if (!d) return -1;
 
@@ -2393,10 +5462,39 @@ int jlog_ctx_first_log_id(jlog_ctx *ctx, jlog_id *id) {
     }
     if(i != 8) continue;
     found = 1;
-    if(log < id->log) id->log = log;
+    if(log < *first) *first = log;
   }
-  if(!found) id->log = 0;
   closedir(d);
+  if(found) __jlog_note_first_log(ctx, *first);
+  return found;
+}
+
+/* 1 and the oldest segment in *first, 0 if there are none, -1 on error */
+static int __jlog_first_live_log(jlog_ctx *ctx, u_int32_t *first) {
+  u_int32_t log, last;
+  int probes;
+
+  if(ctx->meta_is_mapped) {
+    last = ctx->meta->storage_log;
+    log = ctx->meta->first_log;
+    for(probes = 0; log <= last && probes < FIRST_LOG_PROBES; log++, probes++) {
+      if(__jlog_segment_exists(ctx, log)) {
+        __jlog_note_first_log(ctx, log);
+        *first = log;
+        return 1;
+      }
+    }
+    if(log > last) return 0;
+  }
+  return __jlog_scan_first_log(ctx, first);
+}
+
+int jlog_ctx_first_log_id(jlog_ctx *ctx, jlog_id *id) {
+  ctx->last_error = JLOG_ERR_SUCCESS;
+
+  id->log = 0;
+  id->marker = 0;
+  if(__jlog_first_live_log(ctx, &id->log) < 0) return -1;
   return 0;
 }
 
@@ -2413,6 +5511,121 @@ int jlog_ctx_last_log_id(jlog_ctx *ctx, jlog_id *id) {
   return -1;
 }
 
+/* record headers already carry their time and the .idx holds the offset
+ * of every record (fixed-size records need no index to find it), so the
+ * index doubles as the timestamp index */
+static int __jlog_record_time(jlog_ctx *ctx, u_int32_t log, u_int32_t marker,
+                              u_int64_t *t) {
+  jlog_message_header_compressed hdr;
+  u_int64_t data_off;
+  u_int32_t disk_len, skip;
+  ssize_t hdr_size;
+  jlog_closed_segment *seg;
+  off_t data_len;
+
+  if((seg = __jlog_find_closed(ctx, log)) != NULL) {
+    if(__jlog_closed_offset(ctx, seg, marker, &data_off) != 0 ||
+       !__jlog_parse_header(ctx, log, ((u_int8_t *)seg->data_base) + data_off,
+                            seg->data_len - data_off, 1, &hdr, &disk_len,
+                            NULL))
+      return -1;
+  }
+  else {
+    __jlog_open_reader(ctx, log);
+    if(IS_FIXED_RECORDS(ctx)) {
+      if(!ctx->data) return -1;
+      data_off = (u_int64_t)(marker - 1) * FIXED_STRIDE(ctx);
+    }
+    else {
+      __jlog_open_indexer(ctx, log);
+      if(!ctx->data || !ctx->index ||
+         !jlog_file_pread(ctx->index, &data_off, sizeof(data_off),
+                          (marker - 1) / INDEX_INTERVAL(ctx) *
+                            sizeof(u_int64_t)))
+        return -1;
+    }
+    if((data_len = jlog_file_size(ctx->data)) == -1) return -1;
+    /* a sparse index leaves us at an earlier record; step forward */
+    for(skip = IS_FIXED_RECORDS(ctx) ? 0 : (marker - 1) % INDEX_INTERVAL(ctx);
+        skip > 0; skip--) {
+      if((hdr_size = __jlog_pread_header(ctx, ctx->data, log, data_off,
+                                         data_len, 0, &hdr, &disk_len,
+                                         NULL)) <= 0)
+        return -1;
+      data_off += hdr_size + disk_len;
+    }
+    if(__jlog_pread_header(ctx, ctx->data, log, data_off, data_len, 1,
+                           &hdr, &disk_len, NULL) <= 0)
+      return -1;
+  }
+  *t = (u_int64_t)hdr.tv_sec * TIME_UNITS(ctx) + hdr.tv_usec;
+  return 0;
+}
+
+int jlog_ctx_seek_time(jlog_ctx *ctx, const struct timeval *when, jlog_id *id) {
+  u_int64_t target, t, lo, hi, mid, log;
+  jlog_id first, last;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  if(__jlog_restore_metastore(ctx, 0) != 0)
+    SYS_FAIL(JLOG_ERR_META_OPEN);
+  if(jlog_ctx_first_log_id(ctx, &first) != 0)
+    SYS_FAIL(JLOG_ERR_OPEN);
+  target = (u_int64_t)when->tv_sec * TIME_UNITS(ctx) +
+           when->tv_usec * (TIME_UNITS(ctx) / 1000000);
+
+  /* find the last segment whose first record is no later than target */
+  lo = first.log;
+  hi = (u_int64_t)ctx->meta->storage_log + 1;
+  log = first.log;
+  while(lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if(__jlog_resync_index(ctx, mid, &last, NULL) != 0) goto finish;
+    if(last.marker > 0) {
+      if(__jlog_record_time(ctx, mid, 1, &t) != 0)
+        SYS_FAIL(JLOG_ERR_FILE_READ);
+      if(t <= target) {
+        log = mid;
+        lo = mid + 1;
+        continue;
+      }
+    }
+    hi = mid;
+  }
+
+  /* the answer is in that segment unless all of it predates target, in
+   * which case it is the first record of the next one with any */
+  for(; log <= ctx->meta->storage_log; log++) {
+    if(__jlog_resync_index(ctx, log, &last, NULL) != 0) goto finish;
+    lo = 1;
+    hi = (u_int64_t)last.marker + 1;
+    while(lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if(__jlog_record_time(ctx, log, mid, &t) != 0)
+        SYS_FAIL(JLOG_ERR_FILE_READ);
+      if(t < target) lo = mid + 1;
+      else hi = mid;
+    }
+    if(lo <= last.marker) {
+      id->log = log;
+      id->marker = lo;
+      return 0;
+    }
+  }
+  /* everything is older; point just past the end */
+  id->log = last.log;
+  id->marker = last.marker + 1;
+
+ finish:
+  if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
+  return -1;
+}
+
 int jlog_ctx_advance_id(jlog_ctx *ctx, jlog_id *cur, 
                         jlog_id *start, jlog_id *finish)
 {
@@ -2431,6 +5644,223 @@ int jlog_ctx_advance_id(jlog_ctx *ctx, jlog_id *cur,
   return 0;
 }
 
+/* state shared by the workers of one jlog_ctx_read_range call; chunks
+ * are whole segments, handed out from next_chunk */
+typedef struct {
+  jlog_ctx *parent;
+  jlog_id start, finish;
+  int ordered;
+  jlog_range_func func;
+  void *closure;
+  pthread_mutex_t lock;
+  pthread_cond_t turn_cv;
+  u_int32_t next_chunk, nchunks, turn;
+  int stop;
+  jlog_err error;
+  int error_errno;
+} jlog_range_job;
+
+/* an ordered worker copies a chunk out here before its turn comes up */
+typedef struct {
+  jlog_id *ids;
+  jlog_message *msgs;
+  size_t *offs;
+  u_int32_t cnt, cnt_alloc;
+  char *data;
+  size_t data_len, data_alloc;
+} jlog_range_buffer;
+
+/* stop is set under job->lock, but workers also poll it between messages */
+static int __jlog_range_stopped(jlog_range_job *job) {
+  return __sync_fetch_and_add(&job->stop, 0);
+}
+
+static void __jlog_range_stop(jlog_range_job *job, jlog_err err, int err_errno) {
+  pthread_mutex_lock(&job->lock);
+  if(err != JLOG_ERR_SUCCESS && job->error == JLOG_ERR_SUCCESS) {
+    job->error = err;
+    job->error_errno = err_errno;
+  }
+  __sync_lock_test_and_set(&job->stop, 1);
+  pthread_cond_broadcast(&job->turn_cv);
+  pthread_mutex_unlock(&job->lock);
+}
+
+static void __jlog_range_fail(jlog_range_job *job, jlog_ctx *rctx) {
+  __jlog_range_stop(job, rctx->last_error, rctx->last_errno);
+}
+
+static int __jlog_range_buffer_add(jlog_range_buffer *b, const jlog_id *id,
+                                   const jlog_message *m) {
+  if(b->cnt == b->cnt_alloc) {
+    u_int32_t n = b->cnt_alloc ? b->cnt_alloc * 2 : 1024;
+    jlog_id *ids = realloc(b->ids, n * sizeof(*ids));
+    jlog_message *msgs;
+    size_t *offs;
+    if(!ids) return -1;
+    b->ids = ids;
+    if(!(msgs = realloc(b->msgs, n * sizeof(*msgs)))) return -1;
+    b->msgs = msgs;
+    if(!(offs = realloc(b->offs, n * sizeof(*offs)))) return -1;
+    b->offs = offs;
+    b->cnt_alloc = n;
+  }
+  if(b->data_len + m->mess_len > b->data_alloc) {
+    size_t n = b->data_alloc ? b->data_alloc : 65536;
+    char *data;
+    while(n < b->data_len + m->mess_len) n *= 2;
+    if(!(data = realloc(b->data, n))) return -1;
+    b->data = data;
+    b->data_alloc = n;
+  }
+  memcpy(b->data + b->data_len, m->mess, m->mess_len);
+  b->ids[b->cnt] = *id;
+  b->msgs[b->cnt] = *m;
+  b->offs[b->cnt] = b->data_len;
+  b->data_len += m->mess_len;
+  b->cnt++;
+  return 0;
+}
+
+static void *__jlog_range_worker(void *vjob) {
+  jlog_range_job *job = vjob;
+  jlog_range_buffer buf;
+  jlog_ctx *rctx;
+  jlog_message m;
+  jlog_id id, last;
+  u_int32_t chunk, i;
+
+  memset(&buf, 0, sizeof(buf));
+  if(!(rctx = jlog_new(job->parent->path))) {
+    __jlog_range_stop(job, JLOG_ERR_OPEN, ENOMEM);
+    return NULL;
+  }
+  rctx->multi_process = job->parent->multi_process;
+  if(jlog_ctx_open_reader(rctx, job->parent->subscriber_name) != 0) {
+    __jlog_range_fail(job, rctx);
+    goto out;
+  }
+
+  while(1) {
+    pthread_mutex_lock(&job->lock);
+    if(__jlog_range_stopped(job) || job->next_chunk >= job->nchunks) {
+      pthread_mutex_unlock(&job->lock);
+      break;
+    }
+    chunk = job->next_chunk++;
+    pthread_mutex_unlock(&job->lock);
+
+    id.log = job->start.log + chunk;
+    id.marker = (chunk == 0 && job->start.marker > 0) ? job->start.marker : 1;
+    if(id.log == job->finish.log) last = job->finish;
+    else if(__jlog_resync_index(rctx, id.log, &last, NULL) != 0) {
+      __jlog_range_fail(job, rctx);
+      break;
+    }
+
+    buf.cnt = 0;
+    buf.data_len = 0;
+    for(; id.marker <= last.marker && !__jlog_range_stopped(job); id.marker++) {
+      if(jlog_ctx_read_message(rctx, &id, &m) != 0) {
+        __jlog_range_fail(job, rctx);
+        break;
+      }
+      if(job->ordered) {
+        if(__jlog_range_buffer_add(&buf, &id, &m) != 0) {
+          rctx->last_error = JLOG_ERR_FILE_READ;
+          rctx->last_errno = ENOMEM;
+          __jlog_range_fail(job, rctx);
+          break;
+        }
+      }
+      else if(job->func(job->closure, &id, &m) != 0)
+        __jlog_range_stop(job, JLOG_ERR_SUCCESS, 0);
+    }
+    if(!job->ordered) continue;
+
+    pthread_mutex_lock(&job->lock);
+    while(job->turn != chunk && !__jlog_range_stopped(job))
+      pthread_cond_wait(&job->turn_cv, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+    for(i = 0; i < buf.cnt && !__jlog_range_stopped(job); i++) {
+      buf.msgs[i].header = &buf.msgs[i].aligned_header;
+      buf.msgs[i].mess = buf.data + buf.offs[i];
+      if(job->func(job->closure, &buf.ids[i], &buf.msgs[i]) != 0)
+        __jlog_range_stop(job, JLOG_ERR_SUCCESS, 0);
+    }
+    pthread_mutex_lock(&job->lock);
+    job->turn++;
+    pthread_cond_broadcast(&job->turn_cv);
+    pthread_mutex_unlock(&job->lock);
+  }
+
+ out:
+  free(buf.ids);
+  free(buf.msgs);
+  free(buf.offs);
+  free(buf.data);
+  jlog_ctx_close(rctx);
+  return NULL;
+}
+
+int jlog_ctx_read_range(jlog_ctx *ctx, const jlog_id *start,
+                        const jlog_id *finish, int nthreads, int ordered,
+                        jlog_range_func func, void *closure) {
+  jlog_range_job job;
+  pthread_t *tids;
+  int i, started = 0;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  if(!func || nthreads < 1 || start->log > finish->log ||
+     (start->log == finish->log && start->marker > finish->marker)) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_LOGID;
+    ctx->last_errno = EINVAL;
+    return -1;
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.parent = ctx;
+  job.start = *start;
+  job.finish = *finish;
+  job.ordered = ordered;
+  job.func = func;
+  job.closure = closure;
+  job.nchunks = finish->log - start->log + 1;
+  job.error = JLOG_ERR_SUCCESS;
+  if((u_int32_t)nthreads > job.nchunks) nthreads = job.nchunks;
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.turn_cv, NULL);
+
+  tids = calloc(nthreads, sizeof(*tids));
+  if(tids) {
+    for(i = 0; i < nthreads; i++) {
+      if(pthread_create(&tids[started], NULL, __jlog_range_worker, &job) != 0)
+        break;
+      started++;
+    }
+  }
+  if(started == 0) {
+    /* no threads to be had; do the work here */
+    __jlog_range_worker(&job);
+  }
+  for(i = 0; i < started; i++) pthread_join(tids[i], NULL);
+  free(tids);
+  pthread_cond_destroy(&job.turn_cv);
+  pthread_mutex_destroy(&job.lock);
+
+  if(job.error != JLOG_ERR_SUCCESS) {
+    ctx->last_error = job.error;
+    ctx->last_errno = job.error_errno;
+    return -1;
+  }
+  return job.stop ? 1 : 0;
+}
+
 static int is_datafile(const char *f, u_int32_t *logid) {
   int i;
   u_int32_t l = 0;
@@ -2448,9 +5878,11 @@ static int is_datafile(const char *f, u_int32_t *logid) {
   return 1;
 }
 
+/* reads the directory rather than starting from first_log, so segments
+ * the bookkeeping lost track of are cleaned up too */
 int jlog_clean(const char *file) {
-  int rv = -1;
-  u_int32_t earliest = 0;
+  int rv = -1, failed = 0;
+  u_int32_t earliest = 0, logid;
   jlog_ctx *log;
   DIR *dir;
   struct dirent *de;
@@ -2461,30 +5893,154 @@ int jlog_clean(const char *file) {
   if(!dir) goto out;
 
   earliest = 0;
-  if(jlog_pending_readers(log, 0, &earliest) < 0) goto out;
+  if(jlog_pending_readers(log, 0, &earliest) < 0) goto done;
 
   rv = 0;
   while((de = readdir(dir)) != NULL) {
-    u_int32_t logid;
     if(is_datafile(de->d_name, &logid) && logid < earliest) {
       char fullfile[MAXPATHLEN];
-      char fullidx[MAXPATHLEN];
+      int len;
 
       memset(fullfile, 0, sizeof(fullfile));
-      memset(fullidx, 0, sizeof(fullidx));
-      snprintf(fullfile, sizeof(fullfile), "%s/%s", file, de->d_name);
-      snprintf(fullidx, sizeof(fullidx), "%s/%s" INDEX_EXT, file, de->d_name);
-      (void)unlink(fullfile);
-      (void)unlink(fullidx); /* this may not exist; don't care */
-      rv++;
+      STRSETDATAFILE(log, fullfile, logid);
+      if(unlink(fullfile) == 0) rv++;
+      else if(errno != ENOENT) failed = 1;
+      len = strlen(fullfile);
+      if((len + sizeof(INDEX_EXT)) <= sizeof(fullfile)) {
+        memcpy(fullfile + len, INDEX_EXT, sizeof(INDEX_EXT));
+        (void)unlink(fullfile); /* this may not exist; don't care */
+      }
+      __jlog_unlink_tag_indexes(log, logid);
     }
   }
+  if(!failed) __jlog_note_first_log(log, earliest);
+ done:
   closedir(dir);
  out:
   jlog_ctx_close(log);
   return rv;
 }
 
+/* the disk a segment takes, its index and tag indexes included */
+static u_int64_t __jlog_segment_bytes(jlog_ctx *ctx, u_int32_t log) {
+  char file[MAXPATHLEN];
+  struct stat sb;
+  u_int64_t total = 0;
+  int len, tag;
+
+  memset(file, 0, sizeof(file));
+  STRSETDATAFILE(ctx, file, log);
+  if(stat(file, &sb) == 0) total += sb.st_size;
+  len = strlen(file);
+  if((len + sizeof(INDEX_EXT)) > sizeof(file)) return total;
+  memcpy(file + len, INDEX_EXT, sizeof(INDEX_EXT));
+  if(stat(file, &sb) == 0) total += sb.st_size;
+  if(!IS_COMPACT_HEADERS(ctx)) return total;
+  for(tag = 1; tag < 256; tag++)
+    if(JLOG_TAG_USED(ctx->meta, tag) &&
+       __jlog_tag_index_filename(ctx, file, log, tag) == 0 &&
+       stat(file, &sb) == 0)
+      total += sb.st_size;
+  return total;
+}
+
+/* the time of segment log's first record, which no record of an earlier
+ * segment is newer than.  Read through a handle of our own, since the
+ * context may be a writer's */
+static int __jlog_segment_first_time(jlog_ctx *ctx, u_int32_t log,
+                                     time_t *sec) {
+  char file[MAXPATHLEN];
+  jlog_message_header_compressed hdr;
+  u_int32_t disk_len;
+  jlog_file *f;
+  off_t len;
+  ssize_t rv = -1;
+
+  memset(file, 0, sizeof(file));
+  STRSETDATAFILE(ctx, file, log);
+  if(!(f = jlog_file_open(file, 0, ctx->file_mode, ctx->multi_process)))
+    return -1;
+  if((len = jlog_file_size(f)) > 0)
+    rv = __jlog_pread_header(ctx, f, log, 0, len, 1, &hdr, &disk_len, NULL);
+  jlog_file_close(f);
+  if(rv <= 0) return -1;
+  *sec = hdr.tv_sec;
+  return 0;
+}
+
+int jlog_ctx_enforce_retention(jlog_ctx *ctx) {
+  u_int32_t first, last, upto, log;
+  u_int64_t max_bytes, total;
+  time_t cutoff, t;
+  jlog_id chkpt, moved;
+  char **list = NULL;
+  int i, removed = 0, failed = 0;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_APPEND) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  max_bytes = JLOG_RETAIN_BYTES(ctx->meta);
+  if(!ctx->meta->retain_age && !max_bytes) return 0;
+  /* from the directory: a segment first_log has lost track of counts
+   * against the limits as much as any other */
+  switch(__jlog_scan_first_log(ctx, &first)) {
+    case -1: SYS_FAIL(JLOG_ERR_OPEN);
+    case 0: return 0;
+  }
+  /* the segment being written always stays */
+  last = ctx->meta->storage_log;
+  upto = first;
+
+  if(max_bytes) {
+    total = 0;
+    for(log = last + 1; log-- > first; ) {
+      total += __jlog_segment_bytes(ctx, log);
+      if(total > max_bytes && log < last) {
+        upto = log + 1;
+        break;
+      }
+    }
+  }
+  if(ctx->meta->retain_age) {
+    cutoff = time(NULL) - ctx->meta->retain_age;
+    while(upto < last && __jlog_segment_first_time(ctx, upto + 1, &t) == 0 &&
+          t < cutoff)
+      upto++;
+  }
+  if(upto <= first) return 0;
+  for(log = first; log < upto; log++)
+    if(__jlog_segment_exists(ctx, log)) removed++;
+
+  /* move subscribers still reading what goes to the first segment kept,
+   * so none of them reads it from the start again; once every one has
+   * moved, the usual checkpoint cleanup may already drop the segments.
+   * Lagging readers may still have them mapped, so neither that cleanup
+   * nor ours recycles them as spares */
+  moved.log = upto;
+  moved.marker = 0;
+  if(jlog_ctx_list_subscribers(ctx, &list) < 0) SYS_FAIL(JLOG_ERR_CHECKPOINT);
+  for(i = 0; list[i]; i++) {
+    if(jlog_get_checkpoint(ctx, list[i], &chkpt) == 0 && chkpt.log < upto &&
+       __jlog_write_checkpoint(ctx, list[i], &moved, 0) != 0) {
+      jlog_ctx_list_subscribers_dispose(ctx, list);
+      SYS_FAIL(JLOG_ERR_CHECKPOINT);
+    }
+  }
+  jlog_ctx_list_subscribers_dispose(ctx, list);
+
+  for(log = first; log < upto; log++)
+    if(__jlog_segment_exists(ctx, log) &&
+       __jlog_unlink_datafile(ctx, log, 0) != 0)
+      failed = 1;
+  if(!failed) __jlog_note_first_log(ctx, upto);
+  return removed;
+ finish:
+  return -1;
+}
+
 /* ------------------ jlog_ctx_repair() and friends ----------- */
 
 /*
@@ -2574,8 +6130,9 @@ static int metastore_ok_p(char *ag, unsigned int lat) {
   off_t oof = lseek(fd, 0, SEEK_END);
   (void)lseek(fd, 0, SEEK_SET);
   size_t fourI = 4*sizeof(unsigned int);
-  FASSERT(oof == (off_t)fourI, "metastore size invalid");
-  if ( oof != (off_t)fourI ) {
+  // newer metastores carry more fields after the original four
+  FASSERT(oof >= (off_t)fourI, "metastore size invalid");
+  if ( oof < (off_t)fourI ) {
     (void)close(fd);
     return 0;
   }
@@ -2601,7 +6158,143 @@ static int metastore_ok_p(char *ag, unsigned int lat) {
   return (gotem == 4);
 }
 
-static int repair_metastore(const char *pth, unsigned int lat) {
+/* what the metastore being replaced can still tell about the jlog's
+ * format: 1 if it has the extended layout intact (*old filled in), 0 if it
+ * is a sound original 16 bytes, in which case no format option was ever
+ * chosen, -1 if it is gone or can't be trusted */
+static int repair_read_metastore(const char *ag, struct _jlog_meta_info *old) {
+  u_int8_t buf[sizeof(*old) + 1];
+  memset(old, 0, sizeof(*old));
+  int fd = open(ag, O_RDONLY);
+  if ( fd < 0 )
+    return -1;
+  ssize_t rd = read(fd, buf, sizeof(buf));
+  (void)close(fd);
+  if ( rd != JLOG_META_BASE_SIZE && rd != (ssize_t)sizeof(*old) )
+    return -1;
+  memcpy(old, buf, rd);
+  if ( (old->hdr_magic != DEFAULT_HDR_MAGIC &&
+        (old->hdr_magic & DEFAULT_HDR_MAGIC_COMPRESSION) !=
+          DEFAULT_HDR_MAGIC_COMPRESSION) ||
+       old->safety > JLOG_SAFE )
+    return -1;
+  if ( rd == JLOG_META_BASE_SIZE )
+    return 0;
+  return JLOG_META_EXTENDED(old) ? 1 : -1;
+}
+
+/* whether the jlog_message_header records from the start of segment fd
+ * stamp nanoseconds: no tv_usec of a million or more is microseconds.
+ * Records all stamped within a millisecond of a whole second can't tell,
+ * and are taken for microseconds */
+static int repair_nsec_records(int fd) {
+  jlog_message_header_compressed hdr;
+  off_t off = 0;
+  int i;
+  for ( i = 0; i < 4096; i++ ) {
+    if ( pread(fd, &hdr, sizeof(jlog_message_header), off) !=
+         sizeof(jlog_message_header) )
+      break;
+    if ( hdr.tv_usec >= 1000000 )
+      return 1;
+    if ( hdr.reserved == DEFAULT_HDR_MAGIC )
+      off += sizeof(jlog_message_header) + hdr.mlen;
+    else if ( (hdr.reserved & DEFAULT_HDR_MAGIC_COMPRESSION) ==
+              DEFAULT_HDR_MAGIC_COMPRESSION &&
+              pread(fd, &hdr.compressed_len, sizeof(hdr.compressed_len),
+                    off + sizeof(jlog_message_header)) ==
+                sizeof(hdr.compressed_len) )
+      off += sizeof(hdr) + hdr.compressed_len;
+    else
+      break;
+  }
+  return 0;
+}
+
+/* the size of every record of a jlog of fixed-size records, which keeps
+ * no .idx and whose records all have a plain header and that many bytes;
+ * 0 for any other jlog.  One nobody has read yet whose records merely
+ * happen to be the same length passes too, which only means writes of
+ * another length are refused from now on */
+static u_int32_t repair_record_size(const char *pth, unsigned int ear,
+                                    unsigned int lat) {
+  char file[MAXPATHLEN];
+  struct dirent *ent;
+  int indexed = 0;
+  DIR *dir = opendir(pth);
+  if ( dir == NULL )
+    return 0;
+  while ( (ent = readdir(dir)) != NULL ) {
+    size_t n = strlen(ent->d_name);
+    if ( n > strlen(INDEX_EXT) &&
+         strcmp(ent->d_name + n - strlen(INDEX_EXT), INDEX_EXT) == 0 )
+      indexed = 1;
+  }
+  (void)closedir(dir);
+  if ( indexed )
+    return 0;
+  jlog_message_header hdr;
+  u_int32_t size = 0;
+  unsigned int seg;
+  for ( seg = ear; seg - ear <= lat - ear; seg++ ) {
+    void *base;
+    size_t len, off = 0;
+    (void)snprintf(file, sizeof(file), "%s%c%08x", pth, IFS_CH, seg);
+    if ( !jlog_map_path_read(file, &base, &len) )
+      continue;
+    while ( off + sizeof(hdr) <= len ) {
+      memcpy(&hdr, (char *)base + off, sizeof(hdr));
+      if ( hdr.reserved != DEFAULT_HDR_MAGIC || hdr.mlen == 0 ||
+           (size && hdr.mlen != size) )
+        break;
+      size = hdr.mlen;
+      off += sizeof(hdr) + size;
+    }
+    munmap(base, len);
+    if ( off != len )
+      return 0;
+  }
+  return size;
+}
+
+/* the interval the .idx files were written with: a closed sparse index
+ * says in its trailer, and a closed dense one is 1.  An open one can't
+ * tell, so if there are only open ones they are dropped, for readers to
+ * rebuild at whatever interval repair settles on.  0 if a sparse index
+ * was closed without saying */
+static u_int32_t repair_index_interval(const char *pth, unsigned int ear,
+                                       unsigned int lat) {
+  char file[MAXPATHLEN];
+  u_int64_t tail[2];
+  unsigned int seg;
+  int pass;
+  for ( pass = 0; pass < 2; pass++ ) {
+    for ( seg = ear; seg - ear <= lat - ear; seg++ ) {
+      (void)snprintf(file, sizeof(file), "%s%c%08x" INDEX_EXT, pth, IFS_CH,
+                     seg);
+      if ( pass == 1 ) {
+        (void)unlink(file);
+        continue;
+      }
+      int fd = open(file, O_RDONLY);
+      if ( fd < 0 )
+        continue;
+      off_t len = lseek(fd, 0, SEEK_END);
+      int got = len >= (off_t)sizeof(tail) && len % sizeof(u_int64_t) == 0 &&
+                pread(fd, tail, sizeof(tail), len - sizeof(tail)) ==
+                  sizeof(tail);
+      (void)close(fd);
+      if ( got && tail[0] == JLOG_SPARSE_CLOSE )
+        return JLOG_SPARSE_INTERVAL(tail[1]);
+      if ( got && tail[1] == 0 )
+        return 1;
+    }
+  }
+  return 1;
+}
+
+static int repair_metastore(const char *pth, unsigned int ear,
+                            unsigned int lat) {
   if ( pth == NULL || pth[0] == '\0' ) {
     FASSERT(0, "invalid metastore path");
     return 0;
@@ -2611,18 +6304,91 @@ static int repair_metastore(const char *pth, unsigned int lat) {
     FASSERT(0, "invalid metastore path length");
     return 0;
   }
-  size_t leen2 = leen + strlen("metastore") + 4; 
+  size_t leen2 = leen + strlen(CPTABLE_FILE) + 4;
   char *ag = (char *)calloc(leen2, sizeof(char));
   if ( ag == NULL )             /* out of memory, so bail */
     return 0;
+  struct _jlog_meta_info goal, old;
+  (void)snprintf(ag, leen2-1, "%s%cmetastore", pth, IFS_CH);
+  int known = repair_read_metastore(ag, &old);
+  memset(&goal, 0, sizeof(goal));
+  goal.storage_log = lat;
+  goal.unit_limit = 4*1024*1024;
+  goal.safety = 1;
+  goal.hdr_magic = DEFAULT_HDR_MAGIC;
+  // a checkpoint table can't be rebuilt from anything, so keep using it
+  (void)snprintf(ag, leen2-1, "%s%c%s", pth, IFS_CH, CPTABLE_FILE);
+  if ( access(ag, F_OK) == 0 )
+    goal.format_flags |= JLOG_FORMAT_CHECKPOINT_TABLE;
+  // nor a dedup window; the file knows how many keys it holds
+  (void)snprintf(ag, leen2-1, "%s%c%s", pth, IFS_CH, DEDUP_FILE);
+  int xfd = open(ag, O_RDONLY);
+  if ( xfd >= 0 ) {
+    jlog_dedup_header dh;
+    if ( read(xfd, &dh, sizeof(dh)) == sizeof(dh) && dh.magic == DEDUP_MAGIC )
+      goal.dedup_window = dh.nkeys;
+    (void)close(xfd);
+  }
+  // the format (header kind, time units, record size, index interval)
+  // is kept by a metastore that still has it, and can't have been chosen
+  // by one that never grew past 16 bytes
+  if ( known > 0 ) {
+    goal.format_flags |= old.format_flags & (JLOG_FORMAT_COMPACT_HEADERS |
+                                             JLOG_FORMAT_NSEC_TIME);
+    memcpy(goal.tags_used, old.tags_used, sizeof(goal.tags_used));
+    goal.record_size = old.record_size;
+    goal.index_interval = old.index_interval;
+  }
+  // otherwise ask the records, in the oldest segment holding any (the
+  // newest is often still empty after a rollover): a whole v3 header,
+  // check byte and all, is no jlog_message_header, and either kind's
+  // times show their units
+  unsigned int seg;
+  for ( seg = ear; known < 0 && seg - ear <= lat - ear; seg++ ) {
+    (void)snprintf(ag, leen2-1, "%s%c%08x", pth, IFS_CH, seg);
+    int dfd = open(ag, O_RDONLY);
+    u_int8_t v3[JLOG_V3_MAX_HDR], v3flags, v3tag;
+    u_int64_t v3time;
+    u_int32_t v3mlen, v3clen;
+    ssize_t v3len;
+    if ( dfd < 0 )
+      continue;
+    if ( (v3len = read(dfd, v3, sizeof(v3))) <= 0 ) {
+      (void)close(dfd);
+      continue;
+    }
+    if ( __jlog_v3_parse(v3, v3len, 0, &v3flags, &v3tag, &v3time,
+                         &v3mlen, &v3clen) ||
+         __jlog_v3_parse(v3, v3len, 1, &v3flags, &v3tag, &v3time,
+                         &v3mlen, &v3clen) ) {
+      goal.format_flags |= JLOG_FORMAT_COMPACT_HEADERS;
+      // which topic tags have indexes is lost; assume any may
+      memset(goal.tags_used, 0xff, sizeof(goal.tags_used));
+      // the first record's time is absolute, and 1e17 microseconds
+      // since the epoch is three million years away
+      if ( v3time >= 100000000000000000ULL )
+        goal.format_flags |= JLOG_FORMAT_NSEC_TIME;
+    }
+    else if ( repair_nsec_records(dfd) )
+      goal.format_flags |= JLOG_FORMAT_NSEC_TIME;
+    (void)close(dfd);
+    break;
+  }
+  // fixed-size records leave no index to find them by, so they have to
+  // be told apart by what the segments hold
+  if ( known < 0 && !(goal.format_flags & JLOG_FORMAT_COMPACT_HEADERS) )
+    goal.record_size = repair_record_size(pth, ear, lat);
+  // reading a sparse index as a dense one finds the wrong records, so
+  // better no repair than a guess
+  if ( known < 0 && !goal.record_size &&
+       (goal.index_interval = repair_index_interval(pth, ear, lat)) == 0 ) {
+    FASSERT(0, "cannot tell the index interval");
+    free((void *)ag);
+    return 0;
+  }
   (void)snprintf(ag, leen2-1, "%s%cmetastore", pth, IFS_CH);
   int b = metastore_ok_p(ag, lat);
   FASSERT(b, "metastore integrity check failed");
-  unsigned int goal[4];
-  goal[0] = lat;
-  goal[1] = 4*1024*1024;
-  goal[2] = 1;
-  goal[3] = DEFAULT_HDR_MAGIC;
   (void)unlink(ag);             /* start from scratch */
   int fd = creat(ag, DEFAULT_FILE_MODE);
   free((void *)ag);
@@ -2630,10 +6396,13 @@ static int repair_metastore(const char *pth, unsigned int lat) {
   FASSERT(fd >= 0, "cannot create new metastore file");
   if ( fd < 0 )
     return 0;
-  int wr = write(fd, &goal[0], sizeof(goal));
+  // only as long as older versions read unless something needs more
+  if ( __jlog_meta_wants_ext(&goal) )
+    goal.meta_ext = JLOG_META_EXT;
+  int wr = write(fd, &goal, JLOG_META_SIZE(&goal));
   (void)close(fd);
-  FASSERT(wr == sizeof(goal), "cannot write new metastore file");
-  return (wr == sizeof(goal));
+  FASSERT(wr == (int)JLOG_META_SIZE(&goal), "cannot write new metastore file");
+  return (wr == (int)JLOG_META_SIZE(&goal));
 }
 
 static int new_checkpoint(char *ag, int fd, unsigned int ear) {
@@ -2995,7 +6764,7 @@ int jlog_ctx_repair(jlog_ctx *ctx, int aggressive) {
   if ( b0 == 1 ) {
     // step 3: attempt to repair the metastore. It might not need any
     // repair, in which case nothing will happen
-    int b1 = repair_metastore(pth, lat);
+    int b1 = repair_metastore(pth, ear, lat);
     FASSERT(b1, "cannot repair metastore");
     // step 4: attempt to repair the checkpoint file. It might not need
     // any repair, in which case nothing will happen
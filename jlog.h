@@ -54,6 +54,7 @@
 struct _jlog_ctx;
 struct _jlog_message_header;
 struct _jlog_id;
+struct timespec;
 
 typedef struct _jlog_ctx jlog_ctx;
 
@@ -131,6 +132,13 @@ typedef enum {
   JLOG_ERR_CLOSE_LOGID,
 } jlog_err;
 
+/* where writers get the time of messages written without one */
+typedef enum {
+  JLOG_CLOCK_REALTIME = 0,  /* read the clock for every message */
+  JLOG_CLOCK_COARSE,        /* CLOCK_REALTIME_COARSE: a tick's resolution */
+  JLOG_CLOCK_BATCH          /* one reading per flush, 256 messages or 10ms */
+} jlog_clock;
+
 typedef enum {
   JLOG_COMPRESSION_NULL = 0,
   JLOG_COMPRESSION_LZ4 = 0x01
@@ -140,6 +148,10 @@ typedef enum {
 
 typedef void (*jlog_error_func) (void *ctx, const char *msg, ...);
 
+/* return nonzero to stop the read */
+typedef int (*jlog_range_func) (void *closure, const jlog_id *id,
+                                const jlog_message *m);
+
 JLOG_API(jlog_ctx *) jlog_new(const char *path);
 JLOG_API(void)      jlog_set_error_func(jlog_ctx *ctx, jlog_error_func Func, void *ptr); 
 JLOG_API(size_t)    jlog_raw_size(jlog_ctx *ctx);
@@ -150,16 +162,38 @@ JLOG_API(int)       jlog_ctx_list_subscribers(jlog_ctx *ctx, char ***subs);
 
 JLOG_API(int)       jlog_ctx_err(jlog_ctx *ctx);
 JLOG_API(const char *) jlog_ctx_err_string(jlog_ctx *ctx);
+JLOG_API(const char *) jlog_err_string(jlog_err err);
 JLOG_API(int)       jlog_ctx_errno(jlog_ctx *ctx);
 JLOG_API(int)       jlog_ctx_open_writer(jlog_ctx *ctx);
 JLOG_API(int)       jlog_ctx_open_reader(jlog_ctx *ctx, const char *subscriber);
 JLOG_API(int)       jlog_ctx_close(jlog_ctx *ctx);
 
 JLOG_API(int)       jlog_ctx_alter_mode(jlog_ctx *ctx, int mode);
+/**
+ * Set the size at which writers move on to a new segment file (4MB by
+ * default).  Larger segments amortize the per-segment open, index and
+ * unlink work for heavy writers; sizes of 4GB and up are recorded in a
+ * second metastore word, unit_limit_hi, which extends the metastore past
+ * its original 16 bytes.  Older versions of the library refuse to open a
+ * jlog once that has happened; smaller sizes keep the 16-byte layout and
+ * stay readable by them.
+ */
 JLOG_API(int)       jlog_ctx_alter_journal_size(jlog_ctx *ctx, size_t size);
 JLOG_API(int)       jlog_ctx_repair(jlog_ctx *ctx, int aggressive);
 JLOG_API(int)       jlog_ctx_alter_safety(jlog_ctx *ctx, jlog_safety safety);
 
+/**
+ * Keep up to `count` fully consumed segments in a spare pool instead of
+ * unlinking them; at each rollover the writer renames a spare into place,
+ * reusing its inode and (where fallocate is available) its disk blocks.
+ * A spare is only emptied when it is taken, and readers drop their
+ * mappings of segments recycled since, but a message must still not be
+ * used once every subscriber has checkpointed past its segment.  The
+ * default of 0 unlinks consumed segments.  Like the other alter calls,
+ * this applies to a new or writer context.
+ */
+JLOG_API(int)       jlog_ctx_alter_spare_segments(jlog_ctx *ctx, u_int32_t count);
+
 /**
  * Control whether this jlog process should use multi-process safe file locks when performing 
  * reads or writes.  If you do not intend to use your jlog from multiple processes, you can 
@@ -170,6 +204,92 @@ JLOG_API(int)       jlog_ctx_alter_safety(jlog_ctx *ctx, jlog_safety safety);
  */
 JLOG_API(int)       jlog_ctx_set_multi_process(jlog_ctx *ctx, uint8_t mproc);
 
+/**
+ * Keep every subscriber's checkpoint in a single mmap'd table instead of a
+ * cp.<hex> file each, so that finding the earliest checkpoint is a memory
+ * scan and checkpointing is a store (plus an msync under JLOG_SAFE).  Worth
+ * it with many subscribers.  The table holds 1024 subscribers whose names
+ * are shorter than 80 bytes.
+ *
+ * must be called after jlog_new and before jlog_ctx_init; the choice is
+ * recorded in the metastore and fixed for the life of the jlog.
+ */
+JLOG_API(int)       jlog_ctx_set_checkpoint_table(jlog_ctx *ctx, uint8_t use);
+
+/**
+ * Write records with a compact header: a flags byte, varints for the
+ * time (a delta from the segment's first record) and lengths, and a check
+ * byte, typically 6-8 bytes where a jlog_message_header takes 16 (20
+ * compressed).  Readers still see a full jlog_message_header; timestamps
+ * keep microseconds.
+ *
+ * must be called after jlog_new and before jlog_ctx_init; the choice is
+ * recorded in the metastore and fixed for the life of the jlog.
+ */
+JLOG_API(int)       jlog_ctx_set_compact_headers(jlog_ctx *ctx, uint8_t use);
+
+/**
+ * Keep nanoseconds rather than microseconds: in such a jlog every
+ * message header's tv_usec holds nanoseconds.  `jlog_message_timespec`
+ * reads either kind.
+ *
+ * must be called after jlog_new and before jlog_ctx_init; the choice is
+ * recorded in the metastore and fixed for the life of the jlog.
+ */
+JLOG_API(int)       jlog_ctx_set_nsec_timestamps(jlog_ctx *ctx, uint8_t use);
+
+/**
+ * Make every message exactly `size` bytes long.  A record's offset in
+ * its segment then follows from its marker, so the jlog keeps no index
+ * files, and writes of any other length fail with JLOG_ERR_ILLEGAL_WRITE.
+ * Cannot be combined with compression or compact headers; jlog_ctx_init
+ * fails with JLOG_ERR_NOT_SUPPORTED if asked to.
+ *
+ * must be called after jlog_new and before jlog_ctx_init; the choice is
+ * recorded in the metastore and fixed for the life of the jlog.
+ */
+JLOG_API(int)       jlog_ctx_set_fixed_record_size(jlog_ctx *ctx,
+                                                   u_int32_t size);
+
+/**
+ * Index only every `interval`th message rather than every one; reads
+ * find the rest by stepping forward over at most interval - 1 records
+ * from the nearest indexed one.  This cuts the index to 1/interval of
+ * its usual size (it otherwise costs 8 bytes a message), and with it
+ * the index I/O readers do.  0 or 1 indexes every message.  Has no
+ * effect with fixed-size records, which keep no index at all.
+ *
+ * must be called after jlog_new and before jlog_ctx_init; the choice is
+ * recorded in the metastore and fixed for the life of the jlog.
+ */
+JLOG_API(int)       jlog_ctx_set_sparse_index(jlog_ctx *ctx,
+                                              u_int32_t interval);
+
+/**
+ * Keep a window of the last `keys` message keys given to
+ * `jlog_ctx_write_message_keyed`, so a producer retrying a write that
+ * already went through is not written twice.  The window lives in a
+ * mmap'd "dedup" file beside the metastore and so outlasts the writer;
+ * keys are compared by 64-bit hash, looked up in a hash table kept in the
+ * same file (32 bytes a key or more in all).  At most 16M keys; 0 keeps
+ * none.
+ *
+ * must be called after jlog_new and before jlog_ctx_init; the choice is
+ * recorded in the metastore and fixed for the life of the jlog.
+ */
+JLOG_API(int)       jlog_ctx_set_dedup_window(jlog_ctx *ctx, u_int32_t keys);
+
+/**
+ * Choose how a writer timestamps messages written without an explicit
+ * time.  JLOG_CLOCK_BATCH stamps everything that goes out in one flush
+ * of the pre-commit buffer with one reading of the clock, so it only
+ * saves anything with a pre-commit buffer.  A reading is reused for at
+ * most 256 messages and, where CLOCK_MONOTONIC_COARSE exists, 10ms
+ * (give or take a tick), so a slowly filling buffer never stamps a
+ * message much older than it is.
+ */
+JLOG_API(int)       jlog_ctx_set_clock(jlog_ctx *ctx, jlog_clock clock);
+
 /**
  * must be called after jlog_new and before the 'open' functions
  * defaults to using JLOG_COMPRESSION_LZ4
@@ -224,6 +344,99 @@ JLOG_API(int)       jlog_ctx_set_pre_commit_buffer_size(jlog_ctx *ctx, size_t s)
  */
 JLOG_API(int)       jlog_ctx_flush_pre_commit_buffer(jlog_ctx *ctx);
 
+/**
+ * For compressed jlogs, have a helper thread decompress up to `depth`
+ * messages beyond the one last read by `jlog_ctx_read_message`, so the
+ * caller's own per-message work overlaps with decompression.  Call after
+ * `jlog_ctx_open_reader`; a depth of 0 turns it off.  The message handed
+ * back stays valid until the next read, as without prefetching.  This has
+ * no effect on uncompressed jlogs.
+ */
+JLOG_API(int)       jlog_ctx_set_prefetch(jlog_ctx *ctx, int depth);
+
+/**
+ * Make `jlog_ctx_read_checkpoint` record progress in memory and write it
+ * out only once `ms` milliseconds have passed since the last write or
+ * after `count` checkpoint calls, whichever comes first (0 disables either
+ * bound; both 0, the default, writes every call).  This reader's own
+ * `jlog_ctx_read_interval` continues from the recorded progress.  Pending
+ * progress is also written by `jlog_ctx_flush_checkpoint`, before
+ * `jlog_ctx_wait` blocks, and by `jlog_ctx_close`; after a crash the
+ * subscriber resumes from the last write, so messages since then are
+ * delivered again.
+ */
+JLOG_API(int)       jlog_ctx_set_checkpoint_interval(jlog_ctx *ctx, u_int32_t ms,
+                                                     u_int32_t count);
+
+/**
+ * Write out progress held back by `jlog_ctx_set_checkpoint_interval`.
+ */
+JLOG_API(int)       jlog_ctx_flush_checkpoint(jlog_ctx *ctx);
+
+/**
+ * Hand segments that every subscriber has moved past to a helper thread
+ * instead of unlinking them inside the checkpoint call, so checkpointing
+ * never waits on the filesystem freeing a large file.  The helper removes
+ * at most `per_second` segments a second (0 for no limit).  With `enable`
+ * 0 the helper is stopped after removing whatever is still queued, as it
+ * is by `jlog_ctx_close`.
+ */
+JLOG_API(int)       jlog_ctx_set_async_reclaim(jlog_ctx *ctx, int enable,
+                                               u_int32_t per_second);
+
+/**
+ * Bound the jlog's disk use whatever its subscribers do: segments whose
+ * records are all older than `max_age` seconds, and the oldest segments
+ * beyond the newest `max_bytes` of them, are removed, with subscribers
+ * still reading them moved past.  0 leaves either unlimited.  Works a
+ * whole segment at a time, never on the one being written, so the limits
+ * are met to within a segment.  The policy is kept in the metastore and
+ * enforced by whichever writer starts a new segment; may be called on a
+ * new jlog or an open writer.
+ */
+JLOG_API(int)       jlog_ctx_set_retention(jlog_ctx *ctx, u_int32_t max_age,
+                                           u_int64_t max_bytes);
+/**
+ * Apply the retention policy now, as `jlogctl -R` does for jlogs whose
+ * writers are idle.
+ *
+ * \return the number of segments removed, -1 on error
+ */
+JLOG_API(int)       jlog_ctx_enforce_retention(jlog_ctx *ctx);
+
+/**
+ * Block a reader until a writer publishes new records, or until `timeout`
+ * elapses (NULL waits forever).  "New" is relative to the last call to
+ * `jlog_ctx_read_interval`, so the usual loop is read_interval, consume,
+ * checkpoint, and wait only when the interval came back empty.
+ *
+ * Writers bump a counter in the metastore whenever records reach a segment
+ * file (pre-commit buffered records count once flushed); on Linux readers
+ * sleep on it with a futex and are woken immediately.  Readers sleep a
+ * second at a time, so that the count of sleepers a reader killed while
+ * waiting leaves behind can be cleared without stranding anyone.
+ *
+ * That counter lives in the extended metastore, which only jlogs using
+ * newer features carry.  On a jlog still in the 16-byte layout a reader
+ * watches the directory for segment writes instead (or, without inotify,
+ * polls the newest segment's size); the first wait only starts that watch
+ * and returns 1, so call read_interval again before relying on it.
+ *
+ * \return 1 if new data may be available, 0 on timeout, -1 on error
+ *         (JLOG_ERR_ILLEGAL_WRITE for a context not opened as a reader)
+ */
+JLOG_API(int)       jlog_ctx_wait(jlog_ctx *ctx, const struct timeval *timeout);
+
+/**
+ * Returns a file descriptor that polls readable when the jlog directory is
+ * written to, for readers that live in an event loop.  The descriptor is
+ * owned by the context and drained by `jlog_ctx_read_interval`.
+ *
+ * \return the descriptor, or -1 (JLOG_ERR_NOT_SUPPORTED where inotify is
+ *         unavailable)
+ */
+JLOG_API(int)       jlog_ctx_wait_fd(jlog_ctx *ctx);
+
 JLOG_API(int)       jlog_ctx_add_subscriber(jlog_ctx *ctx, const char *subscriber,
                                             jlog_position whence);
 JLOG_API(int)       jlog_ctx_add_subscriber_copy_checkpoint(jlog_ctx *ctx, 
@@ -232,12 +445,117 @@ JLOG_API(int)       jlog_ctx_add_subscriber_copy_checkpoint(jlog_ctx *ctx,
 JLOG_API(int)       jlog_ctx_set_subscriber_checkpoint(jlog_ctx *ctx, const char *subscriber,
                                             const jlog_id *checkpoint);
 JLOG_API(int)       jlog_ctx_remove_subscriber(jlog_ctx *ctx, const char *subscriber);
+/**
+ * Add a subscriber that only wants records written with one of the
+ * `ntags` topic tags in `tags` (see `jlog_ctx_write_tagged`).  The filter
+ * is kept in `tf.<subscriber>` beside the checkpoint and loaded by
+ * `jlog_ctx_open_reader`; such a reader walks each interval with
+ * `jlog_ctx_filter_next`, which finds matching records from per-tag
+ * indexes instead of reading every record, and checkpoints the interval's
+ * end as usual.
+ *
+ * \return 0 on success, -1 (JLOG_ERR_NOT_SUPPORTED if a tag is 0 or
+ *         there are none)
+ */
+JLOG_API(int)       jlog_ctx_add_subscriber_filtered(jlog_ctx *ctx,
+                                                     const char *subscriber,
+                                                     jlog_position whence,
+                                                     const u_int8_t *tags,
+                                                     int ntags);
+
+/**
+ * Consumer groups let several processes share one subscriber.  Open a
+ * reader on the group's subscriber name in each worker and, instead of
+ * `jlog_ctx_read_interval`/`jlog_ctx_read_checkpoint`, loop on claim and
+ * checkpoint.  A claim leases one segment to the calling context (recorded
+ * in `lg.<subscriber>` beside the checkpoint) and returns the unread part
+ * of it, so several contexts in one process are separate workers; leases
+ * of contexts that are closed, or whose process exits, are handed out
+ * again from their last checkpoint.  The subscriber's own checkpoint follows the low watermark
+ * of the group, so pruning waits on the slowest lease.
+ *
+ * Delivery within a segment is in order; across segments it is not, and
+ * a message may be seen twice if its worker dies before checkpointing.
+ *
+ * \return the number of messages in [start, finish], 0 if there is
+ *         nothing to claim, -1 on error
+ */
+JLOG_API(int)       jlog_ctx_group_claim(jlog_ctx *ctx, jlog_id *start,
+                                         jlog_id *finish);
+/**
+ * Record progress on the segment leased by `jlog_ctx_group_claim`.
+ * Fails with JLOG_ERR_ILLEGAL_CHECKPOINT if the lease has been taken over.
+ */
+JLOG_API(int)       jlog_ctx_group_checkpoint(jlog_ctx *ctx, const jlog_id *id);
 
 JLOG_API(int)       jlog_ctx_write(jlog_ctx *ctx, const void *message, size_t mess_len);
+/**
+ * Write a message carrying topic tag `tag` (1-255) for filtered
+ * subscribers to select on.  Tags live in the compact record header, so
+ * other jlogs fail with JLOG_ERR_NOT_SUPPORTED.
+ */
+JLOG_API(int)       jlog_ctx_write_tagged(jlog_ctx *ctx, u_int8_t tag,
+                                          const void *message, size_t mess_len);
 JLOG_API(int)       jlog_ctx_write_message(jlog_ctx *ctx, jlog_message *msg, struct timeval *when);
+JLOG_API(int)       jlog_ctx_write_message_ts(jlog_ctx *ctx, jlog_message *msg,
+                                              const struct timespec *when);
+/**
+ * As `jlog_ctx_write_message`, unless `key` is among the jlog's dedup
+ * window (see `jlog_ctx_set_dedup_window`), in which case nothing is
+ * written.
+ *
+ * \return 0 if written, 1 if dropped as a duplicate, -1 on error
+ *         (JLOG_ERR_NOT_SUPPORTED if the jlog keeps no window)
+ */
+JLOG_API(int)       jlog_ctx_write_message_keyed(jlog_ctx *ctx, jlog_message *msg,
+                                                 struct timeval *when,
+                                                 const void *key, size_t key_len);
+/**
+ * The time `m` was written at, at whatever resolution the jlog keeps.
+ */
+JLOG_API(void)      jlog_message_timespec(jlog_ctx *ctx, const jlog_message *m,
+                                          struct timespec *ts);
 JLOG_API(int)       jlog_ctx_read_interval(jlog_ctx *ctx,
                                            jlog_id *first_mess, jlog_id *last_mess);
 JLOG_API(int)       jlog_ctx_read_message(jlog_ctx *ctx, const jlog_id *, jlog_message *);
+/**
+ * Move `id` forward to the first record at or after it, up to `end`,
+ * that this reader's tag filter wants; without a filter every record
+ * does.  The usual loop starts `id` at the interval's first record and
+ * reads `id` then advances it past each match.
+ *
+ * \return 1 if `id` is at a match, 0 if none remain up to `end`, -1 on
+ *         error
+ */
+JLOG_API(int)       jlog_ctx_filter_next(jlog_ctx *ctx, jlog_id *id,
+                                         const jlog_id *end);
+
+/* hand back compressed payloads as they sit on disk; see jlog_ctx_set_read_flags */
+#define JLOG_READ_NO_DECOMPRESS 0x01
+
+/**
+ * With JLOG_READ_NO_DECOMPRESS, reads from a compressed jlog leave the
+ * payload compressed: `mess` points at it in the mapped segment and
+ * `mess_len` is its compressed length, while `header->mlen` still gives
+ * the original length.  Consumers that only look at headers, or relay
+ * records with `jlog_ctx_write_compressed_message`, never pay for
+ * decompression; others can call `jlog_message_decompress` as needed.
+ */
+JLOG_API(int)       jlog_ctx_set_read_flags(jlog_ctx *ctx, u_int32_t flags);
+/**
+ * Decompress a message read with JLOG_READ_NO_DECOMPRESS in place, into
+ * the same per-context buffer an ordinary read would have used.  A no-op
+ * for messages that are not compressed.
+ */
+JLOG_API(int)       jlog_message_decompress(jlog_ctx *ctx, jlog_message *m);
+/**
+ * Append a message read with JLOG_READ_NO_DECOMPRESS from a jlog with the
+ * same compression provider, without recompressing it.
+ * \return 0 on success, -1 with JLOG_ERR_NOT_SUPPORTED if the providers
+ *         differ or this jlog is not compressed
+ */
+JLOG_API(int)       jlog_ctx_write_compressed_message(jlog_ctx *ctx, jlog_message *msg,
+                                                      struct timeval *when);
 JLOG_API(int)       jlog_ctx_bulk_read_messages(jlog_ctx *ctx, const jlog_id *, const int, jlog_message *);
 JLOG_API(int)       jlog_ctx_read_checkpoint(jlog_ctx *ctx, const jlog_id *checkpoint);
 JLOG_API(int)       jlog_snprint_logid(char *buff, int n, const jlog_id *checkpoint);
@@ -246,6 +564,42 @@ JLOG_API(int)       jlog_pending_readers(jlog_ctx *ctx, u_int32_t log, u_int32_t
 JLOG_API(int)       __jlog_pending_readers(jlog_ctx *ctx, u_int32_t log);
 JLOG_API(int)       jlog_ctx_first_log_id(jlog_ctx *ctx, jlog_id *id);
 JLOG_API(int)       jlog_ctx_last_log_id(jlog_ctx *ctx, jlog_id *id);
+/**
+ * Find the first message written at or after `when`, by binary search over
+ * the segments and then over the records of one segment.  Timestamps are
+ * taken to be nondecreasing; writers in several processes may interleave a
+ * little, so the answer can be off by a handful of records at the edge.
+ *
+ * To replay from there, checkpoint at `id` with the marker one less.
+ *
+ * \param id set to the message found, or to just past the last message if
+ *        everything in the jlog is older than `when`
+ * \return 0 on success, -1 on error
+ */
+JLOG_API(int)       jlog_ctx_seek_time(jlog_ctx *ctx, const struct timeval *when,
+                                       jlog_id *id);
+
+/**
+ * Read every message in [`start`, `finish`] (as returned by
+ * `jlog_ctx_read_interval` or `jlog_ctx_seek_time`) using up to `nthreads`
+ * threads, each with its own reader context, handing out whole segments
+ * as units of work.
+ *
+ * Unordered, `func` is called concurrently from the worker threads as
+ * each message is read, and must be thread-safe.  Ordered, each worker
+ * buffers its segment and `func` is called from one thread at a time in
+ * jlog order; the parallelism is then in reading and decompression, at
+ * the cost of up to `nthreads` segments of memory.
+ *
+ * No checkpoint is moved; that remains up to the caller.
+ *
+ * \return 0 when the range was read, 1 if `func` stopped it early, -1 on
+ *         error
+ */
+JLOG_API(int)       jlog_ctx_read_range(jlog_ctx *ctx, const jlog_id *start,
+                                        const jlog_id *finish, int nthreads,
+                                        int ordered, jlog_range_func func,
+                                        void *closure);
 JLOG_API(int)       jlog_ctx_advance_id(jlog_ctx *ctx, jlog_id *cur, 
                                         jlog_id *start, jlog_id *finish);
 JLOG_API(int)       jlog_clean(const char *path);
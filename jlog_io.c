@@ -49,8 +49,21 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-static pthread_mutex_t jlog_files_lock = PTHREAD_MUTEX_INITIALIZER;
-static jlog_hash_table jlog_files = JLOG_HASH_EMPTY;
+/* open files are registered by dev/ino so that every context in the
+ * process shares one fd (and so one set of fcntl locks) per file.  The
+ * registry is split into shards so that contexts switching segments do
+ * not all queue on a single mutex. */
+#define JLOG_FILE_SHARDS 16
+
+#define JLOG_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+typedef struct {
+  pthread_mutex_t lock;
+  jlog_hash_table files;
+} jlog_file_shard;
+
+static jlog_file_shard jlog_file_shards[JLOG_FILE_SHARDS];
+static pthread_once_t jlog_file_shards_once = PTHREAD_ONCE_INIT;
 
 typedef struct {
   dev_t st_dev;
@@ -64,51 +77,99 @@ struct _jlog_file {
   int locked;
   pthread_mutex_t lock;
   uint8_t multi_process;
+  /* fds from opens that raced with the one registered; closing one would
+   * drop our fcntl locks on the file, so they wait for the last close */
+  int *stray_fds;
+  int nstray;
 };
 
-jlog_file *jlog_file_open(const char *path, int flags, int mode, int multi_process)
+static void jlog_file_shards_init(void)
+{
+  int i;
+  for (i = 0; i < JLOG_FILE_SHARDS; i++)
+    pthread_mutex_init(&jlog_file_shards[i].lock, NULL);
+}
+
+static jlog_file_shard *jlog_file_shard_for(const jlog_file_id *id)
+{
+  u_int64_t h = (u_int64_t)id->st_ino ^ ((u_int64_t)id->st_dev << 7);
+  h ^= h >> 17;
+  return &jlog_file_shards[h % JLOG_FILE_SHARDS];
+}
+
+/* called with the shard locked */
+static jlog_file *jlog_file_share(jlog_file_shard *shard, const jlog_file_id *id)
 {
-  struct stat sb;
-  jlog_file_id id;
-  jlog_file *f = NULL;
   union {
     jlog_file *f;
     void *vptr;
   } pun;
-  int fd, realflags = O_RDWR;
+
+  if (!jlog_hash_retrieve(&shard->files, (void *)id, sizeof(jlog_file_id),
+                          &pun.vptr))
+    return NULL;
+  pun.f->refcnt++;
+  return pun.f;
+}
+
+jlog_file *jlog_file_open(const char *path, int flags, int mode, int multi_process)
+{
+  struct stat sb;
+  jlog_file_id id;
+  jlog_file_shard *shard;
+  jlog_file *f = NULL;
+  int *stray, fd, realflags = O_RDWR;
 
   if (flags & O_CREAT) realflags |= O_CREAT;
   if (flags & O_EXCL) realflags |= O_EXCL;
 
-  if (pthread_mutex_lock(&jlog_files_lock) != 0) return NULL;
+  pthread_once(&jlog_file_shards_once, jlog_file_shards_init);
 
-  if (stat(path, &sb) == 0) {
-    if (!S_ISREG(sb.st_mode)) goto out;
+  /* a file already open in this process must be shared rather than
+   * opened again, so look it up by dev/ino first (an O_EXCL open is
+   * new by definition).  No lock is held across any of the syscalls. */
+  if (!(flags & O_EXCL) && stat(path, &sb) == 0) {
+    if (!S_ISREG(sb.st_mode)) return NULL;
     memset(&id, 0, sizeof(id));
     id.st_dev = sb.st_dev;
     id.st_ino = sb.st_ino;
-    if (jlog_hash_retrieve(&jlog_files, (void *)&id, sizeof(jlog_file_id),
-                           &pun.vptr))
-    {
-      if (!(flags & O_EXCL)) {
-        f = pun.f;
-        f->refcnt++;
-      }
-      goto out;
-    }
+    shard = jlog_file_shard_for(&id);
+    if (pthread_mutex_lock(&shard->lock) != 0) return NULL;
+    f = jlog_file_share(shard, &id);
+    pthread_mutex_unlock(&shard->lock);
+    if (f) return f;
   }
 
-  if ((fd = open(path, realflags, mode)) == -1) goto out;
-  if (fstat(fd, &sb) != 0) {
+  if ((fd = open(path, realflags, mode)) == -1) return NULL;
+  if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
     while (close(fd) == -1 && errno == EINTR) ;
-    goto out;
+    return NULL;
   }
+  memset(&id, 0, sizeof(id));
   id.st_dev = sb.st_dev;
   id.st_ino = sb.st_ino;
-  if (!(f = malloc(sizeof(jlog_file)))) {
+  shard = jlog_file_shard_for(&id);
+
+  if (pthread_mutex_lock(&shard->lock) != 0) {
     while (close(fd) == -1 && errno == EINTR) ;
-    goto out;
+    return NULL;
   }
+  if ((f = jlog_file_share(shard, &id)) != NULL) {
+    /* someone registered it while we were opening */
+    if ((stray = realloc(f->stray_fds, (f->nstray + 1) * sizeof(int)))) {
+      f->stray_fds = stray;
+      f->stray_fds[f->nstray++] = fd;
+    }
+    else {
+      f->refcnt--;
+      f = NULL;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (!f) while (close(fd) == -1 && errno == EINTR) ;
+    return f;
+  }
+
+  if (!(f = malloc(sizeof(jlog_file)))) goto fail;
   memset(f, 0, sizeof(jlog_file));
   f->id = id;
   f->fd = fd;
@@ -116,27 +177,42 @@ jlog_file *jlog_file_open(const char *path, int flags, int mode, int multi_proce
   f->locked = 0;
   f->multi_process = multi_process;
   pthread_mutex_init(&(f->lock), NULL);
-  if (!jlog_hash_store(&jlog_files, (void *)&f->id, sizeof(jlog_file_id), f)) {
-    while (close(f->fd) == -1 && errno == EINTR) ;
+  if (!jlog_hash_store(&shard->files, (void *)&f->id, sizeof(jlog_file_id), f)) {
+    pthread_mutex_destroy(&(f->lock));
     free(f);
-    f = NULL;
+    goto fail;
   }
-out:
-  pthread_mutex_unlock(&jlog_files_lock);
+  pthread_mutex_unlock(&shard->lock);
   return f;
+
+fail:
+  pthread_mutex_unlock(&shard->lock);
+  while (close(fd) == -1 && errno == EINTR) ;
+  return NULL;
 }
 
 int jlog_file_close(jlog_file *f)
 {
-  if (pthread_mutex_lock(&jlog_files_lock) != 0) return 0;
-  if (--f->refcnt == 0) {
-    assert(jlog_hash_delete(&jlog_files, (void *)&f->id, sizeof(jlog_file_id),
+  jlog_file_shard *shard = jlog_file_shard_for(&f->id);
+  int i, last;
+
+  if (pthread_mutex_lock(&shard->lock) != 0) return 0;
+  if ((last = (--f->refcnt == 0))) {
+    assert(jlog_hash_delete(&shard->files, (void *)&f->id, sizeof(jlog_file_id),
                             NULL, NULL));
+    /* close before anyone can register the file again: closing any fd
+     * drops every fcntl lock this process holds on it, a new owner's
+     * included */
+    for (i = 0; i < f->nstray; i++)
+      while (close(f->stray_fds[i]) == -1 && errno == EINTR) ;
     while (close(f->fd) == -1 && errno == EINTR) ;
+  }
+  pthread_mutex_unlock(&shard->lock);
+  if (last) {
+    free(f->stray_fds);
     pthread_mutex_destroy(&(f->lock));
     free(f);
   }
-  pthread_mutex_unlock(&jlog_files_lock);  
   return 1;
 }
 
@@ -260,7 +336,7 @@ int jlog_file_map_rdwr(jlog_file *f, void **base, size_t *len)
   return 1;
 }
 
-int jlog_file_map_read(jlog_file *f, void **base, size_t *len)
+int jlog_file_map_rdwr_len(jlog_file *f, size_t len, void **base, size_t *size)
 {
   struct stat sb;
   void *my_map;
@@ -270,7 +346,79 @@ int jlog_file_map_read(jlog_file *f, void **base, size_t *len)
   flags = MAP_SHARED;
 #endif
   if (fstat(f->fd, &sb) != 0) return 0;
-  my_map = mmap(NULL, sb.st_size, PROT_READ, flags, f->fd, 0);
+  my_map = mmap(NULL, len, PROT_READ|PROT_WRITE, flags, f->fd, 0);
+  if (my_map == MAP_FAILED) return 0;
+  *base = my_map;
+  *size = sb.st_size;
+  return 1;
+}
+
+/* read-only mapping of a whole file; large ones are placed on a huge
+ * page boundary so transparent huge pages can back them where the
+ * filesystem allows */
+static void *jlog_map_file_read(int fd, size_t len)
+{
+  void *my_map = MAP_FAILED;
+  int flags = 0;
+
+#ifdef MAP_SHARED
+  flags = MAP_SHARED;
+#endif
+#if defined(MAP_ANONYMOUS) && defined(MAP_FIXED)
+  if (len >= JLOG_HUGEPAGE_SIZE) {
+    size_t span = len + JLOG_HUGEPAGE_SIZE, used;
+    uintptr_t pagesize = sysconf(_SC_PAGESIZE);
+    char *area, *aligned;
+
+    area = mmap(NULL, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area != MAP_FAILED) {
+      aligned = (char *)(((uintptr_t)area + JLOG_HUGEPAGE_SIZE - 1) &
+                         ~(uintptr_t)(JLOG_HUGEPAGE_SIZE - 1));
+      my_map = mmap(aligned, len, PROT_READ, flags | MAP_FIXED, fd, 0);
+      if (my_map == MAP_FAILED) {
+        munmap(area, span);
+      } else {
+        used = (len + pagesize - 1) & ~(pagesize - 1);
+        if (aligned > area) munmap(area, aligned - area);
+        if (aligned + used < area + span)
+          munmap(aligned + used, (area + span) - (aligned + used));
+      }
+    }
+  }
+#endif
+  if (my_map == MAP_FAILED)
+    my_map = mmap(NULL, len, PROT_READ, flags, fd, 0);
+#if defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+  if (my_map != MAP_FAILED && len >= JLOG_HUGEPAGE_SIZE)
+    madvise(my_map, len, MADV_HUGEPAGE);
+#endif
+  return my_map;
+}
+
+int jlog_file_map_read(jlog_file *f, void **base, size_t *len)
+{
+  struct stat sb;
+  void *my_map;
+
+  if (fstat(f->fd, &sb) != 0) return 0;
+  my_map = jlog_map_file_read(f->fd, sb.st_size);
+  if (my_map == MAP_FAILED) return 0;
+  *base = my_map;
+  *len = sb.st_size;
+  return 1;
+}
+
+int jlog_map_path_read(const char *path, void **base, size_t *len)
+{
+  struct stat sb;
+  void *my_map = MAP_FAILED;
+  int fd;
+
+  while ((fd = open(path, O_RDONLY)) == -1 && errno == EINTR) ;
+  if (fd == -1) return 0;
+  if (fstat(fd, &sb) == 0 && sb.st_size > 0)
+    my_map = jlog_map_file_read(fd, sb.st_size);
+  while (close(fd) == -1 && errno == EINTR) ;
   if (my_map == MAP_FAILED) return 0;
   *base = my_map;
   *len = sb.st_size;
@@ -294,4 +442,31 @@ int jlog_file_truncate(jlog_file *f, off_t len)
   return 0;
 }
 
+int jlog_file_willneed(jlog_file *f, off_t offset, off_t len)
+{
+#ifdef HAVE_POSIX_FADVISE
+  if (posix_fadvise(f->fd, offset, len, POSIX_FADV_WILLNEED) != 0) return 0;
+#endif
+  return 1;
+}
+
+int jlog_file_dontneed(jlog_file *f, off_t offset, off_t len)
+{
+#ifdef HAVE_POSIX_FADVISE
+  if (posix_fadvise(f->fd, offset, len, POSIX_FADV_DONTNEED) != 0) return 0;
+#endif
+  return 1;
+}
+
+int jlog_file_reserve(jlog_file *f, off_t len)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+  int rv;
+  while ((rv = fallocate(f->fd, FALLOC_FL_KEEP_SIZE, 0, len)) == -1 &&
+         errno == EINTR) ;
+  if (rv == -1 && errno != EOPNOTSUPP) return 0;
+#endif
+  return 1;
+}
+
 /* vim:se ts=2 sw=2 et: */
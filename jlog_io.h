@@ -114,6 +114,18 @@ int jlog_file_sync(jlog_file *f);
  */
 int jlog_file_map_rdwr(jlog_file *f, void **base, size_t *len);
 
+/**
+ * maps the first len bytes of a jlog_file for reading and writing, even
+ * if the file is shorter; the rest of its last page reads as zeros
+ * @param[in] f the jlog_file on which you are operating
+ * @param[in] len the length to map
+ * @param[out] base is set to the base of the mapped region
+ * @param[out] size is set to the length of the file
+ * @return 1 on success, 0 on failure
+ * @internal
+ */
+int jlog_file_map_rdwr_len(jlog_file *f, size_t len, void **base, size_t *size);
+
 /**
  * maps the entirety of a jlog_file into memory for reading
  * @param[out] map is set to the base of the mapped region
@@ -123,6 +135,18 @@ int jlog_file_map_rdwr(jlog_file *f, void **base, size_t *len);
  */
 int jlog_file_map_read(jlog_file *f, void **base, size_t *len);
 
+/**
+ * maps the entirety of the file at path into memory for reading; the
+ * file is opened read-only and the descriptor is closed before returning,
+ * so this bypasses the shared jlog_file handles entirely.  Only suitable
+ * for files that will no longer change.
+ * @param[out] map is set to the base of the mapped region
+ * @param[out] len is set to the length of the mapped region
+ * @return 1 on success, 0 on failure (including an empty file)
+ * @internal
+ */
+int jlog_map_path_read(const char *path, void **base, size_t *len);
+
 /**
  * gives the size of a jlog_file
  * @return size of file on success, -1 on failure
@@ -137,6 +161,30 @@ off_t jlog_file_size(jlog_file *f);
  */
 int jlog_file_truncate(jlog_file *f, off_t len);
 
+/**
+ * advises the kernel that a range of a jlog_file will be read soon;
+ * a len of 0 means through the end of the file
+ * @return 1 on success or if unsupported, 0 on failure
+ * @internal
+ */
+int jlog_file_willneed(jlog_file *f, off_t offset, off_t len);
+
+/**
+ * advises the kernel that cached pages for a range of a jlog_file will
+ * not be read again and may be dropped
+ * @return 1 on success or if unsupported, 0 on failure
+ * @internal
+ */
+int jlog_file_dontneed(jlog_file *f, off_t offset, off_t len);
+
+/**
+ * allocates disk blocks for the first len bytes of a jlog_file without
+ * changing its size, so later appends need not allocate
+ * @return 1 on success or if unsupported, 0 on failure
+ * @internal
+ */
+int jlog_file_reserve(jlog_file *f, off_t len);
+
 #ifdef __cplusplus
 }  /* Close scope of 'extern "C"' declaration which encloses file. */
 #endif
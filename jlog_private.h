@@ -62,8 +62,237 @@ struct _jlog_meta_info {
   u_int32_t unit_limit;
   u_int32_t safety;
   u_int32_t hdr_magic;
+  /* the rest exists only once meta_ext is JLOG_META_EXT, which is set when
+   * the jlog is made with, or later given, a feature that needs it.  Until
+   * then the metastore stays the JLOG_META_BASE_SIZE bytes older versions
+   * insist on, and these read as 0 from the zero-filled end of its page */
+  u_int32_t meta_ext;
+  /* bumped by writers each time records are materialized; readers
+   * blocked in jlog_ctx_wait sleep on this word (futex where available) */
+  u_int32_t write_seq;
+  u_int32_t waiters;
+  u_int32_t format_flags;  /* JLOG_FORMAT_* chosen at jlog_ctx_init */
+  /* consumed segments waiting for reuse are spare.<seq> for seq in
+   * [spare_head, spare_tail); at most spare_limit of them */
+  u_int32_t spare_limit;
+  u_int32_t spare_head;
+  u_int32_t spare_tail;
+  /* no live segment is older than this; it only ever lags behind, so
+   * jlogs from before it was kept simply start at 0 */
+  u_int32_t first_log;
+  /* high word of the segment size limit; unit_limit is the low word */
+  u_int32_t unit_limit_hi;
+  /* every message is exactly this long (0: messages vary in length) */
+  u_int32_t record_size;
+  /* the .idx holds the offset of every index_interval'th record only
+   * (0 or 1: of every record) */
+  u_int32_t index_interval;
+  /* keyed writes repeating one of the last dedup_window keys are
+   * dropped (0: no dedup file is kept) */
+  u_int32_t dedup_window;
+  /* retention regardless of subscribers: segments whose records are all
+   * older than retain_age seconds, or that the newest retain_bytes of
+   * segments leave out, are removed (0: no limit) */
+  u_int32_t retain_age;
+  u_int32_t retain_bytes;
+  u_int32_t retain_bytes_hi;
+  /* bit t is set before the first <seg>.t<hh> index for tag t is made,
+   * so removing a segment only looks for the tags ever used */
+  u_int32_t tags_used[8];
 };
 
+#define JLOG_META_BASE_SIZE 16
+#define JLOG_META_EXT 0x6a6c6d31  /* "jlm1" */
+#define JLOG_META_EXTENDED(meta) ((meta)->meta_ext == JLOG_META_EXT)
+#define JLOG_META_SIZE(meta) \
+  (JLOG_META_EXTENDED(meta) ? sizeof(struct _jlog_meta_info) : JLOG_META_BASE_SIZE)
+
+#define JLOG_UNIT_LIMIT(meta) \
+  (((u_int64_t)(meta)->unit_limit_hi << 32) | (meta)->unit_limit)
+#define JLOG_RETAIN_BYTES(meta) \
+  (((u_int64_t)(meta)->retain_bytes_hi << 32) | (meta)->retain_bytes)
+#define JLOG_TAG_USED(meta, t) \
+  ((meta)->tags_used[(t) >> 5] & (1U << ((t) & 31)))
+
+/* subscribers' checkpoints live in one mmap'd "checkpoints" table
+ * rather than a cp.<hex> file apiece */
+#define JLOG_FORMAT_CHECKPOINT_TABLE 0x01
+/* records carry a compact (v3) header rather than a jlog_message_header */
+#define JLOG_FORMAT_COMPACT_HEADERS 0x02
+/* tv_usec (and a v3 header's time) counts nanoseconds, not microseconds */
+#define JLOG_FORMAT_NSEC_TIME 0x04
+
+/* a sparse index is closed by this word followed by the record count,
+ * since the count no longer follows from the index length.  The high half
+ * of the count's word holds the index interval, for repair to find (0 in
+ * indexes closed before it did) */
+#define JLOG_SPARSE_CLOSE (~(u_int64_t)0)
+#define JLOG_SPARSE_TAIL(count, interval) \
+  (((u_int64_t)(interval) << 32) | (u_int32_t)(count))
+#define JLOG_SPARSE_COUNT(w) ((u_int32_t)(w))
+#define JLOG_SPARSE_INTERVAL(w) ((u_int32_t)((w) >> 32))
+
+/* a v3 header is a tag byte followed by varints: the time in tv_usec
+ * units since the epoch, mlen and, in compressed jlogs, compressed_len.  The time
+ * is absolute when the tag has JLOG_V3_ABSTIME (a segment's first record
+ * always does) and otherwise a zigzag delta from the segment's first
+ * record, which thereby serves as the segment's base timestamp.  With
+ * JLOG_V3_TAGGED the tag byte is followed by the record's topic tag.
+ * A check byte over all of the above ends it, so that a reader or repair
+ * resyncing on arbitrary bytes rarely takes them for a header */
+#define JLOG_V3_TAG 0xA0
+#define JLOG_V3_TAG_MASK 0xF0
+#define JLOG_V3_ABSTIME 0x01
+#define JLOG_V3_TAGGED 0x02
+#define JLOG_V3_FLAGS (JLOG_V3_ABSTIME|JLOG_V3_TAGGED) /* every flag we understand */
+#define JLOG_V3_MAX_HDR (1 + 1 + 10 + 5 + 5 + 1)
+
+/* the markers of a segment's records carrying topic tag tt, ascending
+ * u_int32_ts, live in <segment>.t<tt> beside its .idx */
+#define TAGIDX_EXT ".t"
+/* a subscriber's tag filter, a bitmap of the tags it wants, lives in a
+ * file named like its checkpoint with this in place of "cp" */
+#define TAGFILTER_PREFIX "tf"
+/* consumer group members hold a byte lock, at their lease token, in a
+ * file named like the subscriber's checkpoint with this for "cp" */
+#define LEASELOCK_PREFIX "lk"
+
+#define CPTABLE_FILE "checkpoints"
+#define DEDUP_FILE "dedup"
+#define SPARE_PREFIX "spare."
+/* missing segment names probed from first_log before giving up on it
+ * and reading the directory */
+#define FIRST_LOG_PROBES 16
+#define CPTABLE_MAGIC 0x4A435054
+#define CPTABLE_SLOTS 1024
+#define CPTABLE_NAME_MAX 80
+
+typedef struct {
+  u_int32_t magic;
+  u_int32_t nslots;
+  u_int32_t reserved[14];
+} jlog_cptable_header;
+
+/* the dedup file: this header, the hashes of the last nkeys keys written
+ * as a ring (u_int64_t[nkeys], next to be replaced at head), then a
+ * counting bloom filter of them (u_int8_t[nbloom]) that spares most
+ * writes any further look, then an open-addressed, linearly probed table
+ * (u_int32_t[nindex]) of ring slot + 1, 0 for empty, that finds a key's
+ * slot in the ring.  A file without the table (nindex 0) is searched
+ * through the ring */
+#define DEDUP_MAGIC 0x4A444450
+#define DEDUP_MAX_KEYS (1 << 24)
+#define DEDUP_BLOOM_PER_KEY 16   /* counters per key; about 0.25% false hits */
+#define DEDUP_HASHES 4
+#define DEDUP_INDEX_PER_KEY 2    /* table entries per key, at least */
+
+typedef struct {
+  u_int32_t magic;
+  u_int32_t nkeys;
+  u_int32_t nbloom;     /* a power of two */
+  u_int32_t head;
+  u_int32_t count;      /* keys in the ring, until it fills */
+  u_int32_t nindex;     /* a power of two over nkeys, or 0 */
+  u_int32_t reserved[10];
+} jlog_dedup_header;
+
+typedef enum {
+  JLOG_CPSLOT_FREE = 0,
+  JLOG_CPSLOT_NEW,      /* subscriber added, no checkpoint written yet */
+  JLOG_CPSLOT_SET
+} jlog_cpslot_state;
+
+typedef struct {
+  u_int32_t seq;        /* seqlock: odd while id is being rewritten */
+  u_int32_t state;
+  jlog_id   id;
+  char      name[CPTABLE_NAME_MAX];
+  u_int8_t  reserved[32];
+} jlog_cptable_slot;
+
+/* a segment whose index carries the 0 close marker never changes again,
+ * so readers keep it mapped read-only and skip the lock/fstat dance.
+ * The last few such segments stay mapped, so probing back and forth
+ * across a segment boundary does not remap them. */
+#define JLOG_CLOSED_CACHE 4
+
+typedef struct {
+  u_int32_t log;
+  u_int32_t last_marker;
+  u_int32_t used;       /* ctx->closed_tick when last looked up */
+  u_int32_t spare_gen;  /* meta->spare_tail when last known to be live */
+  u_int64_t *idx_base;
+  size_t    idx_len;
+  void      *data_base;
+  size_t    data_len;
+} jlog_closed_segment;
+
+/* one segment of a consumer group's work, kept in lg.<hex name> */
+typedef enum {
+  JLOG_LEASE_FREE = 0,
+  JLOG_LEASE_CLAIMED,
+  JLOG_LEASE_DONE
+} jlog_lease_state;
+
+typedef struct {
+  u_int32_t log;
+  u_int32_t marker;  /* last message in log the owner checkpointed */
+  u_int32_t pid;     /* owner while claimed */
+  u_int32_t token;   /* and which of its contexts */
+  u_int32_t state;
+} jlog_lease;
+
+typedef struct {
+  u_int32_t marker;
+  u_int8_t  tag;
+} jlog_tag_mark;
+
+/* decompression prefetch: a helper thread with its own reader context
+ * decompresses the messages after the one last read into a ring of
+ * buffers, which the reader then hands out in place of mess_data */
+typedef enum {
+  JLOG_PREFETCH_EMPTY = 0,
+  JLOG_PREFETCH_BUSY,     /* the helper is filling it */
+  JLOG_PREFETCH_READY,
+  JLOG_PREFETCH_HELD      /* handed to the reader until its next read */
+} jlog_prefetch_state;
+
+typedef struct {
+  jlog_id   id;
+  jlog_prefetch_state state;
+  jlog_message_header_compressed header;
+  char     *buf;
+  size_t    buf_size;
+} jlog_prefetch_slot;
+
+typedef struct {
+  jlog_ctx *hctx;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cv;
+  int       depth;
+  int       stop;
+  int       exhausted;  /* the helper ran out of readable messages */
+  u_int32_t gen;        /* bumped whenever the reader jumps elsewhere */
+  jlog_id   next;
+  jlog_prefetch_slot *slots;
+  char     *held;       /* the HELD slot's buf, for jlog_message_decompress */
+} jlog_prefetch;
+
+/* asynchronous reclamation: segments a checkpoint moved past are queued
+ * here and unlinked by a helper thread, at most per_second a second */
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cv;
+  int       stop;
+  u_int32_t per_second;  /* 0 for no limit */
+  u_int32_t *queue;
+  int       head;
+  int       count;
+  int       size;
+} jlog_reclaim;
+
 struct _jlog_ctx {
   struct _jlog_meta_info *meta;
   pthread_mutex_t write_lock;
@@ -87,9 +316,70 @@ struct _jlog_ctx {
   jlog_file *checkpoint;
   jlog_file *metastore;
   jlog_file *pre_commit;
+  jlog_file *lease;
+  int       lease_fd;     /* lk.<hex name>, holding our token's lock */
+  u_int32_t lease_token;  /* tells our leases from other contexts' */
+  jlog_file *cptable_file;
+  void      *cptable;
+  size_t    cptable_len;
+  jlog_file *dedup_file;
+  jlog_dedup_header *dedup;   /* mapped, once a keyed write needs it */
+  size_t    dedup_len;
+  /* a writer rolled over with a retention policy set; whoever next
+   * drops write_lock (and wins retain_busy) enforces it */
+  volatile int retain_due;
+  int       retain_busy;
+  int       cpslot;      /* our subscriber's slot, if we have looked */
   void     *mmap_base;
   size_t    mmap_len;
+  jlog_closed_segment closed[JLOG_CLOSED_CACHE];
+  u_int32_t closed_tick;
+  u_int32_t closed_pruned; /* checkpoint log closed[] was last pruned at */
+  /* base timestamp of segment seg_base_log, for v3 delta times */
+  int       seg_base_valid;
+  u_int32_t seg_base_log;
+  u_int64_t seg_base;
+  /* the pre-commit buffer holds v3 records with absolute times; they
+   * are rewritten here against the segment they are flushed to */
+  u_int8_t  *v3_scratch;
+  size_t    v3_scratch_len;
+  /* tagged records resync has indexed but not yet added to their
+   * segment's tag indexes */
+  jlog_tag_mark *tag_pend;
+  size_t    tag_pend_len;
+  size_t    tag_pend_alloc;
+  /* a reader's tag filter, and the matching records of segment
+   * tag_marks_log it has loaded, good through marker tag_marks_upto */
+  int       tag_filtered;
+  u_int8_t  tag_filter[32];
+  jlog_tag_mark *tag_marks;
+  size_t    tag_marks_len;
+  size_t    tag_marks_alloc;
+  int       tag_marks_valid;
+  u_int32_t tag_marks_log;
+  u_int32_t tag_marks_upto;
+  jlog_clock clock;
+  u_int64_t batch_time;  /* JLOG_CLOCK_BATCH's reading, 0 once flushed */
+  u_int32_t batch_uses;  /* messages stamped with it so far */
+  u_int64_t batch_mono;  /* coarse monotonic time it was taken */
+  u_int32_t readahead_log;
+  u_int32_t dontneed_log;
+  u_int64_t dontneed_off;
   char     *subscriber_name;
+  u_int32_t read_flags;
+  /* deferred checkpoints: read_checkpoint only records cp_pending_id
+   * until cp_defer_count calls or cp_defer_ms have passed */
+  u_int32_t cp_defer_ms;
+  u_int32_t cp_defer_count;
+  u_int32_t cp_pending_count;
+  int       cp_pending;
+  jlog_id   cp_pending_id;
+  struct timeval cp_written;
+  u_int32_t last_write_seq;
+  /* where the newest segment ended, for waits on jlogs without write_seq */
+  int       wait_polls;
+  u_int64_t last_write_mark;
+  int       wait_fd;
   int       last_error;
   int       last_errno;
   jlog_error_func error_func;
@@ -105,6 +395,8 @@ struct _jlog_ctx {
    */
   size_t    mess_data_size;
   char      *mess_data;
+  jlog_prefetch *prefetch;
+  jlog_reclaim *reclaim;
 };
 
 /* macros */
@@ -59,7 +59,10 @@ foreach (@$files) {
 }
 undef $files;
 
-if ((stat "$jlog/metastore")[7] != 16) {
+# 16 bytes, or the longer layout that jlogs using newer features carry,
+# marked by "jlm1" (JLOG_META_EXT) right after the first 16 bytes
+my $meta_size = (stat "$jlog/metastore")[7];
+if ($meta_size != 16 && $meta_size < 20) {
   die "metastore has invalid size\n";
 }
 my ($current_segment, $unit_limit, $safety, $hdr_magic);
@@ -74,6 +77,10 @@ sysread(META, $data, 4) == 4 or die "metastore read error: $!";
 $safety = unpack_32($data);
 sysread(META, $data, 4) == 4 or die "metastore read error: $!";
 $hdr_magic = unpack_32($data);
+if ($meta_size != 16) {
+  sysread(META, $data, 4) == 4 or die "metastore read error: $!";
+  unpack_32($data) == 0x6a6c6d31 or die "metastore has invalid size\n";
+}
 close META;
 
 my $oldest_cp_segment = 0xffffffff;
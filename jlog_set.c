@@ -0,0 +1,463 @@
+/*
+ * Copyright (c) 2005-2008, Message Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Message Systems, Inc. nor the names
+ *      of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written
+ *      permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+
+#include "jlog_config.h"
+#include "jlog_private.h"
+#include "jlog_hash.h"
+#include "jlog_set.h"
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#if HAVE_TIME_H
+#include <time.h>
+#endif
+
+#define MEMBERS_FILE "members"
+
+typedef enum {
+  JLOG_SET_NEW,
+  JLOG_SET_WRITE,
+  JLOG_SET_READ
+} jlog_set_mode;
+
+typedef struct {
+  char *path;
+  jlog_ctx *ctx;
+  /* the rest of this member's interval: next up to finish */
+  jlog_id next;
+  jlog_id finish;
+  int left;
+  /* the message at next, when an ordered read has looked at it */
+  int have_head;
+  jlog_message head;
+  /* the last message handed out, where a checkpoint goes */
+  int have_taken;
+  jlog_id taken;
+} jlog_set_member_state;
+
+struct _jlog_set {
+  char *path;
+  jlog_set_member_state *members;
+  int nmembers;
+  jlog_set_mode mode;
+  int ordered;
+  u_int32_t turn;   /* whose turn it is, for writes and unordered reads */
+  int last;         /* member of the message handed out last, or -1 */
+  jlog_err last_error;
+  int last_errno;
+};
+
+#define SET_FAIL(set, err) do { \
+  (set)->last_error = (err); \
+  (set)->last_errno = errno; \
+  return -1; \
+} while(0)
+
+/* the member's failure is the set's */
+static int __jlog_set_member_fail(jlog_set *set, jlog_ctx *ctx) {
+  set->last_error = jlog_ctx_err(ctx);
+  set->last_errno = jlog_ctx_errno(ctx);
+  return -1;
+}
+
+static void __jlog_set_close_members(jlog_set *set) {
+  int i;
+  for(i = 0; i < set->nmembers; i++) {
+    if(set->members[i].ctx) jlog_ctx_close(set->members[i].ctx);
+    free(set->members[i].path);
+  }
+  free(set->members);
+  set->members = NULL;
+  set->nmembers = 0;
+}
+
+static int __jlog_set_manifest(jlog_set *set, char *file, size_t len) {
+  if(snprintf(file, len, "%s%c" MEMBERS_FILE, set->path, IFS_CH) >= len) {
+    errno = ENAMETOOLONG;
+    SET_FAIL(set, JLOG_ERR_CREATE_PATHLEN);
+  }
+  return 0;
+}
+
+/* read the member paths, one per line, from the members file */
+static int __jlog_set_load(jlog_set *set) {
+  char file[MAXPATHLEN], line[MAXPATHLEN];
+  jlog_set_member_state *members;
+  size_t len;
+  FILE *fp;
+
+  if(set->members) return 0;
+  if(__jlog_set_manifest(set, file, sizeof(file)) != 0) return -1;
+  if((fp = fopen(file, "r")) == NULL) SET_FAIL(set, JLOG_ERR_META_OPEN);
+  while(fgets(line, sizeof(line), fp)) {
+    len = strlen(line);
+    if(len && line[len - 1] == '\n') line[--len] = '\0';
+    if(!len) continue;
+    members = realloc(set->members, (set->nmembers + 1) * sizeof(*members));
+    if(!members) goto nomem;
+    set->members = members;
+    memset(&members[set->nmembers], 0, sizeof(*members));
+    if((members[set->nmembers].path = strdup(line)) == NULL) goto nomem;
+    set->nmembers++;
+  }
+  fclose(fp);
+  if(set->nmembers == 0) {
+    errno = EINVAL;
+    SET_FAIL(set, JLOG_ERR_META_OPEN);
+  }
+  return 0;
+
+ nomem:
+  fclose(fp);
+  __jlog_set_close_members(set);
+  errno = ENOMEM;
+  SET_FAIL(set, JLOG_ERR_META_OPEN);
+}
+
+jlog_set *jlog_set_new(const char *path) {
+  jlog_set *set = calloc(1, sizeof(*set));
+  set->path = strdup(path);
+  set->mode = JLOG_SET_NEW;
+  set->last = -1;
+  return set;
+}
+
+int jlog_set_init(jlog_set *set, const char * const *members, int nmembers) {
+  char file[MAXPATHLEN], tmp[MAXPATHLEN + sizeof(".tmp")];
+  jlog_ctx *ctx;
+  FILE *fp;
+  int i;
+
+  set->last_error = JLOG_ERR_SUCCESS;
+  if(set->mode != JLOG_SET_NEW || nmembers < 1) {
+    errno = EINVAL;
+    SET_FAIL(set, JLOG_ERR_ILLEGAL_INIT);
+  }
+  for(i = 0; i < nmembers; i++) {
+    ctx = jlog_new(members[i]);
+    if(jlog_ctx_init(ctx) != 0 &&
+       jlog_ctx_err(ctx) != JLOG_ERR_CREATE_EXISTS) {
+      __jlog_set_member_fail(set, ctx);
+      jlog_ctx_close(ctx);
+      return -1;
+    }
+    jlog_ctx_close(ctx);
+  }
+
+  if(mkdir(set->path, 0755) == -1 && errno != EEXIST)
+    SET_FAIL(set, JLOG_ERR_CREATE_MKDIR);
+  if(__jlog_set_manifest(set, file, sizeof(file)) != 0) return -1;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+  if((fp = fopen(tmp, "w")) == NULL) SET_FAIL(set, JLOG_ERR_CREATE_META);
+  for(i = 0; i < nmembers; i++) fprintf(fp, "%s\n", members[i]);
+  if(fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+    fclose(fp);
+    unlink(tmp);
+    SET_FAIL(set, JLOG_ERR_CREATE_META);
+  }
+  fclose(fp);
+  /* the set only exists once all of its members do */
+  if(rename(tmp, file) != 0) {
+    unlink(tmp);
+    SET_FAIL(set, JLOG_ERR_CREATE_META);
+  }
+  return 0;
+}
+
+int jlog_set_add_subscriber(jlog_set *set, const char *s,
+                            jlog_position whence) {
+  jlog_ctx *ctx;
+  int i, added = 0;
+
+  set->last_error = JLOG_ERR_SUCCESS;
+  if(__jlog_set_load(set) != 0) return -1;
+  /* carry on past members that have it already, as a half-done earlier
+   * attempt would have left it */
+  for(i = 0; i < set->nmembers; i++) {
+    ctx = jlog_new(set->members[i].path);
+    if(jlog_ctx_add_subscriber(ctx, s, whence) == 0) added++;
+    else if(jlog_ctx_err(ctx) != JLOG_ERR_SUBSCRIBER_EXISTS) {
+      __jlog_set_member_fail(set, ctx);
+      jlog_ctx_close(ctx);
+      return -1;
+    }
+    jlog_ctx_close(ctx);
+  }
+  if(!added) {
+    errno = EEXIST;
+    SET_FAIL(set, JLOG_ERR_SUBSCRIBER_EXISTS);
+  }
+  return 0;
+}
+
+int jlog_set_remove_subscriber(jlog_set *set, const char *s) {
+  jlog_ctx *ctx;
+  int i, rv, removed = 0;
+
+  set->last_error = JLOG_ERR_SUCCESS;
+  if(__jlog_set_load(set) != 0) return -1;
+  for(i = 0; i < set->nmembers; i++) {
+    ctx = jlog_new(set->members[i].path);
+    rv = jlog_ctx_remove_subscriber(ctx, s);
+    if(rv < 0) {
+      __jlog_set_member_fail(set, ctx);
+      jlog_ctx_close(ctx);
+      return -1;
+    }
+    removed += rv;
+    jlog_ctx_close(ctx);
+  }
+  if(!removed) set->last_error = JLOG_ERR_INVALID_SUBSCRIBER;
+  return removed ? 1 : 0;
+}
+
+int jlog_set_open_writer(jlog_set *set) {
+  jlog_set_member_state *m;
+  int i;
+
+  set->last_error = JLOG_ERR_SUCCESS;
+  if(set->mode != JLOG_SET_NEW) {
+    errno = EINVAL;
+    SET_FAIL(set, JLOG_ERR_ILLEGAL_OPEN);
+  }
+  if(__jlog_set_load(set) != 0) return -1;
+  for(i = 0; i < set->nmembers; i++) {
+    m = &set->members[i];
+    m->ctx = jlog_new(m->path);
+    if(jlog_ctx_open_writer(m->ctx) != 0)
+      return __jlog_set_member_fail(set, m->ctx);
+  }
+  set->mode = JLOG_SET_WRITE;
+  return 0;
+}
+
+int jlog_set_open_reader(jlog_set *set, const char *subscriber) {
+  jlog_set_member_state *m;
+  int i;
+
+  set->last_error = JLOG_ERR_SUCCESS;
+  if(set->mode != JLOG_SET_NEW) {
+    errno = EINVAL;
+    SET_FAIL(set, JLOG_ERR_ILLEGAL_OPEN);
+  }
+  if(__jlog_set_load(set) != 0) return -1;
+  for(i = 0; i < set->nmembers; i++) {
+    m = &set->members[i];
+    m->ctx = jlog_new(m->path);
+    if(jlog_ctx_open_reader(m->ctx, subscriber) != 0)
+      return __jlog_set_member_fail(set, m->ctx);
+  }
+  set->mode = JLOG_SET_READ;
+  return 0;
+}
+
+int jlog_set_close(jlog_set *set) {
+  __jlog_set_close_members(set);
+  free(set->path);
+  free(set);
+  return 0;
+}
+
+int jlog_set_members(jlog_set *set) {
+  if(__jlog_set_load(set) != 0) return -1;
+  return set->nmembers;
+}
+
+jlog_ctx *jlog_set_member(jlog_set *set, int member) {
+  if(member < 0 || member >= set->nmembers) return NULL;
+  return set->members[member].ctx;
+}
+
+static int __jlog_set_write_to(jlog_set *set, int member,
+                               const void *message, size_t mess_len) {
+  jlog_ctx *ctx = set->members[member].ctx;
+
+  if(jlog_ctx_write(ctx, message, mess_len) != 0)
+    return __jlog_set_member_fail(set, ctx);
+  return 0;
+}
+
+int jlog_set_write(jlog_set *set, const void *message, size_t mess_len) {
+  set->last_error = JLOG_ERR_SUCCESS;
+  if(set->mode != JLOG_SET_WRITE) {
+    errno = EPERM;
+    SET_FAIL(set, JLOG_ERR_ILLEGAL_WRITE);
+  }
+  return __jlog_set_write_to(set, set->turn++ % set->nmembers,
+                             message, mess_len);
+}
+
+int jlog_set_write_keyed(jlog_set *set, const void *key, size_t key_len,
+                         const void *message, size_t mess_len) {
+  set->last_error = JLOG_ERR_SUCCESS;
+  if(set->mode != JLOG_SET_WRITE) {
+    errno = EPERM;
+    SET_FAIL(set, JLOG_ERR_ILLEGAL_WRITE);
+  }
+  return __jlog_set_write_to(set,
+                             jlog_hash__hash(key, key_len, 0) % set->nmembers,
+                             message, mess_len);
+}
+
+int jlog_set_set_ordered(jlog_set *set, int ordered) {
+  set->ordered = ordered;
+  return 0;
+}
+
+int jlog_set_read_interval(jlog_set *set) {
+  jlog_set_member_state *m;
+  jlog_id start, finish;
+  int i, n, total = 0;
+
+  set->last_error = JLOG_ERR_SUCCESS;
+  if(set->mode != JLOG_SET_READ) {
+    errno = EPERM;
+    SET_FAIL(set, JLOG_ERR_ILLEGAL_CHECKPOINT);
+  }
+  set->last = -1;
+  for(i = 0; i < set->nmembers; i++) {
+    m = &set->members[i];
+    if((n = jlog_ctx_read_interval(m->ctx, &start, &finish)) < 0)
+      return __jlog_set_member_fail(set, m->ctx);
+    m->next = start;
+    m->finish = finish;
+    m->left = n;
+    m->have_head = 0;
+    total += n;
+  }
+  return total;
+}
+
+/* the member whose message comes out next, or -1 if none has any */
+static int __jlog_set_pick(jlog_set *set) {
+  jlog_set_member_state *m;
+  struct timespec ts, best_ts;
+  int i, k, best = -1;
+
+  if(!set->ordered) {
+    for(k = 0; k < set->nmembers; k++) {
+      i = (set->turn + k) % set->nmembers;
+      if(set->members[i].left > 0) {
+        set->turn = i + 1;
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  for(i = 0; i < set->nmembers; i++) {
+    m = &set->members[i];
+    if(m->left <= 0) continue;
+    if(!m->have_head) {
+      if(jlog_ctx_read_message(m->ctx, &m->next, &m->head) != 0)
+        return -2 - i;
+      m->have_head = 1;
+    }
+    jlog_message_timespec(m->ctx, &m->head, &ts);
+    if(best < 0 || ts.tv_sec < best_ts.tv_sec ||
+       (ts.tv_sec == best_ts.tv_sec && ts.tv_nsec < best_ts.tv_nsec)) {
+      best = i;
+      best_ts = ts;
+    }
+  }
+  return best;
+}
+
+int jlog_set_read_message(jlog_set *set, jlog_set_message *out) {
+  jlog_set_member_state *m;
+  int i;
+
+  set->last_error = JLOG_ERR_SUCCESS;
+  if(set->mode != JLOG_SET_READ) {
+    errno = EPERM;
+    SET_FAIL(set, JLOG_ERR_ILLEGAL_WRITE);
+  }
+  /* the last message handed out is done with now */
+  if(set->last >= 0) {
+    m = &set->members[set->last];
+    JLOG_ID_ADVANCE(&m->next);
+    m->left--;
+    m->have_head = 0;
+    set->last = -1;
+  }
+
+  if((i = __jlog_set_pick(set)) == -1) return 0;
+  if(i < -1) return __jlog_set_member_fail(set, set->members[-2 - i].ctx);
+  m = &set->members[i];
+  if(m->have_head) out->message = m->head;
+  else if(jlog_ctx_read_message(m->ctx, &m->next, &out->message) != 0)
+    return __jlog_set_member_fail(set, m->ctx);
+  /* a copied jlog_message still points at the member's header */
+  out->message.header = &out->message.aligned_header;
+  out->member = i;
+  out->id = m->next;
+  m->taken = m->next;
+  m->have_taken = 1;
+  set->last = i;
+  return 1;
+}
+
+int jlog_set_read_checkpoint(jlog_set *set) {
+  jlog_set_member_state *m;
+  int i;
+
+  set->last_error = JLOG_ERR_SUCCESS;
+  if(set->mode != JLOG_SET_READ) {
+    errno = EPERM;
+    SET_FAIL(set, JLOG_ERR_ILLEGAL_CHECKPOINT);
+  }
+  for(i = 0; i < set->nmembers; i++) {
+    m = &set->members[i];
+    if(!m->have_taken) continue;
+    if(jlog_ctx_read_checkpoint(m->ctx, &m->taken) != 0)
+      return __jlog_set_member_fail(set, m->ctx);
+    m->have_taken = 0;
+  }
+  return 0;
+}
+
+jlog_err jlog_set_err(jlog_set *set) {
+  return set->last_error;
+}
+
+const char *jlog_set_err_string(jlog_set *set) {
+  return jlog_err_string(set->last_error);
+}
+
+int jlog_set_errno(jlog_set *set) {
+  return set->last_errno;
+}
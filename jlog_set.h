@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2005-2008, Message Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Message Systems, Inc. nor the names
+ *      of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written
+ *      permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _JLOG_SET_H
+#define _JLOG_SET_H
+
+#include "jlog.h"
+
+/*
+ * A jlog set spreads one logical queue over several member jlogs, say
+ * one per disk, so that neither a single filesystem nor a single writer
+ * lock bounds its throughput.  The set's own directory holds only a
+ * "members" file naming the member jlogs; each member is an ordinary
+ * jlog that jlogctl and friends can inspect on its own.
+ *
+ * Subscribers of a set are subscribers of every member under the same
+ * name.  Their checkpoint is the composite of the members' checkpoints,
+ * each of which marks the last message taken from that member.
+ *
+ * Like a jlog_ctx, a jlog_set is for one thread at a time.
+ */
+
+typedef struct _jlog_set jlog_set;
+
+typedef struct {
+  int member;           /* the member it was read from */
+  jlog_id id;           /* and its id there */
+  jlog_message message;
+} jlog_set_message;
+
+JLOG_API(jlog_set *) jlog_set_new(const char *path);
+
+/**
+ * Create the set and its `nmembers` member jlogs at the paths given.
+ * A member that already exists is adopted as it is, so a member wanting
+ * other than the default settings can be created beforehand with
+ * jlog_new, jlog_ctx_set_* and jlog_ctx_init.
+ *
+ * \return 0 on success, -1 with jlog_set_err set otherwise
+ */
+JLOG_API(int)       jlog_set_init(jlog_set *set, const char * const *members,
+                                  int nmembers);
+JLOG_API(int)       jlog_set_add_subscriber(jlog_set *set, const char *s,
+                                            jlog_position whence);
+JLOG_API(int)       jlog_set_remove_subscriber(jlog_set *set, const char *s);
+
+JLOG_API(int)       jlog_set_open_writer(jlog_set *set);
+JLOG_API(int)       jlog_set_open_reader(jlog_set *set, const char *subscriber);
+JLOG_API(int)       jlog_set_close(jlog_set *set);
+
+JLOG_API(int)       jlog_set_members(jlog_set *set);
+/**
+ * The member's own context, once the set is opened, for settings that
+ * jlog_set doesn't pass through (the pre-commit buffer, say) and for
+ * details of an error the set reports.
+ */
+JLOG_API(jlog_ctx *) jlog_set_member(jlog_set *set, int member);
+
+/**
+ * Write to each member in turn.
+ */
+JLOG_API(int)       jlog_set_write(jlog_set *set, const void *message,
+                                   size_t mess_len);
+/**
+ * Write to the member chosen by a hash of `key`, so that all messages
+ * with one key stay in one member and are read in the order written.
+ */
+JLOG_API(int)       jlog_set_write_keyed(jlog_set *set,
+                                         const void *key, size_t key_len,
+                                         const void *message, size_t mess_len);
+
+/**
+ * Hand out messages in timestamp order across the members rather than
+ * taking turns between them.  Order is by the members' clocks, and only
+ * among the messages of one jlog_set_read_interval.
+ */
+JLOG_API(int)       jlog_set_set_ordered(jlog_set *set, int ordered);
+
+/**
+ * Read each member's interval: the messages past its checkpoint.
+ *
+ * \return the number of messages now available, or -1 on error
+ */
+JLOG_API(int)       jlog_set_read_interval(jlog_set *set);
+/**
+ * Take the next message of the merged stream.  The message stays valid
+ * until the next read from the set.
+ *
+ * \return 1 with *m filled in, 0 once the interval is used up, -1 on error
+ */
+JLOG_API(int)       jlog_set_read_message(jlog_set *set, jlog_set_message *m);
+/**
+ * Checkpoint every member at the last message taken from it.
+ */
+JLOG_API(int)       jlog_set_read_checkpoint(jlog_set *set);
+
+JLOG_API(jlog_err)  jlog_set_err(jlog_set *set);
+JLOG_API(const char *) jlog_set_err_string(jlog_set *set);
+JLOG_API(int)       jlog_set_errno(jlog_set *set);
+
+#endif
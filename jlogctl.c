@@ -55,6 +55,9 @@ static int cleanup = 0;
 static int quiet = 0;
 static char *add_subscriber = NULL;
 static char *remove_subscriber = NULL;
+static long long retain_age = -1;
+static long long retain_bytes = -1;
+static int retain_every = -1;
 
 static void usage(const char *prog) {
   printf("Usage:\n    %s <options> logpath1 [logpath2 [...]]\n",
@@ -69,6 +72,10 @@ static void usage(const char *prog) {
   printf("\t      -d:\tAnalyze datafiles\n");
   printf("\t      -r:\tAnalyze datafiles and repair if needed\n");
   printf("\t      -v:\tVerbose output\n");
+  printf("\t-A <sec>:\tRetain records for at most <sec> seconds (0: forever)\n");
+  printf("\t-B <len>:\tRetain at most <len> bytes of segments (0: any)\n");
+  printf("\t-R <sec>:\tApply the retention policy, then again every <sec>\n"
+         "\t\t\tseconds until killed (0: just once)\n");
   printf("\nWARNING: the -r option can't be used on jlogs that are "
          "open by another process\n");
 }
@@ -103,6 +110,64 @@ static void analyze_datafile(jlog_ctx *ctx, u_int32_t logid) {
     }
   }
 }
+static void show_segment(jlog_ctx *log, const char *file, u_int32_t logid,
+                         const jlog_id *cps, int ncps, int skip_missing) {
+  char name[9];
+  char fullfile[MAXPATHLEN];
+  char fullidx[MAXPATHLEN];
+  struct stat st;
+  int i, readers;
+
+  STRLOGID(name, logid);
+  snprintf(fullfile, sizeof(fullfile), "%s/%s", file, name);
+  snprintf(fullidx, sizeof(fullidx), "%s/%s" INDEX_EXT, file, name);
+  if(stat(fullfile, &st)) {
+    if(skip_missing && errno == ENOENT) return;
+    if(!quiet) printf("\t%8s [error statting file: %s\n", name, strerror(errno));
+    return;
+  }
+  for(readers = 0, i = 0; i < ncps; i++)
+    if(cps[i].log <= logid) readers++;
+  if(!quiet) printf("\t%8s [%9llu bytes] %d pending readers\n",
+                    name, (unsigned long long)st.st_size, readers);
+  if(show_index_info && !quiet) {
+    struct stat sb;
+    /* fixed-size records keep no .idx; their count comes from the size */
+    if (!log->meta->record_size && stat(fullidx, &sb)) {
+      printf("\t\t idx: none\n");
+    } else {
+      u_int32_t marker;
+      int closed;
+      if (jlog_idx_details(log, logid, &marker, &closed)) {
+        printf("\t\t idx: error\n");
+      } else {
+        printf("\t\t idx: %u messages (%08x), %s\n",
+               marker, marker, closed?"closed":"open");
+      }
+    }
+  }
+  if (analyze_datafiles) analyze_datafile(log, logid);
+  if((readers == 0) && cleanup) {
+    unlink(fullfile);
+    unlink(fullidx);
+  }
+}
+static void enforce_retention(jlog_ctx *log, const char *file) {
+  int removed = jlog_ctx_enforce_retention(log);
+  if(removed < 0)
+    fprintf(stderr, "retention on '%s' failed: %s\n", file,
+            jlog_ctx_err_string(log));
+  else if(removed > 0 && !quiet)
+    printf("%s: removed %d segments\n", file, removed);
+}
+static void retention_pass(const char *file) {
+  jlog_ctx *log = jlog_new(file);
+  if(jlog_ctx_open_writer(log))
+    fprintf(stderr, "error opening '%s': %s\n", file, jlog_ctx_err_string(log));
+  else
+    enforce_retention(log, file);
+  jlog_ctx_close(log);
+}
 static void process_jlog(const char *file, const char *sub) {
   jlog_ctx *log;
   log = jlog_new(file);
@@ -128,6 +193,18 @@ static void process_jlog(const char *file, const char *sub) {
       fprintf(stderr, "error opening '%s': %s\n", file, jlog_ctx_err_string(log));
       return;
     }
+    if(retain_age >= 0 || retain_bytes >= 0) {
+      if(jlog_ctx_set_retention(log,
+           retain_age >= 0 ? retain_age : log->meta->retain_age,
+           retain_bytes >= 0 ? retain_bytes : JLOG_RETAIN_BYTES(log->meta)))
+        fprintf(stderr, "Could not set retention on '%s': %s\n", file,
+                jlog_ctx_err_string(log));
+      else if(!quiet)
+        printf("Retaining %u seconds, %llu bytes (0: no limit)\n",
+               log->meta->retain_age,
+               (unsigned long long)JLOG_RETAIN_BYTES(log->meta));
+    }
+    if(retain_every >= 0) enforce_retention(log, file);
   } else {
     if(jlog_ctx_open_reader(log, sub)) {
       fprintf(stderr, "error opening '%s': %s\n", file, jlog_ctx_err_string(log));
@@ -170,52 +247,40 @@ static void process_jlog(const char *file, const char *sub) {
     jlog_ctx_list_subscribers_dispose(log, list);
   }
   if(show_files) {
-    DIR *dir;
-    struct dirent *de;
-    dir = opendir(file);
-    if(!dir) {
-      fprintf(stderr, "error opening '%s'\n", file);
-      return;
+    char **list;
+    jlog_id *cps = NULL, first;
+    int i, ncps = 0;
+    u_int32_t logid;
+
+    /* gather the checkpoints once rather than rescanning per segment */
+    if(jlog_ctx_list_subscribers(log, &list) >= 0) {
+      for(i=0; list[i]; i++);
+      cps = calloc(i + 1, sizeof(*cps));
+      for(i=0; cps && list[i]; i++)
+        if(jlog_get_checkpoint(log, list[i], &cps[ncps]) == 0) ncps++;
+      jlog_ctx_list_subscribers_dispose(log, list);
     }
-    while((de = readdir(dir)) != NULL) {
-      u_int32_t logid;
-      if(is_datafile(de->d_name, &logid)) {
-        char fullfile[MAXPATHLEN];
-        char fullidx[MAXPATHLEN];
-        struct stat st;
-        int readers;
-        snprintf(fullfile, sizeof(fullfile), "%s/%s", file, de->d_name);
-        snprintf(fullidx, sizeof(fullidx), "%s/%s" INDEX_EXT, file, de->d_name);
-        if(stat(fullfile, &st)) {
-          if(!quiet) printf("\t%8s [error statting file: %s\n", de->d_name, strerror(errno));
-        } else {
-          readers = __jlog_pending_readers(log, logid);
-          if(!quiet) printf("\t%8s [%9llu bytes] %d pending readers\n",
-                            de->d_name, (unsigned long long)st.st_size, readers);
-          if(show_index_info && !quiet) {
-            struct stat sb;
-            if (stat(fullidx, &sb)) {
-              printf("\t\t idx: none\n");
-            } else {
-              u_int32_t marker;
-              int closed;
-              if (jlog_idx_details(log, logid, &marker, &closed)) {
-                printf("\t\t idx: error\n");
-              } else {
-                printf("\t\t idx: %u messages (%08x), %s\n",
-                       marker, marker, closed?"closed":"open");
-              }
-            }
-          }
-          if (analyze_datafiles) analyze_datafile(log, logid);
-          if((readers == 0) && cleanup) {
-            unlink(fullfile);
-            unlink(fullidx);
-          }
-        }
+    if(cleanup) {
+      /* cleaning wants strays too, so look at everything there is */
+      DIR *dir;
+      struct dirent *de;
+      dir = opendir(file);
+      if(!dir) {
+        fprintf(stderr, "error opening '%s'\n", file);
+        free(cps);
+        return;
+      }
+      while((de = readdir(dir)) != NULL) {
+        if(is_datafile(de->d_name, &logid))
+          show_segment(log, file, logid, cps, ncps, 0);
       }
+      closedir(dir);
     }
-    closedir(dir);
+    else if(jlog_ctx_first_log_id(log, &first) == 0) {
+      for(logid = first.log; logid <= log->meta->storage_log; logid++)
+        show_segment(log, file, logid, cps, ncps, 1);
+    }
+    free(cps);
   }
   jlog_ctx_close(log);
 }
@@ -223,9 +288,18 @@ int main(int argc, char **argv) {
   int i, c;
   int option_index = 0;
   char *subscriber = NULL;
-  while((c = getopt_long(argc, argv, "a:e:dsilrcp:v",
+  while((c = getopt_long(argc, argv, "a:e:dsilrcp:vA:B:R:",
                          NULL, &option_index)) != EOF) {
     switch(c) {
+     case 'A':
+      retain_age = strtoll(optarg, NULL, 10);
+      break;
+     case 'B':
+      retain_bytes = strtoll(optarg, NULL, 10);
+      break;
+     case 'R':
+      retain_every = atoi(optarg);
+      break;
      case 'v':
       verbose = 1;
       break;
@@ -276,5 +350,11 @@ int main(int argc, char **argv) {
     if(!quiet) printf("%s\n", argv[i]);
     process_jlog(argv[i], subscriber);
   }
+  /* daemon mode: segments are only ever dropped whole, so a pass every
+   * so often keeps the disk bounded however fast the writers are */
+  while(retain_every > 0) {
+    sleep(retain_every);
+    for(i=optind; i<argc; i++) retention_pass(argv[i]);
+  }
   return 0;
 }
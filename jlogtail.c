@@ -4,8 +4,6 @@
 
 #include "jlog.h"
 
-#define SLEEP_10MS_IN_US 10000
-#define SLEEP_1S_IN_US 1000000
 jlog_ctx* ctx;
 const char *lf = "\n";
 char subscriber[32] = "jlog-tail";
@@ -13,8 +11,8 @@ char subscriber[32] = "jlog-tail";
 int main(int argc, char** argv) {
   const char* path;
   jlog_id begin, end;
-  int count, two_times_a_charm = 0;
-  int sleeptime = SLEEP_10MS_IN_US;
+  int count;
+  struct timeval one_second = { 1, 0 };
 
   if(argc != 2) {
     fprintf(stderr, "usage: %s /path/to/jlog\n", argv[0]);
@@ -38,8 +36,7 @@ int main(int argc, char** argv) {
     if (count > 0) {
       int i;
       jlog_message m;
-   
-      two_times_a_charm = 0; 
+
       for (i = 0; i < count; i++, JLOG_ID_ADVANCE(&begin)) {
         end = begin;
       
@@ -61,12 +58,9 @@ int main(int argc, char** argv) {
       // checkpoint (commit) our read:
       jlog_ctx_read_checkpoint(ctx, &end);
     }
-    if(two_times_a_charm > 1) {
-      sleeptime *= 2;
-      if(sleeptime > SLEEP_1S_IN_US) sleeptime = SLEEP_1S_IN_US;
-      usleep(sleeptime);
+    else {
+      /* the timeout keeps us honest against writers too old to wake us */
+      if(jlog_ctx_wait(ctx, &one_second) < 0) usleep(100000);
     }
-    else sleeptime = SLEEP_10MS_IN_US;
-    two_times_a_charm++;
   }
 }
@@ -32,8 +32,12 @@
 
 #include <stdio.h>
 #include <getopt.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include "jlog.h"
 #include "jlog_compress.h"
+#include "jlog_set.h"
 
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -55,6 +59,10 @@ extern int creat(const char *, int);
 #include <errno.h>
 #endif
 
+#if HAVE_DIRENT_H
+#include <dirent.h>
+#endif
+
 #ifndef MIN
 #define  MIN(x, y)               ((x) < (y) ? (x) : (y))
 #endif
@@ -112,14 +120,24 @@ static size_t default_pre_commit_size = 1024*128;
 void usage() {
   fprintf(stderr,
           "options:\n"
-          "\tinit [-p <path>] [-s <subscriber>] [-j <journalsize>]\n"
-          "\tinit_compressed [-p <path>] [-s <subscriber>] [-j <journalsize>]\n"
+          "\tinit [-p <path>] [-s <subscriber>] [-j <journalsize>] [-t] [-c]\n"
+          "\tinit_compressed [-p <path>] [-s <subscriber>] [-j <journalsize>] [-t] [-c]\n"
           "\tread [-p <path>] [-n <count>] [-s <subscriber>]\n"
           "\tbulk_read [-p <path>] [-n <count>] [-s <subscriber>]\n"
           "\twrite [-p <path>] [-l <len>] [-n <count>]\n"
           "\trepair [-p <path>]\n"
           "\ttwo_checkpoints [-p <path>] [-n <count>] [-s <subscriber>]\n"
-          "\tresize_pre_commit [-p <path>] [-l <new_size>]\n");
+          "\tresize_pre_commit [-p <path>] [-l <new_size>]\n"
+          "\tsegment_bench [-p <path>] [-l <len>] [-n <count>]\n"
+          "\trecycle [-p <path>]\n"
+          "\ttags [-p <path>] [-n <count>]\n"
+          "\tretention [-p <path>]\n"
+          "\twait [-p <path>]\n"
+          "\tgroup [-p <path>] [-n <count>]\n"
+          "\tcompact [-p <path>] [-n <count>]\n"
+          "\tfixed [-p <path>] [-n <count>]\n"
+          "\tsparse [-p <path>] [-n <count>]\n"
+          "\tset [-p <path>] [-n <count>]\n");
 }
 
 static void
@@ -133,9 +151,12 @@ print_rate(hrtime_t s, hrtime_t f, uint64_t cnt) {
 }
 
 
-void jcreate(const char *path, const char *subscriber, int compressed, int jsize) {
+void jcreate(const char *path, const char *subscriber, int compressed, size_t jsize,
+             int cptable, int compact) {
   ctx = jlog_new(path);
   jlog_ctx_set_use_compression(ctx, compressed);
+  jlog_ctx_set_checkpoint_table(ctx, cptable);
+  jlog_ctx_set_compact_headers(ctx, compact);
   jlog_ctx_alter_journal_size(ctx, jsize);
   if(jlog_ctx_init(ctx) != 0) {
     fprintf(stderr, "jlog_ctx_init failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
@@ -445,9 +466,1302 @@ void jopenr_two_checks(const char *sub, const char *check_sub, int expect, const
 }
 
 
+/*
+  Write and then read back the same messages with a range of segment
+  sizes, to show what rollover and per-segment reader work cost.  Each
+  jlog is created at <path>.<size> and removed afterwards.
+*/
+static void rmjlog(const char *path) {
+  char file[MAXPATHLEN];
+  struct dirent *de;
+  DIR *dir;
+
+  if(!(dir = opendir(path))) return;
+  while((de = readdir(dir)) != NULL) {
+    if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+    if(snprintf(file, sizeof(file), "%s%c%s", path, IFS_CH,
+                de->d_name) >= (int)sizeof(file)) continue;
+    (void)unlink(file);
+  }
+  closedir(dir);
+  (void)rmdir(path);
+}
+
+static const size_t bench_sizes[] = { 1024*1024, 4*1024*1024, 64*1024*1024,
+                                      512*1024*1024 };
+
+void jsegment_bench(const char *path, int len, int count) {
+  char bpath[MAXPATHLEN];
+  char *message;
+  jlog_id begin, end;
+  jlog_message m;
+  hrtime_t s, f;
+  int i, n, got;
+  size_t b;
+
+  message = malloc(len);
+  memset(message, 'X', len);
+  for(b=0; b<sizeof(bench_sizes)/sizeof(*bench_sizes); b++) {
+    snprintf(bpath, sizeof(bpath), "%s.%llu", path,
+             (unsigned long long)bench_sizes[b]);
+    jcreate(bpath, SUBSCRIBER, 0, bench_sizes[b], 0, 0);
+
+    ctx = jlog_new(bpath);
+    jlog_ctx_set_multi_process(ctx, 0);
+    if(jlog_ctx_open_writer(ctx) != 0) {
+      fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+    s = my_gethrtime();
+    for(i=0; i<count; i++) jlog_ctx_write(ctx, message, len);
+    f = my_gethrtime();
+    jlog_ctx_close(ctx);
+    printf("segment size %10llu: write ", (unsigned long long)bench_sizes[b]);
+    print_rate(s, f, count);
+
+    ctx = jlog_new(bpath);
+    jlog_ctx_set_multi_process(ctx, 0);
+    if(jlog_ctx_open_reader(ctx, SUBSCRIBER) != 0) {
+      fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+    got = 0;
+    s = my_gethrtime();
+    while(got < count && (n = jlog_ctx_read_interval(ctx, &begin, &end)) > 0) {
+      for(i=0; i<n; i++, JLOG_ID_ADVANCE(&begin))
+        if(jlog_ctx_read_message(ctx, &begin, &m) == 0) got++;
+      jlog_ctx_read_checkpoint(ctx, &end);
+    }
+    f = my_gethrtime();
+    printf("segment size %10llu: read  ", (unsigned long long)bench_sizes[b]);
+    print_rate(s, f, got);
+    jlog_ctx_close(ctx);
+    rmjlog(bpath);
+  }
+  free(message);
+}
+
+/*
+  Recycle segments that another reader still has mapped.  Reader "a"
+  reads the first two segments (mapping them once closed), reader "b"
+  consumes them into the spare pool, and the writer then rolls over onto
+  the spares.  Reading the old ids through "a" must now fail or give the
+  original message, never another segment's data or a SIGBUS.
+*/
+static void jwrite_numbered(const char *path, int from, int count) {
+  char buf[32];
+  int i;
+
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_writer(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  for(i=from; i<from+count; i++) {
+    snprintf(buf, sizeof(buf), "message %08d", i);
+    if(jlog_ctx_write(ctx, buf, strlen(buf)) != 0) {
+      fprintf(stderr, "jlog_ctx_write failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+  }
+  jlog_ctx_close(ctx);
+}
+
+static int jcheck_numbered(jlog_message *m, int n) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "message %08d", n);
+  return m->mess_len == strlen(buf) && !memcmp(m->mess, buf, m->mess_len);
+}
+
+void jrecycle(const char *path) {
+  jlog_ctx *a, *b;
+  jlog_id begin, end, id;
+  jlog_message m;
+  int i, n, seen = 0, per_segment = 0;
+
+  rmjlog(path);
+  ctx = jlog_new(path);
+  jlog_ctx_alter_journal_size(ctx, 4096);
+  jlog_ctx_alter_spare_segments(ctx, 2);
+  if(jlog_ctx_init(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_init failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  jlog_ctx_add_subscriber(ctx, "a", JLOG_BEGIN);
+  jlog_ctx_add_subscriber(ctx, "b", JLOG_BEGIN);
+  jlog_ctx_close(ctx);
+  /* 4096 / (16 header + 16 message) per segment: 0 and 1 full, 2 open */
+  jwrite_numbered(path, 0, 300);
+
+  a = jlog_new(path);
+  b = jlog_new(path);
+  if(jlog_ctx_open_reader(a, "a") != 0 || jlog_ctx_open_reader(b, "b") != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed\n");
+    exit(-1);
+  }
+  while(seen < 300 && (n = jlog_ctx_read_interval(a, &begin, &end)) > 0) {
+    if(begin.log == 0) per_segment = end.marker;
+    for(i=0; i<n; i++, JLOG_ID_ADVANCE(&begin), seen++) {
+      if(jlog_ctx_read_message(a, &begin, &m) != 0 || !jcheck_numbered(&m, seen)) {
+        fprintf(stderr, "recycle: bad first read at %d\n", seen);
+        exit(-1);
+      }
+    }
+    jlog_ctx_read_checkpoint(a, &end);
+  }
+  while((n = jlog_ctx_read_interval(b, &begin, &end)) > 0)
+    jlog_ctx_read_checkpoint(b, &end);
+  if(per_segment == 0) {
+    fprintf(stderr, "recycle: segment 0 never closed\n");
+    exit(-1);
+  }
+  /* b's checkpoint put 0 and 1 in the pool; now a spare is taken for
+   * each new segment */
+  jwrite_numbered(path, 300, 300);
+
+  for(id.log = 0; id.log < 2; id.log++) {
+    for(id.marker = 1; id.marker <= per_segment; id.marker++) {
+      if(jlog_ctx_read_message(a, &id, &m) == 0 &&
+         !jcheck_numbered(&m, id.log * per_segment + id.marker - 1)) {
+        fprintf(stderr, "recycle: read another segment's data at %08x:%08x\n",
+                id.log, id.marker);
+        exit(-1);
+      }
+    }
+  }
+  jlog_ctx_close(a);
+  jlog_ctx_close(b);
+  rmjlog(path);
+  printf("recycle: ok\n");
+}
+
+/*
+  Write records tagged i % 10 over several segments and read them back
+  through a subscriber filtered on tag 7, part way through the writes
+  and again at the end.  It must see exactly the records tagged 7, in
+  order, and the tag indexes must go with the segments they describe.
+*/
+static int jdrain_filtered(const char *path, const char *sub, int *next) {
+  jlog_ctx *r;
+  jlog_id begin, end, id;
+  jlog_message m;
+  int n, rv, last_log = -1;
+
+  r = jlog_new(path);
+  if(jlog_ctx_open_reader(r, sub) != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(r), jlog_ctx_err_string(r));
+    exit(-1);
+  }
+  while((n = jlog_ctx_read_interval(r, &begin, &end)) > 0) {
+    id = begin;
+    while((rv = jlog_ctx_filter_next(r, &id, &end)) == 1) {
+      if(jlog_ctx_read_message(r, &id, &m) != 0 || !jcheck_numbered(&m, *next)) {
+        fprintf(stderr, "tags: %s expected message %d at %08x:%08x\n", sub,
+                *next, id.log, id.marker);
+        exit(-1);
+      }
+      *next += 10;
+      last_log = id.log;
+      JLOG_ID_ADVANCE(&id);
+    }
+    if(rv < 0) {
+      fprintf(stderr, "jlog_ctx_filter_next failed: %d %s\n", jlog_ctx_err(r), jlog_ctx_err_string(r));
+      exit(-1);
+    }
+    jlog_ctx_read_checkpoint(r, &end);
+  }
+  if(n < 0) {
+    fprintf(stderr, "jlog_ctx_read_interval failed: %d %s\n", jlog_ctx_err(r), jlog_ctx_err_string(r));
+    exit(-1);
+  }
+  jlog_ctx_close(r);
+  return last_log;
+}
+
+void jtags(const char *path, int count) {
+  char buf[32], tidx[MAXPATHLEN];
+  u_int8_t seven[] = { 7 };
+  int i, next = 7, last_log;
+
+  rmjlog(path);
+  ctx = jlog_new(path);
+  jlog_ctx_set_compact_headers(ctx, 1);
+  jlog_ctx_alter_journal_size(ctx, 4096);
+  if(jlog_ctx_init(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_init failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  if(jlog_ctx_add_subscriber_filtered(ctx, "seven", JLOG_BEGIN, seven, 1) != 0) {
+    fprintf(stderr, "jlog_ctx_add_subscriber_filtered failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  jlog_ctx_close(ctx);
+
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_writer(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  for(i=0; i<count; i++) {
+    snprintf(buf, sizeof(buf), "message %08d", i);
+    if(jlog_ctx_write_tagged(ctx, i % 10, buf, strlen(buf)) != 0) {
+      fprintf(stderr, "jlog_ctx_write_tagged failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+    /* once with the writer part way into a segment */
+    if(i == count / 2) jdrain_filtered(path, "seven", &next);
+  }
+  jlog_ctx_close(ctx);
+  last_log = jdrain_filtered(path, "seven", &next);
+  if(next != 7 + 10 * ((count - 8) / 10 + 1) || last_log < 2) {
+    fprintf(stderr, "tags: saw up to message %d in segment %d of %d messages\n",
+            next - 10, last_log, count);
+    exit(-1);
+  }
+  /* the only subscriber has passed segment 0, so its index for tag 7
+   * should have gone with it */
+  snprintf(tidx, sizeof(tidx), "%s%c00000000.t07", path, IFS_CH);
+  if(access(tidx, F_OK) == 0) {
+    fprintf(stderr, "tags: %s outlived its segment\n", tidx);
+    exit(-1);
+  }
+  rmjlog(path);
+  printf("tags: ok\n");
+}
+
+/*
+  Retention with a subscriber that never reads: first with a size cap,
+  which must keep the segments within a segment of the cap, then with an
+  age limit, where records stamped an hour ago must go and those stamped
+  now must stay.  Either way the subscriber then reads on from the first
+  record kept, with no gaps, to the last one written.  Segments removed
+  under a lagging subscriber must not end up in the spare pool.
+*/
+static int jspares(const char *path) {
+  struct dirent *de;
+  DIR *dir;
+  int n = 0;
+
+  if(!(dir = opendir(path))) return 0;
+  while((de = readdir(dir)) != NULL)
+    if(!strncmp(de->d_name, "spare.", 6)) n++;
+  closedir(dir);
+  return n;
+}
+
+static u_int64_t jsegment_bytes(const char *path) {
+  char file[MAXPATHLEN];
+  struct dirent *de;
+  struct stat sb;
+  u_int64_t total = 0;
+  DIR *dir;
+
+  if(!(dir = opendir(path))) return 0;
+  while((de = readdir(dir)) != NULL) {
+    /* segments and their .idx and .t<hh> indexes */
+    if(strlen(de->d_name) < 8 || strspn(de->d_name, "0123456789abcdef") != 8)
+      continue;
+    if(snprintf(file, sizeof(file), "%s%c%s", path, IFS_CH,
+                de->d_name) >= (int)sizeof(file)) continue;
+    if(stat(file, &sb) == 0) total += sb.st_size;
+  }
+  closedir(dir);
+  return total;
+}
+
+static int jretained(const char *path, int count) {
+  jlog_ctx *r;
+  jlog_id begin, end;
+  jlog_message m;
+  int i, n, first = -1, next = -1;
+
+  r = jlog_new(path);
+  if(jlog_ctx_open_reader(r, "dead") != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(r), jlog_ctx_err_string(r));
+    exit(-1);
+  }
+  while((n = jlog_ctx_read_interval(r, &begin, &end)) > 0) {
+    for(i=0; i<n; i++, JLOG_ID_ADVANCE(&begin)) {
+      if(jlog_ctx_read_message(r, &begin, &m) != 0) {
+        fprintf(stderr, "retention: read failed at %08x:%08x\n", begin.log, begin.marker);
+        exit(-1);
+      }
+      if(first < 0) first = next = atoi((char *)m.mess + 8);
+      if(!jcheck_numbered(&m, next++)) {
+        fprintf(stderr, "retention: expected message %d at %08x:%08x\n",
+                next - 1, begin.log, begin.marker);
+        exit(-1);
+      }
+    }
+    jlog_ctx_read_checkpoint(r, &end);
+  }
+  jlog_ctx_close(r);
+  if(next != count) {
+    fprintf(stderr, "retention: read up to message %d of %d\n", next - 1, count);
+    exit(-1);
+  }
+  return first;
+}
+
+void jretention(const char *path) {
+  char buf[32];
+  struct timeval now;
+  jlog_message m;
+  u_int64_t bytes;
+  int i, first, count = 2000;
+
+  rmjlog(path);
+  ctx = jlog_new(path);
+  jlog_ctx_alter_journal_size(ctx, 4096);
+  jlog_ctx_alter_spare_segments(ctx, 2);
+  jlog_ctx_set_retention(ctx, 0, 16384);
+  if(jlog_ctx_init(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_init failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  jlog_ctx_add_subscriber(ctx, "dead", JLOG_BEGIN);
+  jlog_ctx_close(ctx);
+  /* enforced by the writer at each rollover */
+  jwrite_numbered(path, 0, count);
+  bytes = jsegment_bytes(path);
+  /* the segment being written is never removed, so allow one more */
+  if(bytes > 16384 + 4096 + 4096 / 16) {
+    fprintf(stderr, "retention: %llu bytes kept over a 16384 byte cap\n",
+            (unsigned long long)bytes);
+    exit(-1);
+  }
+  if(jspares(path) != 0) {
+    fprintf(stderr, "retention: removed segments went to the spare pool\n");
+    exit(-1);
+  }
+  if((first = jretained(path, count)) <= 0) {
+    fprintf(stderr, "retention: nothing removed under the size cap\n");
+    exit(-1);
+  }
+
+  rmjlog(path);
+  ctx = jlog_new(path);
+  jlog_ctx_alter_journal_size(ctx, 4096);
+  jlog_ctx_set_retention(ctx, 600, 0);
+  if(jlog_ctx_init(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_init failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  jlog_ctx_add_subscriber(ctx, "dead", JLOG_BEGIN);
+  jlog_ctx_close(ctx);
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_writer(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  gettimeofday(&now, NULL);
+  for(i=0; i<count; i++) {
+    struct timeval when = now;
+    if(i < count / 2) when.tv_sec -= 3600;
+    snprintf(buf, sizeof(buf), "message %08d", i);
+    m.mess = buf;
+    m.mess_len = strlen(buf);
+    if(jlog_ctx_write_message(ctx, &m, &when) != 0) {
+      fprintf(stderr, "jlog_ctx_write_message failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+  }
+  /* nothing older is left for an explicit pass to find */
+  if((i = jlog_ctx_enforce_retention(ctx)) != 0) {
+    fprintf(stderr, "retention: a second pass removed %d segments\n", i);
+    exit(-1);
+  }
+  jlog_ctx_close(ctx);
+  /* only the segment holding the last old record may keep any */
+  first = jretained(path, count);
+  if(first <= 0 || first > count / 2 || count / 2 - first > 4096 / 32) {
+    fprintf(stderr, "retention: kept records from %d, %d were an hour old\n",
+            first, count / 2);
+    exit(-1);
+  }
+  rmjlog(path);
+  printf("retention: ok\n");
+}
+
+/*
+  jlog_ctx_wait: a writer's context is refused, an idle reader times out,
+  and a reader is woken promptly by a write from another process, even
+  after a reader killed while waiting has left its count behind.  Both
+  with an extended metastore's write count to sleep on and with an older
+  one's, where the first wait only starts watching the directory.
+*/
+static double jelapsed(const struct timeval *since) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - since->tv_sec) + (now.tv_usec - since->tv_usec) / 1e6;
+}
+
+void jwait(const char *path, int extended) {
+  struct timeval tv, start;
+  jlog_id begin, end;
+  jlog_ctx *w, *r;
+  pid_t pid;
+  int rv;
+
+  rmjlog(path);
+  ctx = jlog_new(path);
+  if(extended) jlog_ctx_alter_spare_segments(ctx, 2);
+  if(jlog_ctx_init(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_init failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  jlog_ctx_add_subscriber(ctx, "wait", JLOG_BEGIN);
+  jlog_ctx_close(ctx);
+
+  w = jlog_new(path);
+  if(jlog_ctx_open_writer(w) != 0) {
+    fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(w), jlog_ctx_err_string(w));
+    exit(-1);
+  }
+  tv.tv_sec = 0;
+  tv.tv_usec = 10000;
+  if(jlog_ctx_wait(w, &tv) != -1 || jlog_ctx_err(w) != JLOG_ERR_ILLEGAL_WRITE ||
+     jlog_ctx_wait_fd(w) != -1 || jlog_ctx_err(w) != JLOG_ERR_ILLEGAL_WRITE) {
+    fprintf(stderr, "wait: a writer got %d %s\n", jlog_ctx_err(w), jlog_ctx_err_string(w));
+    exit(-1);
+  }
+  jlog_ctx_close(w);
+
+  r = jlog_new(path);
+  if(jlog_ctx_open_reader(r, "wait") != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(r), jlog_ctx_err_string(r));
+    exit(-1);
+  }
+  if(jlog_ctx_read_interval(r, &begin, &end) != 0) {
+    fprintf(stderr, "wait: found records in a new jlog\n");
+    exit(-1);
+  }
+  tv.tv_usec = 50000;
+  if(!extended) {
+    if(jlog_ctx_wait(r, &tv) != 1) {
+      fprintf(stderr, "wait: first wait on an older metastore did not return 1\n");
+      exit(-1);
+    }
+    jlog_ctx_read_interval(r, &begin, &end);
+  }
+  gettimeofday(&start, NULL);
+  if((rv = jlog_ctx_wait(r, &tv)) != 0 || jelapsed(&start) < 0.04) {
+    fprintf(stderr, "wait: idle wait gave %d after %.3fs\n", rv, jelapsed(&start));
+    exit(-1);
+  }
+
+  /* a reader killed in its sleep */
+  if((pid = fork()) == 0) {
+    jlog_ctx *dead = jlog_new(path);
+    if(jlog_ctx_open_reader(dead, "wait") != 0) _exit(1);
+    jlog_ctx_read_interval(dead, &begin, &end);
+    jlog_ctx_wait(dead, NULL);
+    _exit(0);
+  }
+  usleep(100000);
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+
+  /* two writes from elsewhere: the first finds only the dead reader's
+   * count, the second must still wake us */
+  for(rv = 0; rv < 2; rv++) {
+    if((pid = fork()) == 0) {
+      usleep(100000);
+      jwrite_numbered(path, rv, 1);
+      _exit(0);
+    }
+    jlog_ctx_read_interval(r, &begin, &end);
+    jlog_ctx_read_checkpoint(r, &end);
+    tv.tv_sec = 5;
+    tv.tv_usec = 0;
+    gettimeofday(&start, NULL);
+    if(jlog_ctx_wait(r, &tv) != 1 || jelapsed(&start) > 0.5) {
+      fprintf(stderr, "wait: write %d woke us after %.3fs\n", rv, jelapsed(&start));
+      exit(-1);
+    }
+    waitpid(pid, NULL, 0);
+    if(jlog_ctx_read_interval(r, &begin, &end) != 1) {
+      fprintf(stderr, "wait: woken with nothing to read\n");
+      exit(-1);
+    }
+    jlog_ctx_read_checkpoint(r, &end);
+  }
+  jlog_ctx_close(r);
+  rmjlog(path);
+  printf("wait (%s metastore): ok\n", extended ? "extended" : "older");
+}
+
+/*
+  Consumer group workers are contexts, not processes: two readers in one
+  process lease different segments and cannot checkpoint each other's,
+  a closed one's lease goes to the other, and so does that of a worker
+  in another process that is killed mid-segment.  Every record is read
+  by someone.
+*/
+static jlog_ctx *jgroup_open(const char *path) {
+  jlog_ctx *g = jlog_new(path);
+  if(jlog_ctx_open_reader(g, "group") != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(g), jlog_ctx_err_string(g));
+    exit(-1);
+  }
+  return g;
+}
+
+static int jgroup_claim(jlog_ctx *g, jlog_id *begin, jlog_id *end) {
+  int n = jlog_ctx_group_claim(g, begin, end);
+  if(n < 0) {
+    fprintf(stderr, "jlog_ctx_group_claim failed: %d %s\n", jlog_ctx_err(g), jlog_ctx_err_string(g));
+    exit(-1);
+  }
+  return n;
+}
+
+static void jgroup_read(jlog_ctx *g, jlog_id begin, const jlog_id *end,
+                        char *seen, int count) {
+  jlog_message m;
+  int n;
+
+  for(; begin.marker <= end->marker; JLOG_ID_ADVANCE(&begin)) {
+    if(jlog_ctx_read_message(g, &begin, &m) != 0) {
+      fprintf(stderr, "jlog_ctx_read_message failed: %d %s\n", jlog_ctx_err(g), jlog_ctx_err_string(g));
+      exit(-1);
+    }
+    n = m.mess_len > 8 ? atoi((char *)m.mess + 8) : -1;
+    if(n < 0 || n >= count || !jcheck_numbered(&m, n)) {
+      fprintf(stderr, "group: bad record at %08x:%08x\n", begin.log, begin.marker);
+      exit(-1);
+    }
+    seen[n] = 1;
+  }
+}
+
+void jgroup(const char *path, int count) {
+  jlog_id abegin, aend, bbegin, bend, cbegin, cend;
+  jlog_ctx *a, *b, *c;
+  char *seen;
+  int fds[2], i;
+  pid_t pid;
+
+  rmjlog(path);
+  ctx = jlog_new(path);
+  jlog_ctx_alter_journal_size(ctx, 1024);
+  if(jlog_ctx_init(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_init failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  jlog_ctx_add_subscriber(ctx, "group", JLOG_BEGIN);
+  jlog_ctx_close(ctx);
+  jwrite_numbered(path, 0, count);
+  seen = calloc(count, 1);
+
+  a = jgroup_open(path);
+  b = jgroup_open(path);
+  if(jgroup_claim(a, &abegin, &aend) == 0 || jgroup_claim(b, &bbegin, &bend) == 0 ||
+     abegin.log == bbegin.log) {
+    fprintf(stderr, "group: two contexts share segment %08x\n", abegin.log);
+    exit(-1);
+  }
+  jgroup_read(a, abegin, &aend, seen, count);
+  jgroup_read(b, bbegin, &bend, seen, count);
+  if(jlog_ctx_group_checkpoint(b, &aend) != -1 ||
+     jlog_ctx_err(b) != JLOG_ERR_ILLEGAL_CHECKPOINT) {
+    fprintf(stderr, "group: checkpointed another context's lease\n");
+    exit(-1);
+  }
+  if(jlog_ctx_group_checkpoint(b, &bend) != 0) {
+    fprintf(stderr, "jlog_ctx_group_checkpoint failed: %d %s\n", jlog_ctx_err(b), jlog_ctx_err_string(b));
+    exit(-1);
+  }
+  /* a goes away without checkpointing; b picks up where it started */
+  jlog_ctx_close(a);
+  if(jgroup_claim(b, &bbegin, &bend) == 0 || bbegin.log != abegin.log ||
+     bbegin.marker != abegin.marker) {
+    fprintf(stderr, "group: closed context's lease %08x:%08x came back as %08x:%08x\n",
+            abegin.log, abegin.marker, bbegin.log, bbegin.marker);
+    exit(-1);
+  }
+  jgroup_read(b, bbegin, &bend, seen, count);
+  jlog_ctx_group_checkpoint(b, &bend);
+
+  /* a worker elsewhere is killed holding a lease */
+  if(pipe(fds) != 0) {
+    perror("pipe");
+    exit(-1);
+  }
+  if((pid = fork()) == 0) {
+    c = jgroup_open(path);
+    if(jlog_ctx_group_claim(c, &cbegin, &cend) <= 0) _exit(1);
+    if(write(fds[1], &cbegin, sizeof(cbegin)) != sizeof(cbegin)) _exit(1);
+    pause();
+    _exit(0);
+  }
+  close(fds[1]);
+  if(read(fds[0], &cbegin, sizeof(cbegin)) != sizeof(cbegin)) {
+    fprintf(stderr, "group: worker failed to claim\n");
+    exit(-1);
+  }
+  close(fds[0]);
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  if(jgroup_claim(b, &bbegin, &bend) == 0 || bbegin.log != cbegin.log ||
+     bbegin.marker != cbegin.marker) {
+    fprintf(stderr, "group: dead worker's lease %08x:%08x came back as %08x:%08x\n",
+            cbegin.log, cbegin.marker, bbegin.log, bbegin.marker);
+    exit(-1);
+  }
+
+  /* and b finishes the lot */
+  do {
+    jgroup_read(b, bbegin, &bend, seen, count);
+    if(jlog_ctx_group_checkpoint(b, &bend) != 0) {
+      fprintf(stderr, "jlog_ctx_group_checkpoint failed: %d %s\n", jlog_ctx_err(b), jlog_ctx_err_string(b));
+      exit(-1);
+    }
+  } while(jgroup_claim(b, &bbegin, &bend) > 0);
+  jlog_ctx_close(b);
+  for(i=0; i<count; i++) {
+    if(!seen[i]) {
+      fprintf(stderr, "group: record %d never read\n", i);
+      exit(-1);
+    }
+  }
+  free(seen);
+  rmjlog(path);
+  printf("group: ok\n");
+}
+
+/*
+  Loses the metastore, as a crash while it is rewritten might, and has a
+  non-aggressive jlog_ctx_repair rebuild it from what else is on disk.
+*/
+static void jlose_metastore(const char *path) {
+  char file[MAXPATHLEN];
+  jlog_ctx *r;
+
+  snprintf(file, sizeof(file), "%s%cmetastore", path, IFS_CH);
+  unlink(file);
+  r = jlog_new(path);
+  if(jlog_ctx_repair(r, 0) != 1) {
+    fprintf(stderr, "jlog_ctx_repair failed: %d %s\n", jlog_ctx_err(r), jlog_ctx_err_string(r));
+    exit(-1);
+  }
+  jlog_ctx_close(r);
+}
+
+/*
+  A compact-header jlog written in two sessions, a second apart per
+  record and rolling over every few dozen records, read back in order
+  with the times written; then every segment's first and last records,
+  found again by jlog_ctx_seek_time, must be the ones read there.
+  Finally the metastore is lost while the newest segment is still empty,
+  and the repaired jlog must read back the same from the start.
+*/
+void jcompact(const char *path, int count) {
+  char buf[32], file[MAXPATHLEN];
+  struct timeval base, when;
+  struct timespec ts;
+  jlog_id begin, end, *ids, id;
+  jlog_message m;
+  int i, n, half, seen = 0, rollovers = 0;
+
+  rmjlog(path);
+  ctx = jlog_new(path);
+  jlog_ctx_set_compact_headers(ctx, 1);
+  jlog_ctx_alter_journal_size(ctx, 1024);
+  if(jlog_ctx_init(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_init failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  jlog_ctx_add_subscriber(ctx, "compact", JLOG_BEGIN);
+  /* keeps the segments read past around to seek in */
+  jlog_ctx_add_subscriber(ctx, "hold", JLOG_BEGIN);
+  jlog_ctx_close(ctx);
+
+  gettimeofday(&base, NULL);
+  base.tv_sec -= count;
+  base.tv_usec = 0;
+  for(half=0; half<2; half++) {
+    ctx = jlog_new(path);
+    if(jlog_ctx_open_writer(ctx) != 0) {
+      fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+    for(i=half*count/2; i<(half+1)*count/2; i++) {
+      when = base;
+      when.tv_sec += i;
+      snprintf(buf, sizeof(buf), "message %08d", i);
+      m.mess = buf;
+      m.mess_len = strlen(buf);
+      if(jlog_ctx_write_message(ctx, &m, &when) != 0) {
+        fprintf(stderr, "jlog_ctx_write_message failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+        exit(-1);
+      }
+    }
+    jlog_ctx_close(ctx);
+  }
+  count -= count % 2;
+
+  ids = calloc(count, sizeof(*ids));
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_reader(ctx, "compact") != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  while((n = jlog_ctx_read_interval(ctx, &begin, &end)) > 0) {
+    for(i=0; i<n; i++, JLOG_ID_ADVANCE(&begin)) {
+      if(seen >= count || jlog_ctx_read_message(ctx, &begin, &m) != 0 ||
+         !jcheck_numbered(&m, seen)) {
+        fprintf(stderr, "compact: expected message %d at %08x:%08x\n",
+                seen, begin.log, begin.marker);
+        exit(-1);
+      }
+      jlog_message_timespec(ctx, &m, &ts);
+      if(ts.tv_sec != base.tv_sec + seen || ts.tv_nsec != 0) {
+        fprintf(stderr, "compact: message %d stamped %ld.%09ld, not %ld\n",
+                seen, (long)ts.tv_sec, (long)ts.tv_nsec, (long)base.tv_sec + seen);
+        exit(-1);
+      }
+      if(seen && begin.log != ids[seen - 1].log) rollovers++;
+      ids[seen++] = begin;
+    }
+    jlog_ctx_read_checkpoint(ctx, &end);
+  }
+  if(n < 0 || seen != count || rollovers < 4) {
+    fprintf(stderr, "compact: read %d of %d messages over %d rollovers\n",
+            seen, count, rollovers);
+    exit(-1);
+  }
+  for(i=0; i<count; i++) {
+    /* either side of each rollover */
+    if(i > 0 && i < count - 1 && ids[i - 1].log == ids[i].log &&
+       ids[i + 1].log == ids[i].log) continue;
+    when = base;
+    when.tv_sec += i;
+    if(jlog_ctx_seek_time(ctx, &when, &id) != 0 ||
+       id.log != ids[i].log || id.marker != ids[i].marker ||
+       jlog_ctx_read_message(ctx, &id, &m) != 0 || !jcheck_numbered(&m, i)) {
+      fprintf(stderr, "compact: seeking to message %d found %08x:%08x, not %08x:%08x\n",
+              i, id.log, id.marker, ids[i].log, ids[i].marker);
+      exit(-1);
+    }
+  }
+  jlog_ctx_close(ctx);
+
+  /* as a rollover leaves it */
+  snprintf(file, sizeof(file), "%s%c%08x", path, IFS_CH, ids[count - 1].log + 1);
+  close(creat(file, DEFAULT_FILE_MODE));
+  jlose_metastore(path);
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_reader(ctx, "hold") != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  seen = 0;
+  while((n = jlog_ctx_read_interval(ctx, &begin, &end)) > 0) {
+    for(i=0; i<n; i++, JLOG_ID_ADVANCE(&begin)) {
+      if(seen >= count || jlog_ctx_read_message(ctx, &begin, &m) != 0 ||
+         !jcheck_numbered(&m, seen)) {
+        fprintf(stderr, "compact: after repair, expected message %d at %08x:%08x\n",
+                seen, begin.log, begin.marker);
+        exit(-1);
+      }
+      seen++;
+    }
+    jlog_ctx_read_checkpoint(ctx, &end);
+  }
+  if(n < 0 || seen != count) {
+    fprintf(stderr, "compact: after repair, read %d of %d messages\n", seen, count);
+    exit(-1);
+  }
+  jlog_ctx_close(ctx);
+  free(ids);
+  rmjlog(path);
+  printf("compact: ok\n");
+}
+
+/*
+  A jlog of fixed-size records written in two sessions, rolling over
+  every few dozen records, with no .idx anywhere.  Read back in bulk
+  after a reopen, in order and with the times written; then records
+  either side of each rollover, fetched directly by id and found again
+  by jlog_ctx_seek_time, must be the ones read there.  A jlog repaired
+  after losing its metastore must still be one of fixed-size records.
+*/
+void jfixed(const char *path, int count) {
+  char buf[32], *dot;
+  struct timeval base, when;
+  struct timespec ts;
+  jlog_id begin, end, *ids, id;
+  jlog_message m, *batch;
+  struct dirent *de;
+  DIR *dir;
+  int i, n, half, seen = 0, rollovers = 0;
+
+  rmjlog(path);
+  ctx = jlog_new(path);
+  jlog_ctx_set_fixed_record_size(ctx, strlen("message 00000000"));
+  jlog_ctx_alter_journal_size(ctx, 1024);
+  if(jlog_ctx_init(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_init failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  jlog_ctx_add_subscriber(ctx, "fixed", JLOG_BEGIN);
+  /* keeps the segments read past around to seek in */
+  jlog_ctx_add_subscriber(ctx, "hold", JLOG_BEGIN);
+  jlog_ctx_close(ctx);
+
+  gettimeofday(&base, NULL);
+  base.tv_sec -= count;
+  base.tv_usec = 0;
+  for(half=0; half<2; half++) {
+    ctx = jlog_new(path);
+    if(jlog_ctx_open_writer(ctx) != 0) {
+      fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+    if(jlog_ctx_write(ctx, "short", 5) != -1 ||
+       jlog_ctx_err(ctx) != JLOG_ERR_ILLEGAL_WRITE) {
+      fprintf(stderr, "fixed: wrote a record of the wrong size\n");
+      exit(-1);
+    }
+    for(i=half*count/2; i<(half+1)*count/2; i++) {
+      when = base;
+      when.tv_sec += i;
+      snprintf(buf, sizeof(buf), "message %08d", i);
+      m.mess = buf;
+      m.mess_len = strlen(buf);
+      if(jlog_ctx_write_message(ctx, &m, &when) != 0) {
+        fprintf(stderr, "jlog_ctx_write_message failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+        exit(-1);
+      }
+    }
+    jlog_ctx_close(ctx);
+  }
+  count -= count % 2;
+
+  if(!(dir = opendir(path))) {
+    perror("opendir");
+    exit(-1);
+  }
+  while((de = readdir(dir)) != NULL) {
+    if((dot = strrchr(de->d_name, '.')) && !strcmp(dot, ".idx")) {
+      fprintf(stderr, "fixed: found index %s\n", de->d_name);
+      exit(-1);
+    }
+  }
+  closedir(dir);
+
+  ids = calloc(count, sizeof(*ids));
+  batch = calloc(count, sizeof(*batch));
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_reader(ctx, "fixed") != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  while((n = jlog_ctx_read_interval(ctx, &begin, &end)) > 0) {
+    if(seen + n > count || jlog_ctx_bulk_read_messages(ctx, &begin, n, batch) != 0) {
+      fprintf(stderr, "fixed: bulk read of %d at %08x:%08x failed: %d %s\n",
+              n, begin.log, begin.marker, jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+    for(i=0; i<n; i++, JLOG_ID_ADVANCE(&begin)) {
+      if(!jcheck_numbered(&batch[i], seen)) {
+        fprintf(stderr, "fixed: expected message %d at %08x:%08x\n",
+                seen, begin.log, begin.marker);
+        exit(-1);
+      }
+      jlog_message_timespec(ctx, &batch[i], &ts);
+      if(ts.tv_sec != base.tv_sec + seen || ts.tv_nsec != 0) {
+        fprintf(stderr, "fixed: message %d stamped %ld.%09ld, not %ld\n",
+                seen, (long)ts.tv_sec, (long)ts.tv_nsec, (long)base.tv_sec + seen);
+        exit(-1);
+      }
+      if(seen && begin.log != ids[seen - 1].log) rollovers++;
+      ids[seen++] = begin;
+    }
+    jlog_ctx_read_checkpoint(ctx, &end);
+  }
+  if(n < 0 || seen != count || rollovers < 4) {
+    fprintf(stderr, "fixed: read %d of %d messages over %d rollovers\n",
+            seen, count, rollovers);
+    exit(-1);
+  }
+  for(i=0; i<count; i++) {
+    /* either side of each rollover */
+    if(i > 0 && i < count - 1 && ids[i - 1].log == ids[i].log &&
+       ids[i + 1].log == ids[i].log) continue;
+    if(jlog_ctx_read_message(ctx, &ids[i], &m) != 0 || !jcheck_numbered(&m, i)) {
+      fprintf(stderr, "fixed: reading %08x:%08x did not give message %d\n",
+              ids[i].log, ids[i].marker, i);
+      exit(-1);
+    }
+    when = base;
+    when.tv_sec += i;
+    if(jlog_ctx_seek_time(ctx, &when, &id) != 0 ||
+       id.log != ids[i].log || id.marker != ids[i].marker) {
+      fprintf(stderr, "fixed: seeking to message %d found %08x:%08x, not %08x:%08x\n",
+              i, id.log, id.marker, ids[i].log, ids[i].marker);
+      exit(-1);
+    }
+  }
+  jlog_ctx_close(ctx);
+
+  jlose_metastore(path);
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_writer(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  if(jlog_ctx_write(ctx, "short", 5) != -1 ||
+     jlog_ctx_err(ctx) != JLOG_ERR_ILLEGAL_WRITE) {
+    fprintf(stderr, "fixed: repair lost the record size\n");
+    exit(-1);
+  }
+  jlog_ctx_close(ctx);
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_reader(ctx, "hold") != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  for(i=0; i<count; i++) {
+    if(jlog_ctx_read_message(ctx, &ids[i], &m) != 0 || !jcheck_numbered(&m, i)) {
+      fprintf(stderr, "fixed: after repair, reading %08x:%08x did not give message %d\n",
+              ids[i].log, ids[i].marker, i);
+      exit(-1);
+    }
+  }
+  jlog_ctx_close(ctx);
+  free(batch);
+  free(ids);
+  rmjlog(path);
+  printf("fixed: ok\n");
+}
+
+/*
+  A jlog indexing every 8th record, rolling over every few dozen.  Every
+  record, indexed or part way through a stride, must be readable by id
+  in any order.  Then the closed segments' indexes lose their close
+  marker, or more, as if the indexer died part way: a fresh reader must
+  rebuild them, close them again and read the same records back.  The
+  same records must come back once more after the metastore is lost and
+  the jlog repaired.
+*/
+#define JSPARSE_STRIDE 8
+
+static int jsparse_idx(const char *path, u_int32_t log, char *file, size_t len) {
+  return snprintf(file, len, "%s%c%08x.idx", path, IFS_CH, log) < (int)len;
+}
+
+static int jsparse_read_all(jlog_ctx *r, jlog_id *ids, int count) {
+  jlog_id begin, end;
+  jlog_message m;
+  int i, n, seen = 0;
+
+  while((n = jlog_ctx_read_interval(r, &begin, &end)) > 0) {
+    for(i=0; i<n; i++, JLOG_ID_ADVANCE(&begin)) {
+      if(seen >= count || jlog_ctx_read_message(r, &begin, &m) != 0 ||
+         !jcheck_numbered(&m, seen)) {
+        fprintf(stderr, "sparse: expected message %d at %08x:%08x\n",
+                seen, begin.log, begin.marker);
+        exit(-1);
+      }
+      ids[seen++] = begin;
+    }
+    jlog_ctx_read_checkpoint(r, &end);
+  }
+  if(n < 0) {
+    fprintf(stderr, "jlog_ctx_read_interval failed: %d %s\n", jlog_ctx_err(r), jlog_ctx_err_string(r));
+    exit(-1);
+  }
+  return seen;
+}
+
+void jsparse(const char *path, int count) {
+  char file[MAXPATHLEN];
+  jlog_id *ids, *again, after;
+  jlog_message m;
+  struct stat sb;
+  off_t *idx_len, len;
+  u_int32_t log, logs;
+  int i, seen;
+
+  rmjlog(path);
+  ctx = jlog_new(path);
+  jlog_ctx_set_sparse_index(ctx, JSPARSE_STRIDE);
+  jlog_ctx_alter_journal_size(ctx, 1024);
+  if(jlog_ctx_init(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_init failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  jlog_ctx_add_subscriber(ctx, "sparse", JLOG_BEGIN);
+  jlog_ctx_add_subscriber(ctx, "repaired", JLOG_BEGIN);
+  /* keeps the segments read past around to read and repair again */
+  jlog_ctx_add_subscriber(ctx, "hold", JLOG_BEGIN);
+  jlog_ctx_close(ctx);
+  jwrite_numbered(path, 0, count / 2);
+  jwrite_numbered(path, count / 2, count - count / 2);
+
+  ids = calloc(count, sizeof(*ids));
+  again = calloc(count, sizeof(*again));
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_reader(ctx, "sparse") != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  if((seen = jsparse_read_all(ctx, ids, count)) != count ||
+     (logs = ids[count - 1].log) < 4) {
+    fprintf(stderr, "sparse: read %d of %d messages over %u segments\n",
+            seen, count, ids[count - 1].log + 1);
+    exit(-1);
+  }
+  /* backwards, so no read is helped along by the one before */
+  for(i=count-1; i>=0; i--) {
+    if(jlog_ctx_read_message(ctx, &ids[i], &m) != 0 || !jcheck_numbered(&m, i)) {
+      fprintf(stderr, "sparse: reading %08x:%08x did not give message %d\n",
+              ids[i].log, ids[i].marker, i);
+      exit(-1);
+    }
+  }
+  /* and nothing past the end of a closed segment */
+  after = ids[0];
+  for(i=0; i<count && ids[i].log == ids[0].log; i++) after = ids[i];
+  after.marker++;
+  if(jlog_ctx_read_message(ctx, &after, &m) == 0) {
+    fprintf(stderr, "sparse: read past the end of segment %08x\n", after.log);
+    exit(-1);
+  }
+  jlog_ctx_close(ctx);
+
+  /* the closed segments' indexes: a stride's worth of offsets and the
+   * close marker and count, so a little over an eighth of a dense one */
+  idx_len = calloc(logs, sizeof(*idx_len));
+  for(log=0; log<logs; log++) {
+    if(!jsparse_idx(path, log, file, sizeof(file)) || stat(file, &sb) != 0) {
+      fprintf(stderr, "sparse: no index for closed segment %08x\n", log);
+      exit(-1);
+    }
+    for(i=0, seen=0; i<count; i++) if(ids[i].log == log) seen++;
+    idx_len[log] = sb.st_size;
+    if(sb.st_size != ((seen + JSPARSE_STRIDE - 1) / JSPARSE_STRIDE + 2) * 8) {
+      fprintf(stderr, "sparse: segment %08x of %d records has a %ld byte index\n",
+              log, seen, (long)sb.st_size);
+      exit(-1);
+    }
+    /* each loses its close marker and count; some their last offset or
+     * half a word more besides, and the first everything */
+    len = sb.st_size - 16;
+    if(log % 3 == 2) len -= 8;
+    if(log % 3 == 0) len -= 4;
+    if(truncate(file, log == 0 ? 0 : len) != 0) {
+      perror("truncate");
+      exit(-1);
+    }
+  }
+
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_reader(ctx, "repaired") != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  if((seen = jsparse_read_all(ctx, again, count)) != count ||
+     memcmp(ids, again, count * sizeof(*ids))) {
+    fprintf(stderr, "sparse: after repair read %d of %d messages\n", seen, count);
+    exit(-1);
+  }
+  for(i=count-1; i>=0; i--) {
+    if(jlog_ctx_read_message(ctx, &ids[i], &m) != 0 || !jcheck_numbered(&m, i)) {
+      fprintf(stderr, "sparse: after repair %08x:%08x did not give message %d\n",
+              ids[i].log, ids[i].marker, i);
+      exit(-1);
+    }
+  }
+  jlog_ctx_close(ctx);
+  for(log=0; log<logs; log++) {
+    if(!jsparse_idx(path, log, file, sizeof(file)) || stat(file, &sb) != 0 ||
+       sb.st_size != idx_len[log]) {
+      fprintf(stderr, "sparse: segment %08x's index was not closed again\n", log);
+      exit(-1);
+    }
+  }
+
+  jlose_metastore(path);
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_reader(ctx, "hold") != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  for(i=count-1; i>=0; i--) {
+    if(jlog_ctx_read_message(ctx, &ids[i], &m) != 0 || !jcheck_numbered(&m, i)) {
+      fprintf(stderr, "sparse: after a metastore repair %08x:%08x did not give message %d\n",
+              ids[i].log, ids[i].marker, i);
+      exit(-1);
+    }
+  }
+  jlog_ctx_close(ctx);
+  free(idx_len);
+  free(again);
+  free(ids);
+  rmjlog(path);
+  printf("sparse: ok\n");
+}
+
+/*
+  A set striped over three members, each small enough to roll over many
+  times.  Written in turn, the messages must come back through a set
+  subscriber in exactly the order written, across a reopen part way;
+  written by key and read in timestamp order, each key's messages must
+  come back in order and every message exactly once.
+*/
+#define JSET_MEMBERS 3
+
+static jlog_set *jset_create(const char *path, char mpaths[][MAXPATHLEN]) {
+  const char *members[JSET_MEMBERS];
+  jlog_set *set;
+  int i;
+
+  rmjlog(path);
+  for(i=0; i<JSET_MEMBERS; i++) {
+    snprintf(mpaths[i], MAXPATHLEN, "%s.%d", path, i);
+    members[i] = mpaths[i];
+    rmjlog(mpaths[i]);
+    ctx = jlog_new(mpaths[i]);
+    jlog_ctx_alter_journal_size(ctx, 4096);
+    if(jlog_ctx_init(ctx) != 0) {
+      fprintf(stderr, "jlog_ctx_init failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+    jlog_ctx_close(ctx);
+  }
+  set = jlog_set_new(path);
+  if(jlog_set_init(set, members, JSET_MEMBERS) != 0) {
+    fprintf(stderr, "jlog_set_init failed: %d %s\n", jlog_set_err(set), jlog_set_err_string(set));
+    exit(-1);
+  }
+  return set;
+}
+
+static jlog_set *jset_open(const char *path, int ordered) {
+  jlog_set *set = jlog_set_new(path);
+  if(jlog_set_open_reader(set, "set") != 0) {
+    fprintf(stderr, "jlog_set_open_reader failed: %d %s\n", jlog_set_err(set), jlog_set_err_string(set));
+    exit(-1);
+  }
+  jlog_set_set_ordered(set, ordered);
+  return set;
+}
+
+void jset(const char *path, int count) {
+  char mpaths[JSET_MEMBERS][MAXPATHLEN], buf[32];
+  struct timespec ts, last_ts;
+  jlog_set_message m;
+  jlog_set *set;
+  int i, n, rv = 0, next = 0, key, keynext[5], seen;
+
+  count -= count % JSET_MEMBERS;
+  set = jset_create(path, mpaths);
+  /* as a half-done earlier attempt would have left it */
+  ctx = jlog_new(mpaths[1]);
+  jlog_ctx_add_subscriber(ctx, "set", JLOG_BEGIN);
+  jlog_ctx_close(ctx);
+  if(jlog_set_add_subscriber(set, "set", JLOG_BEGIN) != 0) {
+    fprintf(stderr, "jlog_set_add_subscriber failed: %d %s\n", jlog_set_err(set), jlog_set_err_string(set));
+    exit(-1);
+  }
+  if(jlog_set_add_subscriber(set, "set", JLOG_BEGIN) == 0 ||
+     jlog_set_err(set) != JLOG_ERR_SUBSCRIBER_EXISTS) {
+    fprintf(stderr, "set: adding a subscriber twice gave %d %s\n", jlog_set_err(set), jlog_set_err_string(set));
+    exit(-1);
+  }
+  if(jlog_set_open_writer(set) != 0) {
+    fprintf(stderr, "jlog_set_open_writer failed: %d %s\n", jlog_set_err(set), jlog_set_err_string(set));
+    exit(-1);
+  }
+  for(i=0; i<count; i++) {
+    snprintf(buf, sizeof(buf), "message %08d", i);
+    if(jlog_set_write(set, buf, strlen(buf)) != 0) {
+      fprintf(stderr, "jlog_set_write failed: %d %s\n", jlog_set_err(set), jlog_set_err_string(set));
+      exit(-1);
+    }
+  }
+  jlog_set_close(set);
+
+  /* one interval, then the rest after a reopen */
+  for(i=0; i<2; i++) {
+    set = jset_open(path, 0);
+    while((n = jlog_set_read_interval(set)) > 0) {
+      while((rv = jlog_set_read_message(set, &m)) == 1) {
+        if(!jcheck_numbered(&m.message, next++)) {
+          fprintf(stderr, "set: expected message %d from member %d at %08x:%08x\n",
+                  next - 1, m.member, m.id.log, m.id.marker);
+          exit(-1);
+        }
+      }
+      if(rv < 0 || jlog_set_read_checkpoint(set) != 0) break;
+      if(i == 0) break;
+    }
+    if(n < 0 || rv < 0) {
+      fprintf(stderr, "set: read failed: %d %s\n", jlog_set_err(set), jlog_set_err_string(set));
+      exit(-1);
+    }
+    jlog_set_close(set);
+  }
+  if(next != count) {
+    fprintf(stderr, "set: read %d of %d messages\n", next, count);
+    exit(-1);
+  }
+
+  set = jset_create(path, mpaths);
+  if(jlog_set_add_subscriber(set, "set", JLOG_BEGIN) != 0 ||
+     jlog_set_open_writer(set) != 0) {
+    fprintf(stderr, "set: %d %s\n", jlog_set_err(set), jlog_set_err_string(set));
+    exit(-1);
+  }
+  for(i=0; i<count; i++) {
+    key = i % 5;
+    snprintf(buf, sizeof(buf), "message %08d", i);
+    if(jlog_set_write_keyed(set, &key, sizeof(key), buf, strlen(buf)) != 0) {
+      fprintf(stderr, "jlog_set_write_keyed failed: %d %s\n", jlog_set_err(set), jlog_set_err_string(set));
+      exit(-1);
+    }
+  }
+  jlog_set_close(set);
+  for(key=0; key<5; key++) keynext[key] = key;
+  seen = 0;
+  set = jset_open(path, 1);
+  while((n = jlog_set_read_interval(set)) > 0) {
+    /* timestamp order only holds within an interval */
+    last_ts.tv_sec = last_ts.tv_nsec = 0;
+    while((rv = jlog_set_read_message(set, &m)) == 1) {
+      i = atoi((char *)m.message.mess + 8);
+      key = i % 5;
+      jlog_message_timespec(jlog_set_member(set, m.member), &m.message, &ts);
+      if(!jcheck_numbered(&m.message, keynext[key]) ||
+         ts.tv_sec < last_ts.tv_sec ||
+         (ts.tv_sec == last_ts.tv_sec && ts.tv_nsec < last_ts.tv_nsec)) {
+        fprintf(stderr, "set: message %d out of order, expected %d\n", i, keynext[key]);
+        exit(-1);
+      }
+      keynext[key] += 5;
+      last_ts = ts;
+      seen++;
+    }
+    if(rv < 0 || jlog_set_read_checkpoint(set) != 0) break;
+  }
+  if(n < 0 || rv < 0 || seen != count) {
+    fprintf(stderr, "set: read %d of %d messages: %d %s\n", seen, count,
+            jlog_set_err(set), jlog_set_err_string(set));
+    exit(-1);
+  }
+  jlog_set_close(set);
+  rmjlog(path);
+  for(i=0; i<JSET_MEMBERS; i++) rmjlog(mpaths[i]);
+  printf("set: ok\n");
+}
+
 int main(int argc, char **argv) {
   int i, len = -1, count = -1;
-  int jsize = 1024000;
+  size_t jsize = 1024000;
+  int cptable = 0, compact = 0;
   const char *path = LOGNAME;
   const char *subscriber = SUBSCRIBER;
   const char *command;
@@ -456,13 +1770,15 @@ int main(int argc, char **argv) {
     exit(-1);
   }
   command = argv[1];
-  while(-1 != (i = getopt(argc-1, argv+1, "p:n:l:s:j:"))) {
+  while(-1 != (i = getopt(argc-1, argv+1, "p:n:l:s:j:tc"))) {
     switch(i) {
     case 'p': path = optarg; break;
     case 's': subscriber = optarg; break;
     case 'l': len = atoi(optarg); break;
     case 'n': count = atoi(optarg); break;
-    case 'j': jsize = atoi(optarg); break;
+    case 'j': jsize = strtoull(optarg, NULL, 10); break;
+    case 't': cptable = 1; break;
+    case 'c': compact = 1; break;
     default: usage(); exit(-1);
     }
   }
@@ -471,7 +1787,7 @@ int main(int argc, char **argv) {
 #endif
   if(!strcmp(command, "init") || !strcmp(command, "init_compressed")) {
     int compress = strcmp(command, "init_compressed") == 0;
-    jcreate(path, subscriber, compress, jsize);
+    jcreate(path, subscriber, compress, jsize, cptable, compact);
     exit(0);
   } else if(!strcmp(command, "write")) {
     char *message;
@@ -498,6 +1814,45 @@ int main(int argc, char **argv) {
     if(count < 0) count = 1;
     jopenr_two_checks(subscriber, CHECKPOINT_SUBSCRIBER, count, path);
     exit(0);
+  } else if (!strcmp(command, "segment_bench")) {
+    if(len < 0) len = 100;
+    if(count < 0) count = 1000000;
+    jsegment_bench(path, len, count);
+    exit(0);
+  } else if (!strcmp(command, "tags")) {
+    if(count < 0) count = 1000;
+    jtags(path, count);
+    exit(0);
+  } else if (!strcmp(command, "retention")) {
+    jretention(path);
+    exit(0);
+  } else if (!strcmp(command, "wait")) {
+    jwait(path, 0);
+    jwait(path, 1);
+    exit(0);
+  } else if (!strcmp(command, "group")) {
+    if(count < 0) count = 200;
+    jgroup(path, count);
+    exit(0);
+  } else if (!strcmp(command, "compact")) {
+    if(count < 0) count = 400;
+    jcompact(path, count);
+    exit(0);
+  } else if (!strcmp(command, "fixed")) {
+    if(count < 0) count = 400;
+    jfixed(path, count);
+    exit(0);
+  } else if (!strcmp(command, "sparse")) {
+    if(count < 0) count = 400;
+    jsparse(path, count);
+    exit(0);
+  } else if (!strcmp(command, "set")) {
+    if(count < 0) count = 3000;
+    jset(path, count);
+    exit(0);
+  } else if (!strcmp(command, "recycle")) {
+    jrecycle(path);
+    exit(0);
   } else if (!strcmp(command, "resize_pre_commit")) {
     i++;
     size_t new_size = default_pre_commit_size;